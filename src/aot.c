@@ -0,0 +1,316 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "aot.h"
+#include "compiler.h"
+#include "memory.h"
+
+typedef struct {
+    ObjFunction** functions;
+    int count;
+    int capacity;
+} FunctionList;
+
+static void collectFunctions(FunctionList* list, ObjFunction* function){
+    // the order functions are numbered in, by both the emitter and aotMain:
+    // the functions nested in a function (in constant order) come before it
+    ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++){
+        if (IS_FUNCTION(constants->values[i])) collectFunctions(list, AS_FUNCTION(constants->values[i]));
+    }
+    if (list->count + 1 > list->capacity){
+        list->capacity = GROW_CAPACITY(list->capacity);
+        list->functions = (ObjFunction**)realloc(list->functions, sizeof(ObjFunction*) * list->capacity);
+        if (list->functions == NULL) exit(1);
+    }
+    list->functions[list->count++] = function;
+}
+
+
+// EMITTER
+
+static void emitString(FILE* out, const char* name, const char* text){
+    // text as a string literal, one line of it per line of C
+    fprintf(out, "static const char %s[] =\n    \"", name);
+    for (const unsigned char* c = (const unsigned char*)text; *c != '\0'; c++){
+        switch (*c){
+            case '\n':
+                fprintf(out, "\\n\"\n    \"");
+                break;
+            case '\\': fprintf(out, "\\\\"); break;
+            case '"':  fprintf(out, "\\\""); break;
+            case '?':  fprintf(out, "\\?"); break;    // no trigraphs
+            case '\t': fprintf(out, "\\t"); break;
+            default:
+                if (*c < ' ' || *c >= 0x7F){
+                    fprintf(out, "\\%03o", *c);
+                } else {
+                    fputc(*c, out);
+                }
+        }
+    }
+    fprintf(out, "\";\n\n");
+}
+
+static void emitConstant(FILE* out, Chunk* chunk, int index){
+    // numbers are written out, so that the C compiler can fold them
+    Value value = chunk->constants.values[index];
+    if (IS_NUMBER(value) && isfinite(AS_NUMBER(value))){
+        fprintf(out, "NUMBER_VAL(%a)", AS_NUMBER(value));
+    } else {
+        fprintf(out, "constants[%d]", index);
+    }
+}
+static void emitCache(FILE* out, uint8_t* operands){
+    uint16_t index = (uint16_t)(operands[0] << 8 | operands[1]);
+    if (index == NO_INLINE_CACHE){
+        fprintf(out, "NULL");
+    } else {
+        fprintf(out, "&caches[%d]", index);
+    }
+}
+
+static int operandAt(uint8_t* operand, int width){
+    int value = 0;
+    for (int i = 0; i < width; i++) value = value << 8 | operand[i];
+    return value;
+}
+
+static void emitInstruction(FILE* out, Chunk* chunk, int offset){
+    uint8_t* ip = chunk->code + offset;
+    int next = offset + instructionLength(chunk, offset);
+    int shortOperand = ip[1] << 8 | ip[2];
+    // the first operand as a constant or as a slot/count, in either width (chunk.h)
+    int constantWidth = isLongOpcode(*ip) ? 3 : 1;
+    int countWidth = isLongOpcode(*ip) ? 2 : 1;
+    int constant = operandAt(ip + 1, constantWidth);
+    int count = operandAt(ip + 1, countWidth);
+    switch (*ip){
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            fprintf(out, "AOT_PUSH(%d, ", offset);
+            emitConstant(out, chunk, constant);
+            fprintf(out, ");");
+            break;
+        case OP_NIL:       fprintf(out, "AOT_PUSH(%d, NIL_VAL());", offset); break;
+        case OP_TRUE:      fprintf(out, "AOT_PUSH(%d, BOOL_VAL(true));", offset); break;
+        case OP_FALSE:     fprintf(out, "AOT_PUSH(%d, BOOL_VAL(false));", offset); break;
+        case OP_DUPLICATE: fprintf(out, "AOT_PUSH(%d, top[%d]);", offset, -1 - ip[1]); break;
+        case OP_POP:       fprintf(out, "top--;"); break;
+        case OP_POPN:      fprintf(out, "top -= %d;", ip[1]); break;
+        case OP_POP_UNDER: fprintf(out, "top[%d] = top[-1]; top -= %d;", -1 - ip[1], ip[1]); break;
+
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG: fprintf(out, "AOT_STEP(jitDefineGlobal(constants[%d]));", constant); break;
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:    fprintf(out, "AOT_HELPER(%d, jitGetGlobal(constants[%d]));", next, constant); break;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:    fprintf(out, "AOT_HELPER(%d, jitSetGlobal(constants[%d]));", next, constant); break;
+        case OP_GET_GLOBAL_SLOT: fprintf(out, "AOT_GET_GLOBAL_SLOT(%d, %d);", offset, shortOperand); break;
+        case OP_SET_GLOBAL_SLOT: fprintf(out, "AOT_SET_GLOBAL_SLOT(%d, %d);", offset, shortOperand); break;
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:     fprintf(out, "AOT_PUSH(%d, slots[%d]);", offset, count); break;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG:     fprintf(out, "slots[%d] = top[-1];", count); break;
+        case OP_GET_UPVALUE:
+        case OP_GET_UPVALUE_LONG:   fprintf(out, "AOT_PUSH(%d, AOT_UPVALUE(%d));", offset, count); break;
+        case OP_SET_UPVALUE:
+        case OP_SET_UPVALUE_LONG:   fprintf(out, "AOT_UPVALUE(%d) = top[-1];", count); break;
+        case OP_GET_OUTER_LOCAL:
+        case OP_GET_OUTER_LOCAL_LONG:
+            fprintf(out, "AOT_PUSH(%d, AOT_OUTER_LOCAL(%d, %d));", offset, count, operandAt(ip + 1 + countWidth, countWidth));
+            break;
+        case OP_SET_OUTER_LOCAL:
+        case OP_SET_OUTER_LOCAL_LONG:
+            fprintf(out, "AOT_OUTER_LOCAL(%d, %d) = top[-1];", count, operandAt(ip + 1 + countWidth, countWidth));
+            break;
+        case OP_GET_STL:
+        case OP_GET_STL_LONG:       fprintf(out, "AOT_HELPER(%d, jitGetStl(constants[%d]));", next, constant); break;
+
+        case OP_EQUAL: fprintf(out, "AOT_EQUAL();"); break;
+        // the protocols of the comparisons are those the interpreter invokes
+        case OP_GREATER:
+        case OP_GREATER_NUM:  fprintf(out, "AOT_BINARY(%d, BOOL_VAL, >, PROTOCOL_LESS);", next); break;
+        case OP_LESS:
+        case OP_LESS_NUM:     fprintf(out, "AOT_BINARY(%d, BOOL_VAL, <, PROTOCOL_GREATER);", next); break;
+        case OP_ADD:
+        case OP_ADD_NUM:      fprintf(out, "AOT_BINARY(%d, NUMBER_VAL, +, PROTOCOL_ADD);", next); break;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM: fprintf(out, "AOT_BINARY(%d, NUMBER_VAL, -, PROTOCOL_SUBTRACT);", next); break;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM: fprintf(out, "AOT_BINARY(%d, NUMBER_VAL, *, PROTOCOL_MULTIPLY);", next); break;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM:   fprintf(out, "AOT_BINARY(%d, NUMBER_VAL, /, PROTOCOL_DIVIDE);", next); break;
+        case OP_NOT:    fprintf(out, "top[-1] = BOOL_VAL(isFalsey(top[-1]));"); break;
+        case OP_NEGATE: fprintf(out, "AOT_NEGATE(%d);", offset); break;
+
+        case OP_PRINT:         fprintf(out, "AOT_HELPER(%d, jitPrint());", next); break;
+        case OP_BUILD_STRING:
+        case OP_BUILD_STRING_LONG: fprintf(out, "AOT_HELPER(%d, jitBuildString(%d));", next, count); break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG: fprintf(out, "if (isFalsey(top[-1])) goto L%d;", jumpTarget(chunk, offset)); break;
+        case OP_JUMP:
+        case OP_JUMP_LONG:          fprintf(out, "goto L%d;", jumpTarget(chunk, offset)); break;
+        case OP_LOOP:
+        case OP_LOOP_LONG:          fprintf(out, "AOT_SAFEPOINT(%d); goto L%d;", next, jumpTarget(chunk, offset)); break;
+
+        case OP_CALL:
+        case OP_CALL_LONG:     fprintf(out, "AOT_HELPER(%d, jitCall(%d));", next, count); break;
+        case OP_CHECK_CALLEE:
+        case OP_CHECK_CALLEE_LONG:
+            fprintf(out, "if (valuesEqual(top[%d], constants[%d])) goto L%d;",
+                -1 - operandAt(ip + 1 + constantWidth, countWidth), constant, jumpTarget(chunk, offset));
+            break;
+        case OP_TAIL_CALL:
+        case OP_TAIL_CALL_LONG: fprintf(out, "AOT_TAIL_CALL(%d, %d);", next, count); break;
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:  fprintf(out, "AOT_STEP(jitClosure(function->chunk.code + %d));", offset); break;
+        case OP_CLOSE_UPVALUE: fprintf(out, "jitCloseUpvalues(top - 1); top--;"); break;
+        case OP_RETURN:        fprintf(out, "AOT_RETURN();"); break;
+
+        // a catch in this frame resumes it in the interpreter (see callJit)
+        case OP_THROW:    fprintf(out, "AOT_THROW(%d);", next); break;
+
+        case OP_CLASS:
+        case OP_CLASS_LONG: fprintf(out, "AOT_STEP(jitClass(constants[%d]));", constant); break;
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_LONG:
+            fprintf(out, *ip == OP_GET_PROPERTY || *ip == OP_GET_PROPERTY_LONG
+                    ? "AOT_GET_PROPERTY(%d, constants[%d], " : "AOT_SET_PROPERTY(%d, constants[%d], ", next, constant);
+            emitCache(out, ip + 1 + constantWidth);
+            fprintf(out, ");");
+            break;
+        case OP_METHOD:
+        case OP_METHOD_LONG:        fprintf(out, "AOT_STEP(jitMethod(constants[%d], false));", constant); break;
+        case OP_STATIC_METHOD:
+        case OP_STATIC_METHOD_LONG: fprintf(out, "AOT_STEP(jitMethod(constants[%d], true));", constant); break;
+        case OP_INVOKE:
+        case OP_INVOKE_LONG:
+            fprintf(out, "AOT_HELPER(%d, jitInvoke(constants[%d], %d, ", next, constant, operandAt(ip + 1 + constantWidth, countWidth));
+            emitCache(out, ip + 1 + constantWidth + countWidth);
+            fprintf(out, "));");
+            break;
+        case OP_INHERIT:          fprintf(out, "AOT_HELPER(%d, jitInherit(false));", next); break;
+        case OP_INHERIT_MULTIPLE: fprintf(out, "AOT_HELPER(%d, jitInherit(true));", next); break;
+        case OP_GET_SUPER:
+        case OP_GET_SUPER_LONG:   fprintf(out, "AOT_HELPER(%d, jitGetSuper(constants[%d]));", next, constant); break;
+        case OP_SUPER_INVOKE:
+        case OP_SUPER_INVOKE_LONG:
+            fprintf(out, "AOT_HELPER(%d, jitSuperInvoke(constants[%d], %d));", next, constant, operandAt(ip + 1 + constantWidth, countWidth));
+            break;
+
+        case OP_INDEX_GET:    fprintf(out, "AOT_HELPER(%d, jitIndexGet(%d));", next, ip[1]); break;
+        case OP_INDEX_SET:    fprintf(out, "AOT_HELPER(%d, jitIndexSet(%d));", next, ip[1]); break;
+        case OP_INDEX_UPDATE: fprintf(out, "AOT_HELPER(%d, jitIndexUpdate(%d));", next, ip[1]); break;
+
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+        case OP_LESS_LOCAL_CONSTANT:
+            fprintf(out, "AOT_BINARY_FUSED(%d, %d, slots[%d], ", offset, next, ip[1]);
+            emitConstant(out, chunk, ip[2]);
+            fprintf(out, *ip == OP_ADD_LOCAL_CONSTANT ? ", NUMBER_VAL, +, PROTOCOL_ADD);"
+                       : *ip == OP_SUBTRACT_LOCAL_CONSTANT ? ", NUMBER_VAL, -, PROTOCOL_SUBTRACT);"
+                       : ", BOOL_VAL, <, PROTOCOL_GREATER);");
+            break;
+        case OP_LESS_LOCAL_LOCAL:
+            fprintf(out, "AOT_BINARY_FUSED(%d, %d, slots[%d], slots[%d], BOOL_VAL, <, PROTOCOL_GREATER);",
+                    offset, next, ip[1], ip[2]);
+            break;
+        case OP_SET_LOCAL_POP: fprintf(out, "slots[%d] = *--top;", ip[1]); break;
+        case OP_JUMP_IF_FALSE_POP:
+            fprintf(out, "if (isFalsey(top[-1])) goto L%d; else top--;", jumpTarget(chunk, offset));
+            break;
+
+        default:
+            // unknown to the emitter: the interpreter finishes the frame
+            fprintf(out, "AOT_BAIL(%d);", offset);
+            break;
+    }
+}
+
+static void emitFunction(FILE* out, ObjFunction* function, int index){
+    Chunk* chunk = &function->chunk;
+    // labels only go on jump targets
+    bool* targets = (bool*)calloc(chunk->count + 1, sizeof(bool));
+    if (targets == NULL) exit(1);
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)){
+        int target = jumpTarget(chunk, offset);
+        if (target >= 0) targets[target] = true;
+    }
+
+    fprintf(out, "// %s\n", function->name == NULL ? "<script>" : function->name->chars);
+    fprintf(out, "static JitStatus aot%d(int frameIndex){\n", index);
+    fprintf(out, "    AOT_ENTER();\n");
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)){
+        if (targets[offset]) fprintf(out, "L%d:\n", offset);
+        fprintf(out, "    ");
+        emitInstruction(out, chunk, offset);
+        fprintf(out, "\n");
+    }
+    if (targets[chunk->count]) fprintf(out, "L%d:\n    AOT_BAIL(%d);\n", chunk->count, chunk->count);
+    fprintf(out, "}\n\n");
+    free(targets);
+}
+
+void emitC(ObjFunction* script, const char* source, const char* stl, FILE* out){
+    // prints script (compiled from source, after the STL) as a C program
+    FunctionList list = {NULL, 0, 0};
+    collectFunctions(&list, script);
+
+    fprintf(out, "// Generated by main --emit-c. Build it with the runtime (everything in src/ but main.c):\n");
+    fprintf(out, "//     gcc -O2 -Isrc out.c $(ls src/*.c | grep -v main.c) -o out -lm\n");
+    fprintf(out, "#include \"aot.h\"\n\n");
+    emitString(out, "source", source);
+    emitString(out, "stl", stl);
+    for (int i = 0; i < list.count; i++){
+        emitFunction(out, list.functions[i], i);
+    }
+    fprintf(out, "static const AotFunction functions[] = {\n");
+    for (int i = 0; i < list.count; i++){
+        fprintf(out, "    {aot%d, %d},\n", i, list.functions[i]->chunk.count);
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "int main(){\n");
+    fprintf(out, "    return aotMain(source, stl, %s, functions, sizeof(functions) / sizeof(functions[0]));\n",
+        vm.optimizeCode ? "true" : "false");
+    fprintf(out, "}\n");
+    free(list.functions);
+}
+
+
+// RUNTIME
+
+int aotMain(const char* source, const char* stl, bool optimize, const AotFunction* functions, int count){
+    // the bytecode is compiled again; it must be the bytecode the functions were generated from
+    stlSource = stl;
+    initVM();
+    vm.optimizeCode = optimize;
+    ObjFunction* script = compile(source, false);
+    if (script == NULL){
+        freeVM();
+        return 65;
+    }
+    FunctionList list = {NULL, 0, 0};
+    collectFunctions(&list, script);
+    bool matches = list.count == count;
+    for (int i = 0; matches && i < count; i++){
+        matches = list.functions[i]->chunk.count == functions[i].length;
+    }
+    if (!matches){
+        fprintf(stderr, "Generated code does not match the compiled script.\n");
+        free(list.functions);
+        freeVM();
+        return 70;
+    }
+    for (int i = 0; i < count; i++){
+        // jitSize stays 0: this code is not the JIT's to free
+        list.functions[i]->jitCode = (void*)functions[i].code;
+    }
+    free(list.functions);
+
+    InterpreterResult result = interpretFunction(script);
+    freeVM();
+    return result == INTERPRETER_OK ? 0 : 70;
+}
@@ -0,0 +1,186 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "jit.h"
+#include "object.h"
+#include "vm.h"
+
+// Ahead-of-time compilation: --emit-c prints a script as a C program.
+// Every Lox function becomes a C function with the native code contract of jit.h, built from the
+// macros below, one per instruction. The program embeds the source of the script and the STL:
+// aotMain compiles them again on startup, then hands each function its C code before the script runs.
+// Functions are matched up by their position in a walk of the function tree (nested functions
+// first, the script last) and checked against the length of the bytecode they came from.
+
+typedef struct {
+    JitCode code;
+    int length;      // bytecode length of the function the code was generated from
+} AotFunction;
+
+void emitC(ObjFunction* script, const char* source, const char* stl, FILE* out);
+// runs a program printed by emitC; returns its exit code
+// (optimize: whether the script was compiled with the peephole optimizer)
+int aotMain(const char* source, const char* stl, bool optimize, const AotFunction* functions, int count);
+
+
+// Generated code
+// The stack top and frame slots are kept in locals, written back before every helper call
+// and reloaded after it (the stack may have moved). Helpers that return false threw an exception,
+// which the function passes on by returning JIT_THREW. A guard that fails bails out: the frame
+// is finished by the interpreter, starting over at the instruction (as in the JIT).
+
+#define AOT_ENTER() \
+    ObjFunction* function = getFrameFunction(&vm.frames[frameIndex]); \
+    Obj* callee = vm.frames[frameIndex].function; \
+    Value* constants = function->chunk.constants.values; \
+    InlineCache* caches = function->chunk.caches; \
+    Value* top; \
+    Value* slots; \
+    (void)callee; \
+    (void)constants; \
+    (void)caches; \
+    AOT_RELOAD()
+
+#define AOT_SYNC()        (vm.stackTop = top)
+#define AOT_RELOAD()      (top = vm.stackTop, slots = vm.frames[frameIndex].slots)
+#define AOT_SAVE_IP(at)   (vm.frames[frameIndex].ip = function->chunk.code + (at))
+#define AOT_UPVALUE(slot) (*((ObjClosure*)callee)->upvalues[slot]->location)
+#define AOT_OUTER_LOCAL(upvalue, slot) (*outerLocal((ObjClosure*)callee, upvalue, slot))
+
+#define AOT_BAIL(offset) \
+    do { \
+        AOT_SAVE_IP(offset); \
+        AOT_SYNC(); \
+        return jitResume(frameIndex) ? JIT_RETURNED : JIT_THREW; \
+    } while (false)
+// a helper that cannot throw
+#define AOT_STEP(call) \
+    do { \
+        AOT_SYNC(); \
+        call; \
+        AOT_RELOAD(); \
+    } while (false)
+// a helper that performs the whole instruction; ip is saved past it, as the interpreter does
+#define AOT_HELPER(next, call) \
+    do { \
+        AOT_SAVE_IP(next); \
+        AOT_SYNC(); \
+        if (!(call)) return JIT_THREW; \
+        AOT_RELOAD(); \
+    } while (false)
+// bails out if the stack has to grow; value is read before top moves, as it may be top[-n]
+#define AOT_PUSH(offset, value) \
+    do { \
+        if (top == vm.stackEnd) AOT_BAIL(offset); \
+        Value aotPushed = (value); \
+        *top++ = aotPushed; \
+    } while (false)
+
+#define AOT_GET_GLOBAL_SLOT(offset, index) \
+    do { \
+        GlobalSlot* aotSlot = &vm.globalSlots[index]; \
+        Value aotValue = IS_EMPTY(aotSlot->value) ? aotSlot->stl : aotSlot->value; \
+        if (IS_EMPTY(aotValue)) AOT_BAIL(offset); \
+        AOT_PUSH(offset, aotValue); \
+    } while (false)
+#define AOT_SET_GLOBAL_SLOT(offset, index) \
+    do { \
+        if (IS_EMPTY(vm.globalSlots[index].value)) AOT_BAIL(offset); \
+        vm.globalSlots[index].value = top[-1]; \
+    } while (false)
+
+#define AOT_EQUAL() \
+    do { \
+        top[-2] = BOOL_VAL(valuesEqual(top[-2], top[-1])); \
+        top--; \
+    } while (false)
+// operands that are not both numbers go through operator overloading
+#define AOT_BINARY(next, valueType, op, protocol) \
+    do { \
+        if (IS_NUMBER(top[-2]) && IS_NUMBER(top[-1])){ \
+            top[-2] = valueType(AS_NUMBER(top[-2]) op AS_NUMBER(top[-1])); \
+            top--; \
+        } else { \
+            AOT_HELPER(next, jitOperator(protocol)); \
+        } \
+    } while (false)
+// a superinstruction's operator on a local and a constant or second local (a and b, in C)
+// bails out if both operands may have to be pushed and the stack has to grow
+#define AOT_BINARY_FUSED(offset, next, a, b, valueType, op, protocol) \
+    do { \
+        Value aotLeft = (a); \
+        Value aotRight = (b); \
+        if (top + 2 > vm.stackEnd) AOT_BAIL(offset); \
+        if (IS_NUMBER(aotLeft) && IS_NUMBER(aotRight)){ \
+            *top++ = valueType(AS_NUMBER(aotLeft) op AS_NUMBER(aotRight)); \
+        } else { \
+            *top++ = aotLeft; \
+            *top++ = aotRight; \
+            AOT_HELPER(next, jitOperator(protocol)); \
+        } \
+    } while (false)
+#define AOT_NEGATE(offset) \
+    do { \
+        if (!IS_NUMBER(top[-1])) AOT_BAIL(offset); \
+        top[-1] = NUMBER_VAL(-AS_NUMBER(top[-1])); \
+    } while (false)
+
+// OP_LOOP checks in with the host when the budget runs out
+#define AOT_SAFEPOINT(next) \
+    do { \
+        if (--vm.budget == 0) AOT_HELPER(next, jitSafepoint()); \
+    } while (false)
+// anything but JIT_RETURNED ends the function with the same status
+#define AOT_TAIL_CALL(next, argCount) \
+    do { \
+        AOT_SAVE_IP(next); \
+        AOT_SYNC(); \
+        JitStatus aotStatus = jitTailCall(argCount); \
+        if (aotStatus != JIT_RETURNED) return aotStatus; \
+        AOT_RELOAD(); \
+    } while (false)
+// the result replaces the callee; the frame is popped
+#define AOT_RETURN() \
+    do { \
+        if (vm.openUpvalues != NULL) jitCloseUpvalues(slots); \
+        slots[0] = top[-1]; \
+        vm.stackTop = slots + 1; \
+        vm.frameCount--; \
+        return JIT_RETURNED; \
+    } while (false)
+#define AOT_THROW(next) \
+    do { \
+        AOT_SAVE_IP(next); \
+        AOT_SYNC(); \
+        jitThrow(); \
+        return JIT_THREW; \
+    } while (false)
+
+// fields found through the inline cache are read and written in place
+#define AOT_GET_PROPERTY(next, name, cache) \
+    do { \
+        InlineCache* aotCache = (cache); \
+        if (aotCache != NULL && IS_INSTANCE(top[-1]) && aotCache->slot >= 0 \
+                && (Obj*)AS_INSTANCE(top[-1])->shape == aotCache->shape){ \
+            top[-1] = AS_INSTANCE(top[-1])->fields[aotCache->slot]; \
+        } else { \
+            AOT_HELPER(next, jitGetProperty(name, aotCache)); \
+        } \
+    } while (false)
+#define AOT_SET_PROPERTY(next, name, cache) \
+    do { \
+        InlineCache* aotCache = (cache); \
+        if (aotCache != NULL && IS_INSTANCE(top[-2]) && aotCache->slot >= 0 \
+                && (Obj*)AS_INSTANCE(top[-2])->shape == aotCache->shape){ \
+            AS_INSTANCE(top[-2])->fields[aotCache->slot] = top[-1]; \
+            top[-2] = top[-1]; \
+            top--; \
+        } else { \
+            AOT_HELPER(next, jitSetProperty(name, aotCache)); \
+        } \
+    } while (false)
+
+#endif
@@ -2,6 +2,7 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
 
 
@@ -13,10 +14,22 @@ void initChunk(Chunk* chunk){
     chunk->lineCount = 0;
     chunk->lineCapacity = 0;
     chunk->lines = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
+    chunk->handlerCount = 0;
+    chunk->handlerCapacity = 0;
+    chunk->handlers = NULL;
+    chunk->inlinedCount = 0;
+    chunk->inlinedCapacity = 0;
+    chunk->inlined = NULL;
 }
 void freeChunk(Chunk* chunk){
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int,  chunk->lines, chunk->lineCapacity);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
+    FREE_ARRAY(ExceptionHandler, chunk->handlers, chunk->handlerCapacity);
+    FREE_ARRAY(InlinedCall, chunk->inlined, chunk->inlinedCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
@@ -45,6 +58,13 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line){
     lineStart->offset = chunk->count - 1;
     lineStart->line = line;
 }
+void truncateChunk(Chunk* chunk, int count){
+    // drops the bytes from offset count on, along with line information that starts among them
+    chunk->count = count;
+    while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= count){
+        chunk->lineCount--;
+    }
+}
 int addConstant(Chunk* chunk, Value value){
     // writes a constant to the constants array
     // returns its array index
@@ -53,6 +73,51 @@ int addConstant(Chunk* chunk, Value value){
     pop();
     return chunk->constants.count - 1;
 }
+int addInlineCache(Chunk* chunk, int offset){
+    // reserves an empty inline cache for the instruction at offset
+    // returns its index, or NO_INLINE_CACHE if the chunk has run out of indices
+    if (chunk->cacheCount == NO_INLINE_CACHE) return NO_INLINE_CACHE;
+    if (chunk->cacheCount + 1 > chunk->cacheCapacity){
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+    InlineCache* cache = &chunk->caches[chunk->cacheCount];
+    cache->offset = offset;
+    cache->count = 0;
+    cache->epoch = 0;
+    cache->shape = NULL;
+    cache->transition = NULL;
+    cache->slot = -1;
+    return chunk->cacheCount++;
+}
+void addHandler(Chunk* chunk, int start, int end, int handler, int depth){
+    // guards [start, end) with the catch block at handler
+    // try blocks finish inside out, so the innermost one that covers an offset comes first
+    if (chunk->handlerCount + 1 > chunk->handlerCapacity){
+        int oldCapacity = chunk->handlerCapacity;
+        chunk->handlerCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->handlers = GROW_ARRAY(ExceptionHandler, chunk->handlers, oldCapacity, chunk->handlerCapacity);
+    }
+    ExceptionHandler* entry = &chunk->handlers[chunk->handlerCount++];
+    entry->start = start;
+    entry->end = end;
+    entry->handler = handler;
+    entry->depth = depth;
+}
+void addInlinedCall(Chunk* chunk, int start, int end, int function, int line){
+    // a body copied into another finishes after the bodies copied into it, which come first
+    if (chunk->inlinedCount + 1 > chunk->inlinedCapacity){
+        int oldCapacity = chunk->inlinedCapacity;
+        chunk->inlinedCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->inlined = GROW_ARRAY(InlinedCall, chunk->inlined, oldCapacity, chunk->inlinedCapacity);
+    }
+    InlinedCall* entry = &chunk->inlined[chunk->inlinedCount++];
+    entry->start = start;
+    entry->end = end;
+    entry->function = function;
+    entry->line = line;
+}
 int getLine(Chunk* chunk, size_t instruction){
     int start = 0;
     int end = chunk->lineCount - 1;
@@ -68,4 +133,145 @@ int getLine(Chunk* chunk, size_t instruction){
             start = mid + 1;
         }
     }
-}
\ No newline at end of file
+}
+
+// chosen from opcode pair counts (--profile): longer sequences go first
+const Superinstruction superinstructions[] = {
+    {OP_ADD_LOCAL_CONSTANT,      3, {OP_GET_LOCAL, OP_CONSTANT, OP_ADD}},
+    {OP_SUBTRACT_LOCAL_CONSTANT, 3, {OP_GET_LOCAL, OP_CONSTANT, OP_SUBTRACT}},
+    {OP_LESS_LOCAL_CONSTANT,     3, {OP_GET_LOCAL, OP_CONSTANT, OP_LESS}},
+    {OP_LESS_LOCAL_LOCAL,        3, {OP_GET_LOCAL, OP_GET_LOCAL, OP_LESS}},
+    {OP_SET_LOCAL_POP,           2, {OP_SET_LOCAL, OP_POP}},
+    {OP_JUMP_IF_FALSE_POP,       2, {OP_JUMP_IF_FALSE, OP_POP}},
+};
+const int superinstructionCount = sizeof(superinstructions) / sizeof(superinstructions[0]);
+
+const Superinstruction* findSuperinstruction(uint8_t opcode){
+    for (int i = 0; i < superinstructionCount; i++){
+        if (superinstructions[i].opcode == opcode) return &superinstructions[i];
+    }
+    return NULL;
+}
+
+int instructionLength(Chunk* chunk, int offset){
+    // returns the length in bytes of the instruction at offset, operands included
+    uint8_t* code = chunk->code + offset;
+    if (*code == OP_CLOSURE){
+        // followed by an (UpvalueKind, index) pair for every upvalue
+        ObjFunction* function = AS_FUNCTION(chunk->constants.values[code[1]]);
+        return 2 + 2 * function->upvalueCount;
+    }
+    if (*code == OP_CLOSURE_LONG){
+        // the constant and every index are wide
+        ObjFunction* function = AS_FUNCTION(chunk->constants.values[code[1] << 16 | code[2] << 8 | code[3]]);
+        return 4 + 3 * function->upvalueCount;
+    }
+    return opcodeLength(chunk->code[offset]);
+}
+int opcodeLength(uint8_t opcode){
+    switch (opcode){
+        case OP_CONSTANT:
+        case OP_DUPLICATE:
+        case OP_POPN:
+        case OP_POP_UNDER:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_STL:
+        case OP_BUILD_STRING:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_STATIC_METHOD:
+        case OP_GET_SUPER:
+        case OP_INDEX_GET:
+        case OP_INDEX_SET:
+        case OP_INDEX_UPDATE:
+            return 2;
+        case OP_GET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_SUPER_INVOKE:
+        case OP_GET_OUTER_LOCAL:
+        case OP_SET_OUTER_LOCAL:
+            return 3;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return 4;
+        case OP_INVOKE:
+        case OP_CHECK_CALLEE:
+            return 5;
+
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_UPVALUE_LONG:
+        case OP_SET_UPVALUE_LONG:
+        case OP_BUILD_STRING_LONG:
+        case OP_CALL_LONG:
+        case OP_TAIL_CALL_LONG:
+            return 3;
+        case OP_CONSTANT_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_GET_STL_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_JUMP_LONG:
+        case OP_LOOP_LONG:
+        case OP_CLASS_LONG:
+        case OP_METHOD_LONG:
+        case OP_STATIC_METHOD_LONG:
+        case OP_GET_SUPER_LONG:
+            return 4;
+        case OP_GET_OUTER_LOCAL_LONG:
+        case OP_SET_OUTER_LOCAL_LONG:
+            return 5;
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY_LONG:
+        case OP_SUPER_INVOKE_LONG:
+            return 6;
+        case OP_INVOKE_LONG:
+        case OP_CHECK_CALLEE_LONG:
+            return 8;
+        default: {
+            // a superinstruction takes the operands of its parts
+            const Superinstruction* fused = findSuperinstruction(opcode);
+            if (fused == NULL) return 1;
+            int length = 1;
+            for (int i = 0; i < fused->partCount; i++){
+                length += opcodeLength(fused->parts[i]) - 1;
+            }
+            return length;
+        }
+    }
+}
+int jumpTarget(Chunk* chunk, int offset){
+    uint8_t* code = chunk->code + offset;
+    int next = offset + opcodeLength(*code);
+    switch (*code){
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_POP:
+            return next + (code[1] << 8 | code[2]);
+        case OP_LOOP:
+            return next - (code[1] << 8 | code[2]);
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+            return next + (code[1] << 16 | code[2] << 8 | code[3]);
+        case OP_LOOP_LONG:
+            return next - (code[1] << 16 | code[2] << 8 | code[3]);
+        case OP_CHECK_CALLEE:
+        case OP_CHECK_CALLEE_LONG:
+            // the jump operand comes last, after the function and the argument count
+            return next + (chunk->code[next - 2] << 8 | chunk->code[next - 1]);
+        default:
+            return -1;
+    }
+}
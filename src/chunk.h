@@ -7,23 +7,42 @@
 // Contains all declarations regarding the Chunk class
 // as well as the enum OpCode for bytecode
 
+// Instructions with a constant, slot, count or jump operand have a LONG variant right after them,
+// whose operands are wide: constants take three bytes, slots and counts two, jumps three.
+// The compiler only emits it when an operand does not fit (see emitConstant).
 typedef enum {
     OP_CONSTANT,
+    OP_CONSTANT_LONG,
     OP_NIL,
     OP_TRUE,
     OP_FALSE,
     OP_DUPLICATE,
     OP_POP,
     OP_POPN,
+    OP_POP_UNDER,
 
     OP_DEFINE_GLOBAL,
+    OP_DEFINE_GLOBAL_LONG,
     OP_GET_GLOBAL,
+    OP_GET_GLOBAL_LONG,
     OP_SET_GLOBAL,
+    OP_SET_GLOBAL_LONG,
+    OP_GET_GLOBAL_SLOT,
+    OP_SET_GLOBAL_SLOT,
     OP_GET_LOCAL,
+    OP_GET_LOCAL_LONG,
     OP_SET_LOCAL,
+    OP_SET_LOCAL_LONG,
     OP_GET_UPVALUE,
+    OP_GET_UPVALUE_LONG,
     OP_SET_UPVALUE,
+    OP_SET_UPVALUE_LONG,
+    OP_GET_OUTER_LOCAL,
+    OP_GET_OUTER_LOCAL_LONG,
+    OP_SET_OUTER_LOCAL,
+    OP_SET_OUTER_LOCAL_LONG,
     OP_GET_STL,
+    OP_GET_STL_LONG,
 
     OP_EQUAL,
     OP_GREATER,
@@ -35,36 +54,177 @@ typedef enum {
     OP_NOT,
     OP_NEGATE,
 
+    // quickened variants: never emitted by the compiler,
+    // the VM rewrites the generic opcode in place after it sees two numbers
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+
     OP_PRINT,
+    OP_BUILD_STRING,
+    OP_BUILD_STRING_LONG,
     OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_FALSE_LONG,
     OP_JUMP,
+    OP_JUMP_LONG,
     OP_LOOP,
+    OP_LOOP_LONG,
 
     OP_CALL,
+    OP_CALL_LONG,
+    OP_TAIL_CALL,
+    OP_TAIL_CALL_LONG,
+    OP_CHECK_CALLEE,
+    OP_CHECK_CALLEE_LONG,
     OP_CLOSURE,
+    OP_CLOSURE_LONG,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
 
-    OP_TRY_CALL,
     OP_THROW,
 
     OP_CLASS,
+    OP_CLASS_LONG,
     OP_GET_PROPERTY,
+    OP_GET_PROPERTY_LONG,
     OP_SET_PROPERTY,
+    OP_SET_PROPERTY_LONG,
     OP_METHOD,
+    OP_METHOD_LONG,
     OP_STATIC_METHOD,
+    OP_STATIC_METHOD_LONG,
     OP_INVOKE,
+    OP_INVOKE_LONG,
     OP_INHERIT,
     OP_INHERIT_MULTIPLE,
     OP_GET_SUPER,
-    OP_SUPER_INVOKE
+    OP_GET_SUPER_LONG,
+    OP_SUPER_INVOKE,
+    OP_SUPER_INVOKE_LONG,
+
+    OP_INDEX_GET,
+    OP_INDEX_SET,
+    OP_INDEX_UPDATE,
+
+    // superinstructions: fused by the compiler from the sequences in the table below
+    OP_ADD_LOCAL_CONSTANT,
+    OP_SUBTRACT_LOCAL_CONSTANT,
+    OP_LESS_LOCAL_CONSTANT,
+    OP_LESS_LOCAL_LOCAL,
+    OP_SET_LOCAL_POP,
+    OP_JUMP_IF_FALSE_POP
 } Opcode;
 
+static inline bool isLongOpcode(Opcode op){
+    switch (op){
+        case OP_CONSTANT_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_UPVALUE_LONG:
+        case OP_SET_UPVALUE_LONG:
+        case OP_GET_OUTER_LOCAL_LONG:
+        case OP_SET_OUTER_LOCAL_LONG:
+        case OP_GET_STL_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_JUMP_LONG:
+        case OP_LOOP_LONG:
+        case OP_BUILD_STRING_LONG:
+        case OP_CALL_LONG:
+        case OP_TAIL_CALL_LONG:
+        case OP_CHECK_CALLEE_LONG:
+        case OP_CLOSURE_LONG:
+        case OP_CLASS_LONG:
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY_LONG:
+        case OP_METHOD_LONG:
+        case OP_STATIC_METHOD_LONG:
+        case OP_INVOKE_LONG:
+        case OP_GET_SUPER_LONG:
+        case OP_SUPER_INVOKE_LONG:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// How OP_CLOSURE gets each upvalue: the byte before its index.
+// A closure is only created in place when the compiler knows the call it is made for (see emitInPlace),
+// and then every one of its upvalues is a local of the frame.
+typedef enum {
+    UPVALUE_INHERITED,      // an upvalue of the enclosing closure
+    UPVALUE_LOCAL,          // a local of the frame, captured
+    UPVALUE_IN_PLACE,       // a local of the frame, read in place: the closure is called right away
+    UPVALUE_IN_PLACE_ARRAY  // read in place if the closure is passed to an array (Array.map, filter or reduce)
+} UpvalueKind;
+
+// Superinstructions replace frequent sequences of instructions (see fuseSuperinstructions in optimizer.h).
+// A fused instruction is followed by the operands of its parts, in order, and does exactly what they do.
+// Adding one takes a row in superinstructions (chunk.c), an opcode above and a handler in vm.c;
+// without templates in jit.c and aot.c, native code hands it to the interpreter. A jump may only be the first part.
+#define SUPERINSTRUCTION_PARTS_MAX 3
+typedef struct {
+    Opcode opcode;
+    int partCount;
+    int parts[SUPERINSTRUCTION_PARTS_MAX];       // opcodes, as int like the optimizer reads them
+} Superinstruction;
+
+extern const Superinstruction superinstructions[];
+extern const int superinstructionCount;
+
 typedef struct {
     int offset;
     int line;
 } LineStart;
 
+// Inline caches for OP_GET_PROPERTY, OP_SET_PROPERTY and OP_INVOKE
+// Each cache remembers the receiver classes last seen at one instruction (up to INLINE_CACHE_WAYS)
+// and the method each of them resolved to.
+// If more classes than that are seen, the cache goes megamorphic and is bypassed.
+// Method ways are flushed whenever vm.cacheEpoch changes (any class gains or copies down methods).
+// Field accesses on instances cache the last shape seen and its slot for the field (-1 if absent);
+// shapes never change, so these are not flushed.
+#define INLINE_CACHE_WAYS 4
+#define INLINE_CACHE_MEGAMORPHIC -1
+#define NO_INLINE_CACHE UINT16_MAX
+
+typedef struct {
+    Obj* klass;
+    Value method;
+} InlineCacheWay;
+typedef struct {
+    int offset;         // offset of the owning instruction
+    int count;          // ways in use, or INLINE_CACHE_MEGAMORPHIC
+    uint32_t epoch;
+    InlineCacheWay ways[INLINE_CACHE_WAYS];
+    Obj* shape;         // shape of the last instance seen
+    Obj* transition;    // shape that adding the field moves it to (OP_SET_PROPERTY only)
+    int slot;
+} InlineCache;
+
+// code in [start, end) is guarded by a try block: an exception thrown there
+// resumes at handler, with the stack cut back to depth slots above the frame
+typedef struct {
+    int start;
+    int end;
+    int handler;
+    int depth;
+} ExceptionHandler;
+
+// code in [start, end) is the body of the function in constant function, copied into a call
+// made on line (compiler.c, inlineCall); runtime errors report it as a frame of its own
+typedef struct {
+    int start;
+    int end;
+    int function;
+    int line;
+} InlinedCall;
+
 typedef struct {
     int count;
     int capacity;
@@ -73,13 +233,33 @@ typedef struct {
     int lineCount;
     int lineCapacity;
     LineStart* lines;
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache* caches;
+    int handlerCount;
+    int handlerCapacity;
+    ExceptionHandler* handlers;     // innermost try blocks first
+    int inlinedCount;
+    int inlinedCapacity;
+    InlinedCall* inlined;           // innermost calls first
 } Chunk;
     
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void truncateChunk(Chunk* chunk, int count);
 int addConstant(Chunk* chunk, Value value);
+int addInlineCache(Chunk* chunk, int offset);
+void addHandler(Chunk* chunk, int start, int end, int handler, int depth);
+void addInlinedCall(Chunk* chunk, int start, int end, int function, int line);
 int getLine(Chunk* chunk, size_t offset);
+int instructionLength(Chunk* chunk, int offset);
+// length of an instruction with a fixed length (anything but OP_CLOSURE and OP_CLOSURE_LONG)
+int opcodeLength(uint8_t opcode);
+// the offset that the jump instruction at offset lands on (OP_JUMP, OP_JUMP_IF_FALSE(_POP), OP_LOOP, OP_CHECK_CALLEE and LONG variants)
+int jumpTarget(Chunk* chunk, int offset);
+// the parts of a superinstruction, or NULL
+const Superinstruction* findSuperinstruction(uint8_t opcode);
 
 #endif
\ No newline at end of file
@@ -8,12 +8,11 @@
 #include <stdint.h>
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+#define UINT24_MAX 0xffffff
 
 // VM FLAGS (can enable/disable)
 
-#define DEBUG_TRACE_EXECUTION
-#define DEBUG_PRINT_CODE
-
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 
@@ -22,4 +21,20 @@
 
 // #define IS_FALSEY_EXTENDED
 
+// Threaded dispatch uses computed gotos (labels-as-values), a GCC/Clang extension.
+// Define VM_SWITCH_DISPATCH to force the portable switch-based dispatch loop instead.
+// #define VM_SWITCH_DISPATCH
+
+#if !defined(VM_SWITCH_DISPATCH) && (defined(__GNUC__) || defined(__clang__))
+#define VM_COMPUTED_GOTO
+#endif
+
+// The baseline JIT compiles hot functions to x86-64 machine code. It needs Linux (mmap)
+// and NaN boxing. Define VM_NO_JIT to build without it; --no-jit turns it off at runtime.
+// #define VM_NO_JIT
+
+#if !defined(VM_NO_JIT) && defined(VALUE_NAN_BOXING) && defined(__x86_64__) && defined(__linux__)
+#define VM_JIT
+#endif
+
 #endif
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include "debug.h"
 #include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 
 // PRIVATE FUNCTIONS
@@ -24,6 +25,7 @@ typedef struct {
     Token name;
     int depth;
     bool isCaptured;
+    int inlineBody;     // the function it was declared with, if calls of it may be inlined (see inlineCall); -1 otherwise
 } Local;
 typedef enum {
     TYPE_SCRIPT,
@@ -31,12 +33,11 @@ typedef enum {
     TYPE_LAMBDA,
     TYPE_METHOD,
     TYPE_INITIALIZER,
-    TYPE_STATIC_METHOD,
-    TYPE_TRY_BLOCK
+    TYPE_STATIC_METHOD
 } FunctionType;
 
 typedef struct {
-    uint8_t index;
+    uint16_t index;
     bool isLocal;
 } Upvalue;
 
@@ -44,7 +45,9 @@ typedef struct {
 // A loop needs to keep track of its starting position for continue
 // and all the indexes for jump operations to backpatch for break
 // this includes the for condition (if exists)
-// LoopInfo owns its endpatches array.
+// A for loop with an increment has its increment after the body: loopStart is -1,
+// and continue jumps forward, to be backpatched like break
+// LoopInfo owns its endpatches and continuepatches arrays.
 // It is never dynamically allocated, and instead created whenever a loop is created
 // and deleted (out of scope) once the loop finishes compiling
 typedef struct LoopInfo {
@@ -54,6 +57,7 @@ typedef struct LoopInfo {
     int innerVariable;
     struct LoopInfo* enclosing;
     ValueArray endpatches;
+    ValueArray continuepatches;
 } LoopInfo;
 
 
@@ -64,13 +68,26 @@ typedef struct Compiler {
     LoopInfo* loop;
 
     struct Compiler* enclosing;
-
-    Local locals[UINT8_COUNT];
+    int lastCall;        // offset of the most recent OP_CALL (-1 if none)
+    int lastProperty;    // offset of the most recent OP_GET_PROPERTY (-1 if none, or if a jump lands after it)
+    int tryDepth;        // number of try blocks around the code being compiled
+    int lastClosure;     // offset of the most recent OP_CLOSURE that may be created in place (-1 if none)
+    bool lambdaInPlace;  // the lambda about to be compiled is called or passed to an array right away
+    bool inPlace;        // a lambda that may be created in place: reads the locals it captures with OP_GET_OUTER_LOCAL
+    int lastFunction;    // offset of the most recent push of a function whose calls may be inlined (-1 if none)
+    int functionBody;    // ... and its body in inlineBodies
+    int inlineBody;      // this function's own body in inlineBodies, once it is compiled (-1 if it is not inlined)
+
+    // up to UINT16_COUNT of each; slots and indices past a byte take LONG instructions
+    Local* locals;
     int localCount;
+    int localCapacity;
     int scopeDepth;
-    Upvalue upvalues[UINT8_COUNT];
+    Upvalue* upvalues;
+    int upvalueCapacity;
 
     HashTable existingConstants;
+    ValueArray farJumps;    // (offset, target) of every forward jump too long for its operand
 } Compiler;
 
 // All logic for handling this struct is in classDeclaration
@@ -84,6 +101,19 @@ typedef struct ClassCompiler {
     SuperclassType type;
 } ClassCompiler;
 
+// A small function whose calls are compiled as a copy of its body (see inlineCall).
+// The copy is taken before endCompiler optimizes the function, so it is code as the compiler emits it.
+#define INLINE_LENGTH_MAX 32    // bytes, up to the first OP_RETURN
+typedef struct {
+    ObjFunction* function;      // (a constant of the chunk it was declared in, so it outlives the compiler)
+    uint8_t* code;
+    int* lines;                 // the line of every byte of code
+    int length;
+    InlinedCall* inlined;       // the bodies copied into it, as in its chunk
+    int inlinedCount;
+    int global;                 // the global slot it is bound to, or -1
+} InlineBody;
+
 
 typedef enum {
     PREC_NONE,
@@ -117,6 +147,10 @@ typedef struct {
 Parser parser;
 Compiler* current;
 ClassCompiler* currentClass;
+// bodies of the functions compiled so far that may be inlined, freed once compile() is done
+InlineBody* inlineBodies;
+int inlineCount;
+int inlineCapacity;
 
 static Chunk* currentChunk(){
     return &current->function->chunk;
@@ -232,23 +266,76 @@ static void emitBytes(uint8_t byte1, uint8_t byte2){
     emitByte(byte1);
     emitByte(byte2);
 }
-static uint8_t makeConstant(Value value){
-    // stores the value in the current chunk's constants array, returns its index as a byte
+static void emitShort(int operand){
+    emitBytes((operand >> 8) & 0xff, operand & 0xff);
+}
+static void emitLong(int operand){
+    emitByte((operand >> 16) & 0xff);
+    emitShort(operand);
+}
+static int makeConstant(Value value){
+    // stores the value in the current chunk's constants array, returns its index
     // if identifier already exists, return that instead
     Value idx;
     if (tableGet(&current->existingConstants, value, &idx))
-        return (uint8_t)AS_NUMBER(idx);
+        return (int)AS_NUMBER(idx);
     
     int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX){
+    if (constant > UINT24_MAX){
         error("Too many constants in one chunk.");
         return 0;
     }
     tableSet(&current->existingConstants, value, NUMBER_VAL(constant));
-    return (uint8_t)constant;
+    return constant;
+}
+static void emitConstant(Opcode instruction, int constant){
+    // constants past a byte take the LONG variant, right after instruction
+    if (constant <= UINT8_MAX){
+        emitBytes(instruction, (uint8_t)constant);
+    } else {
+        emitByte(instruction + 1);
+        emitLong(constant);
+    }
+}
+static void emitCount(Opcode instruction, int count){
+    // emits an instruction with a count (or slot) operand, LONG past a byte
+    if (count <= UINT8_MAX){
+        emitBytes(instruction, (uint8_t)count);
+    } else {
+        emitByte(instruction + 1);
+        emitShort(count);
+    }
+}
+static void emitInlineCache(int offset){
+    // reserves an inline cache for the instruction at offset and emits its index as a two-byte operand
+    emitShort(addInlineCache(currentChunk(), offset));
+}
+static void emitNameAndCount(Opcode instruction, int name, int argCount){
+    // OP_INVOKE and OP_SUPER_INVOKE: LONG if either operand does not fit in a byte
+    if (name <= UINT8_MAX && argCount <= UINT8_MAX){
+        emitBytes(instruction, (uint8_t)name);
+        emitByte((uint8_t)argCount);
+    } else {
+        emitByte(instruction + 1);
+        emitLong(name);
+        emitShort(argCount);
+    }
+}
+static void emitInvoke(int name, int argCount){
+    int offset = currentChunk()->count;
+    emitNameAndCount(OP_INVOKE, name, argCount);
+    emitInlineCache(offset);
+}
+static int emitCheckCallee(int function, int argCount){
+    // emits OP_CHECK_CALLEE with a jump to patch later, like emitJump
+    emitNameAndCount(OP_CHECK_CALLEE, function, argCount);
+    emitByte(0xff);
+    emitByte(0xff);
+    return currentChunk()->count - 2;
 }
-static void emitConstant(Opcode instruction, uint8_t operand){
-    emitBytes(instruction, operand);
+static void emitCall(int argCount){
+    current->lastCall = currentChunk()->count;
+    emitCount(OP_CALL, argCount);
 }
 static void emitReturn(){
     // if initializer, return 'this' on reserved slot 0
@@ -270,24 +357,37 @@ static int emitJump(uint8_t instruction){
 static void patchJump(int offset){
     // -2 adjusts for the bytecode offset of the JUMP operand
     int jump = currentChunk()->count - offset - 2;
-    if (jump > UINT16_MAX){
+    if (jump > UINT24_MAX){
         error("Too much bytecode to jump over.");
+    } else if (jump > UINT16_MAX){
+        // the operand keeps its placeholder; endCompiler widens the jump (widenJumps)
+        writeValueArray(&current->farJumps, NUMBER_VAL(offset - 1));
+        writeValueArray(&current->farJumps, NUMBER_VAL(currentChunk()->count));
+        jump = UINT16_MAX;
     }
     currentChunk()->code[offset] = (jump >> 8) & 0xff;
     currentChunk()->code[offset + 1] = jump & 0xff;
+    // the end of the chunk is now a jump target, which later rewrites must keep in place
+    current->lastProperty = -1;
 }
 static void emitLoop(int loopStart){
-    emitByte(OP_LOOP);
-
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX)
+    // the distance counts from the end of the instruction: 3 bytes, or 4 for OP_LOOP_LONG
+    int offset = currentChunk()->count - loopStart + 3;
+    if (offset <= UINT16_MAX){
+        emitByte(OP_LOOP);
+        emitShort(offset);
+    } else if (offset + 1 <= UINT24_MAX){
+        emitByte(OP_LOOP_LONG);
+        emitLong(offset + 1);
+    } else {
         error("Loop body too large.");
-
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+    }
 }
 static void emitPops(int number){
-    // Assumes that number <= UINT8_MAX
+    while (number > UINT8_MAX){
+        emitBytes(OP_POPN, UINT8_MAX);
+        number -= UINT8_MAX;
+    }
     switch (number){
         case 0: break;     // Emit nothing
         case 1: emitByte(OP_POP); break;
@@ -299,13 +399,36 @@ static void emitPops(int number){
 
 
 // Compiler constructor/destructor
+static Local* pushLocal(Compiler* compiler){
+    if (compiler->localCount + 1 > compiler->localCapacity){
+        int oldCapacity = compiler->localCapacity;
+        compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->locals = GROW_ARRAY(Local, compiler->locals, oldCapacity, compiler->localCapacity);
+    }
+    return &compiler->locals[compiler->localCount++];
+}
 static void initCompiler(Compiler* compiler, FunctionType type){
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
+    compiler->upvalues = NULL;
+    compiler->upvalueCapacity = 0;
     compiler->scopeDepth = 0;
     compiler->function = newFunction();
     compiler->type = type;
     initTable(&compiler->existingConstants);
+    initValueArray(&compiler->farJumps);
     compiler->loop = NULL;
+    compiler->lastCall = -1;
+    compiler->lastProperty = -1;
+    compiler->tryDepth = 0;
+    compiler->lastClosure = -1;
+    compiler->lastFunction = -1;
+    compiler->functionBody = -1;
+    compiler->inlineBody = -1;
+    compiler->lambdaInPlace = false;
+    compiler->inPlace = type == TYPE_LAMBDA && current != NULL && current->lambdaInPlace;
+    if (current != NULL) current->lambdaInPlace = false;
 
     // set this as current compiler
     compiler->enclosing = current;
@@ -315,16 +438,15 @@ static void initCompiler(Compiler* compiler, FunctionType type){
     // if this is a lambda, generate one
     if (type == TYPE_LAMBDA){
         current->function->name = lambdaString("lambda_");
-    } else if (type == TYPE_TRY_BLOCK){
-        current->function->name = lambdaString("try_");
     } else if (type != TYPE_SCRIPT){
         current->function->name = copyString(parser.previous.start, parser.previous.length);
     }
 
     // claim slot 0 of call stack for self
-    Local* local = &current->locals[current->localCount++];
+    Local* local = pushLocal(current);
     local->depth = 0;
     local->isCaptured = false;
+    local->inlineBody = -1;
     if (type == TYPE_METHOD || type == TYPE_INITIALIZER){
         // define 'this' for methods and initializers
         local->name.start = "this";
@@ -334,28 +456,129 @@ static void initCompiler(Compiler* compiler, FunctionType type){
         local->name.length = 0;
     }
 }
+static bool isInlinable(uint8_t opcode){
+    // what a body copied into its call sites may hold (see copyBody): no stores to locals,
+    // no upvalues, no loops, nothing that defines anything
+    switch (opcode){
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_DUPLICATE:
+        case OP_POP:
+        case OP_POPN:
+        case OP_POP_UNDER:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_GLOBAL_SLOT:
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+        case OP_GET_STL:
+        case OP_GET_STL_LONG:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_PRINT:
+        case OP_BUILD_STRING:
+        case OP_BUILD_STRING_LONG:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_CALL:
+        case OP_CALL_LONG:
+        case OP_TAIL_CALL:
+        case OP_TAIL_CALL_LONG:
+        case OP_CHECK_CALLEE:
+        case OP_CHECK_CALLEE_LONG:
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_LONG:
+        case OP_INVOKE:
+        case OP_INVOKE_LONG:
+            return true;
+        default:
+            return false;
+    }
+}
+static int addInlineBody(Compiler* compiler){
+    // keeps a copy of the function compiler has just emitted, if its calls may be inlined;
+    // returns its index in inlineBodies, or -1
+    ObjFunction* function = compiler->function;
+    Chunk* chunk = &function->chunk;
+    if (compiler->type != TYPE_FUNCTION && compiler->type != TYPE_LAMBDA) return -1;
+    if (function->upvalueCount > 0 || function->arity > UINT8_MAX
+            || compiler->farJumps.count > 0 || chunk->handlerCount > 0) return -1;
+    int length = 0;
+    while (chunk->code[length] != OP_RETURN){
+        if (!isInlinable(chunk->code[length])) return -1;
+        length += instructionLength(chunk, length);
+        if (length > INLINE_LENGTH_MAX) return -1;
+    }
+
+    if (inlineCount + 1 > inlineCapacity){
+        int oldCapacity = inlineCapacity;
+        inlineCapacity = GROW_CAPACITY(oldCapacity);
+        inlineBodies = GROW_ARRAY(InlineBody, inlineBodies, oldCapacity, inlineCapacity);
+    }
+    InlineBody* body = &inlineBodies[inlineCount];
+    body->function = function;
+    body->code = ALLOCATE(uint8_t, length);
+    memcpy(body->code, chunk->code, length);
+    body->lines = ALLOCATE(int, length);
+    for (int i = 0; i < length; i++) body->lines[i] = getLine(chunk, i);
+    body->length = length;
+    body->inlined = ALLOCATE(InlinedCall, chunk->inlinedCount);
+    for (int i = 0; i < chunk->inlinedCount; i++) body->inlined[i] = chunk->inlined[i];
+    body->inlinedCount = chunk->inlinedCount;
+    body->global = -1;
+    return inlineCount++;
+}
+static void freeInlineBodies(){
+    for (int i = 0; i < inlineCount; i++){
+        FREE_ARRAY(uint8_t, inlineBodies[i].code, inlineBodies[i].length);
+        FREE_ARRAY(int, inlineBodies[i].lines, inlineBodies[i].length);
+        FREE_ARRAY(InlinedCall, inlineBodies[i].inlined, inlineBodies[i].inlinedCount);
+    }
+    FREE_ARRAY(InlineBody, inlineBodies, inlineCapacity);
+    inlineBodies = NULL;
+    inlineCount = 0;
+    inlineCapacity = 0;
+}
+
 static ObjFunction* endCompiler(){
     // emit final byte, extract ObjFunction*
     emitReturn();
     ObjFunction* function = current->function;
+    if (!parser.hasError){
+        current->inlineBody = addInlineBody(current);
+        if (current->farJumps.count > 0) widenJumps(&function->chunk, &current->farJumps);
+        if (vm.optimizeCode) vm.bytesOptimized += optimizeChunk(&function->chunk, function->arity);
+        fuseSuperinstructions(&function->chunk);
+    }
 
-    // clean up allocated compiler temporaries
+    // clean up allocated compiler temporaries (the upvalues go once the closure is emitted)
     freeTable(&current->existingConstants);
+    freeValueArray(&current->farJumps);
+    FREE_ARRAY(Local, current->locals, current->localCapacity);
 
     // restores enclosing compiler
     current = current->enclosing;
     
-    #ifdef DEBUG_PRINT_CODE
-    if (!parser.hasError){
-        disassembleChunk(&function->chunk, (function->name != NULL ? function->name->chars : "<script>"));
+    if (!parser.hasError && vm.compileHook != NULL){
+        vm.compileHook(function);
     }
-    #endif
 
     return function;
 }
 
 static void initLoopInfo(LoopInfo* loopInfo, int loopStart){
     initValueArray(&loopInfo->endpatches);
+    initValueArray(&loopInfo->continuepatches);
     loopInfo->loopStart = loopStart;
     loopInfo->loopDepth = current->scopeDepth;
     // initialize loop and inner variable to -1 (specific to for)
@@ -373,6 +596,7 @@ static void endLoopInfo(){
     }
     // free associated temporaries
     freeValueArray(&current->loop->endpatches);
+    freeValueArray(&current->loop->continuepatches);
     // restore enclosing loopInfo
     current->loop = current->loop->enclosing;
 }
@@ -380,6 +604,14 @@ static void addEndpatch(int offset){
     // adds a jump instruction at this offset to be patched to the end of this loop
     writeValueArray(&current->loop->endpatches, NUMBER_VAL(offset));
 }
+static void patchContinues(){
+    // backpatch all recorded continue jumps to here
+    ValueArray* array = &current->loop->continuepatches;
+    for (int i = 0; i < array->count; i++){
+        patchJump((int)AS_NUMBER(array->values[i]));
+    }
+    array->count = 0;
+}
 static void emitPrejumpPops(){
     // iterates through locals (does not affect it!), emits pops for values within the loop
     // if the loop has a captured value, emit OP_CLOSE_UPVALUE instead
@@ -412,16 +644,18 @@ static void parsePrecedence(Precedence precedence);
 // PARSER EXPRESSION FUNCTIONS
 static void number(bool canAssign){
     double value = strtod(parser.previous.start, NULL);
-    uint8_t constant = makeConstant(NUMBER_VAL(value));
+    int constant = makeConstant(NUMBER_VAL(value));
     emitConstant(OP_CONSTANT, constant);
 }
 static void string(bool canAssign){
     // quotation marks are already stripped (changed after string interpolation added)
     // (copyString() because there is no guarantee that the source string survives past compilation)
-    uint8_t constant = makeConstant(OBJ_VAL(copyString(parser.previous.start, parser.previous.length)));
+    int constant = makeConstant(OBJ_VAL(copyString(parser.previous.start, parser.previous.length)));
     emitConstant(OP_CONSTANT, constant);
 }
 static void grouping(bool canAssign){
+    // (fun(){...})() is the way to call a lambda right away
+    current->lambdaInPlace = check(TOKEN_FUN);
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
     // No bytecode emitted.
@@ -512,10 +746,10 @@ static void or_(bool canAssign){
 
 
 // PARSER VARIABLE HELPER FUNCTIONS
-static uint8_t identifierConstant(Token* name){
+static int identifierConstant(Token* name){
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
-static uint8_t syntheticConstant(const char* name){
+static int syntheticConstant(const char* name){
     Token synth = syntheticToken(name);
     return identifierConstant(&synth);
 }
@@ -525,14 +759,15 @@ static bool identifiersEqual(Token* a, Token* b){
     return (memcmp(a->start, b->start, a->length) == 0);
 }
 static void addLocal(Token name){
-    if (current->localCount == UINT8_COUNT){
+    if (current->localCount == UINT16_COUNT){
         error("Too many local variables in function.");
         return;
     }
-    Local* local = &current->locals[current->localCount++];
+    Local* local = pushLocal(current);
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
+    local->inlineBody = -1;
 }
 static void markInitialized(){
     // specific to local variables
@@ -562,10 +797,15 @@ static int addUpvalue(Compiler* compiler, int slotIdx, bool isLocal){
         if (upvalue->index == slotIdx && upvalue->isLocal == isLocal)
             return i;
     }
-    if (upvalueCount == UINT8_MAX){
+    if (upvalueCount == UINT16_COUNT){
         error("Too many closure variables in function.");
         return 0;
     }
+    if (upvalueCount + 1 > compiler->upvalueCapacity){
+        int oldCapacity = compiler->upvalueCapacity;
+        compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues, oldCapacity, compiler->upvalueCapacity);
+    }
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = slotIdx;
     return compiler->function->upvalueCount++;
@@ -578,13 +818,15 @@ static int resolveUpvalue(Compiler* compiler, Token* name){
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1){
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(compiler, local, true);
     }
 
     // Recursive case: if found, add to this compiler as nonlocal upvalue
+    // (a closure created in place has no upvalues to pass on)
     int upvalue = resolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1){
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        compiler->enclosing->inPlace = false;
+        return addUpvalue(compiler, upvalue, false);
     }
 
     return -1;
@@ -607,7 +849,7 @@ static void declareVariable(){
     }
     addLocal(*name);
 }
-static void defineVariable(uint8_t global){
+static void defineVariable(int global){
     // specific to global variables
     // local variables are on the stack. mark slot as initialized
     if (current->scopeDepth > 0){
@@ -616,7 +858,7 @@ static void defineVariable(uint8_t global){
     }
     emitConstant(OP_DEFINE_GLOBAL, global);
 }
-static uint8_t parseVariable(const char* errorMessage){
+static int parseVariable(const char* errorMessage){
     // parses the variable name, then:
     // global scope: returns the constant idx to the variable name
     // local scope: declares the variable name in the Compiler locals struct
@@ -627,6 +869,80 @@ static uint8_t parseVariable(const char* errorMessage){
 }
 
 
+static int resolveGlobal(Token* name){
+    // returns the slot of a global variable in vm.globalSlots
+    // or -1 if it does not fit in a two-byte operand (fall back to lookups by name)
+    int slot = globalSlot(OBJ_VAL(copyString(name->start, name->length)));
+    return slot > UINT16_MAX ? -1 : slot;
+}
+static void emitVariable(uint8_t op, int arg){
+    // global slots take a two-byte operand; every other variable a single byte, or a LONG instruction
+    switch (op){
+        case OP_GET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT:
+            emitByte(op);
+            emitShort(arg);
+            break;
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            emitConstant(op, arg);
+            break;
+        case OP_GET_OUTER_LOCAL:
+        case OP_SET_OUTER_LOCAL: {
+            // the upvalue, then the slot of the enclosing frame it captures: LONG if either does not fit in a byte
+            int slot = current->upvalues[arg].index;
+            if (arg <= UINT8_MAX && slot <= UINT8_MAX){
+                emitBytes(op, (uint8_t)arg);
+                emitByte((uint8_t)slot);
+            } else {
+                emitByte(op + 1);
+                emitShort(arg);
+                emitShort(slot);
+            }
+            break;
+        }
+        default:
+            emitCount(op, arg);
+            break;
+    }
+}
+static int pushedFunction(){
+    // the body of the function pushed by the last instruction emitted, if its calls may be inlined; or -1
+    Chunk* chunk = currentChunk();
+    int offset = current->lastFunction;
+    if (offset < 0 || offset >= chunk->count || offset + instructionLength(chunk, offset) != chunk->count) return -1;
+    return current->functionBody;
+}
+static int findInlineBody(uint8_t getOp, int arg){
+    // the body of the function a variable was declared with, if calls of it may be inlined; or -1
+    if (getOp == OP_GET_LOCAL) return current->locals[arg].inlineBody;
+    if (getOp != OP_GET_GLOBAL_SLOT) return -1;
+    for (int i = inlineCount - 1; i >= 0; i--){
+        if (inlineBodies[i].global == arg) return i;
+    }
+    return -1;
+}
+static void bindInlineBody(Token* name, int body){
+    // calls of the variable just declared as name may be inlined with body (-1: they may not)
+    if (current->scopeDepth > 0){
+        current->locals[current->localCount - 1].inlineBody = body;
+        return;
+    }
+    int slot = resolveGlobal(name);
+    if (slot == -1) return;
+    // a global declared again forgets its old body
+    for (int i = 0; i < inlineCount; i++){
+        if (inlineBodies[i].global == slot) inlineBodies[i].global = -1;
+    }
+    if (body == -1) return;
+    // a function calling itself is not copied into its own calls
+    InlineBody* inlined = &inlineBodies[body];
+    for (int offset = 0; offset < inlined->length; offset += opcodeLength(inlined->code[offset])){
+        uint8_t* code = inlined->code + offset;
+        if (*code == OP_GET_GLOBAL_SLOT && (code[1] << 8 | code[2]) == slot) return;
+    }
+    inlined->global = slot;
+}
 static void namedVariable(Token name, bool canAssign){
     uint8_t getOp, setOp;
     int arg = resolveLocal(current, &name);
@@ -634,8 +950,18 @@ static void namedVariable(Token name, bool canAssign){
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
     } else if ((arg = resolveUpvalue(current, &name)) != -1){
-        getOp = OP_GET_UPVALUE;
-        setOp = OP_SET_UPVALUE;
+        if (current->inPlace && current->upvalues[arg].isLocal){
+            getOp = OP_GET_OUTER_LOCAL;
+            setOp = OP_SET_OUTER_LOCAL;
+        } else {
+            // an upvalue of the enclosing closure: an in-place closure has none
+            current->inPlace = false;
+            getOp = OP_GET_UPVALUE;
+            setOp = OP_SET_UPVALUE;
+        }
+    } else if ((arg = resolveGlobal(&name)) != -1){
+        getOp = OP_GET_GLOBAL_SLOT;
+        setOp = OP_SET_GLOBAL_SLOT;
     } else {
         arg = identifierConstant(&name);
         getOp = OP_GET_GLOBAL;
@@ -650,7 +976,7 @@ static void namedVariable(Token name, bool canAssign){
                 // evaluate expression and set variable to value on stack
                 advance();
                 expression();
-                emitConstant(setOp, (uint8_t)arg);
+                emitVariable(setOp, arg);
                 return;
             }
             case (TOKEN_PLUS_EQUAL):   assignInstruction = OP_ADD; break;
@@ -663,16 +989,22 @@ static void namedVariable(Token name, bool canAssign){
             // compound assignment operation.
             // get variable, advance past operator, evaluate expression to the right (PREC_ASSIGN)
             // apply operation and set variable to value on stack
-            emitBytes(getOp, arg);
+            emitVariable(getOp, arg);
             advance();
             expression();
             emitByte((uint8_t)assignInstruction);
-            emitConstant(setOp, arg);
+            emitVariable(setOp, arg);
             return;
         }
     }
     // Assumed get operation if no assignment succeeded
-    emitConstant(getOp, arg);
+    int offset = currentChunk()->count;
+    emitVariable(getOp, arg);
+    int body = findInlineBody(getOp, arg);
+    if (body != -1){
+        current->lastFunction = offset;
+        current->functionBody = body;
+    }
 
     // if variable assignment on an invalid target, return to parsePrecedence and do not consume '='
     // error handling is done there.
@@ -682,16 +1014,16 @@ static void variable(bool canAssign){
     namedVariable(parser.previous, canAssign);
 }
 
-static uint8_t argumentList(){
+static int argumentList(){
     // Evaluates all arguments to be on the stack.
     // LEFT_PAREN already consumed
-    uint8_t argCount = 0;
+    int argCount = 0;
     if (!check(TOKEN_RIGHT_PAREN)){
         do {
             expression();
-            if (argCount == 255){
-                // About to overflow to 256 arguments
-                error("Cannot have more than 255 arguments.");
+            if (argCount == UINT16_MAX){
+                // About to overflow to 65536 arguments
+                error("Cannot have more than 65535 arguments.");
             }
             argCount++;
         } while (match(TOKEN_COMMA));
@@ -699,97 +1031,318 @@ static uint8_t argumentList(){
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
     return argCount;
 }
+static bool emitInPlace(UpvalueKind kind){
+    // creates the closure right before this point in place, if it may be: it then reads the locals
+    // it captures from this frame's slots (OP_GET_OUTER_LOCAL) and no upvalue is captured for it
+    Chunk* chunk = currentChunk();
+    int offset = current->lastClosure;
+    current->lastClosure = -1;
+    if (offset < 0 || offset + instructionLength(chunk, offset) != chunk->count) return false;
+    bool wide = chunk->code[offset] == OP_CLOSURE_LONG;
+    uint8_t* code = chunk->code + offset;
+    int constant = wide ? (code[1] << 16 | code[2] << 8 | code[3]) : code[1];
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+    uint8_t* descriptor = code + (wide ? 4 : 2);
+    for (int i = 0; i < function->upvalueCount; i++){
+        descriptor[i * (wide ? 3 : 2)] = kind;
+    }
+    return true;
+}
+static bool isArrayCallback(int name){
+    // the Array methods that only call their callback while they run, and never keep it
+    ObjString* string = AS_STRING(currentChunk()->constants.values[name]);
+    return (string->length == 3 && memcmp(string->chars, "map", 3) == 0)
+        || (string->length == 6 && memcmp(string->chars, "filter", 6) == 0)
+        || (string->length == 6 && memcmp(string->chars, "reduce", 6) == 0);
+}
+static bool copyBody(InlineBody* body, bool emit){
+    // copies body after the arguments of its call, or only checks that it can be (emit false).
+    // The function has no frame of its own: a local is read with OP_DUPLICATE at its distance from the
+    // stack top, which is followed through the body. Constants and inline caches are the caller's own.
+    // The first OP_RETURN leaves the result on top: OP_POP_UNDER drops the callee, arguments and locals under it.
+
+    // the operands of the instruction at code, read only where it has them: a constant first, or a count
+#define BODY_CONSTANT() (wide ? (code[1] << 16 | code[2] << 8 | code[3]) : code[1])
+#define BODY_COUNT()    (wide ? (code[1] << 8 | code[2]) : code[1])
+#define BODY_ARGS()     (wide ? (code[4] << 8 | code[5]) : code[2])
+    Value* constants = body->function->chunk.constants.values;
+    int height = body->function->arity + 1;
+    bool reachable = true;
+    // forward jumps that have yet to land: (target in the body, operand to patch, height)
+    int pending[INLINE_LENGTH_MAX][3];
+    int pendingCount = 0;
+    // where every instruction of the body lands in the copy; it keeps the lines of the body
+    int at[INLINE_LENGTH_MAX + 1];
+    int line = parser.previous.line;
+
+    int offset = 0;
+    while (true){
+        for (int j = pendingCount - 1; j >= 0; j--){
+            if (pending[j][0] != offset) continue;
+            if (reachable && pending[j][2] != height) return false;
+            height = pending[j][2];
+            reachable = true;
+            if (emit) patchJump(pending[j][1]);
+            pendingCount--;
+            memcpy(pending[j], pending[pendingCount], sizeof(pending[j]));
+        }
+        if (!reachable) return false;
+        at[offset] = currentChunk()->count;
+        if (offset == body->length) break;
+        if (emit) parser.previous.line = body->lines[offset];
+
+        uint8_t* code = body->code + offset;
+        bool wide = isLongOpcode(*code);
+        switch (*code){
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_LONG:
+            case OP_GET_STL:
+            case OP_GET_STL_LONG:
+                if (emit) emitConstant(*code - wide, makeConstant(constants[BODY_CONSTANT()]));
+                height++;
+                break;
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                if (emit) emitByte(*code);
+                height++;
+                break;
+            case OP_DUPLICATE:
+                if (emit) emitBytes(OP_DUPLICATE, code[1]);
+                height++;
+                break;
+            case OP_GET_LOCAL:
+            case OP_GET_LOCAL_LONG: {
+                int distance = height - 1 - BODY_COUNT();
+                if (distance > UINT8_MAX) return false;
+                if (emit) emitBytes(OP_DUPLICATE, (uint8_t)distance);
+                height++;
+                break;
+            }
+            case OP_GET_GLOBAL_SLOT:
+                if (emit){
+                    emitByte(OP_GET_GLOBAL_SLOT);
+                    emitShort(code[1] << 8 | code[2]);
+                }
+                height++;
+                break;
+            case OP_POP:
+            case OP_PRINT:
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+                if (emit) emitByte(*code);
+                height--;
+                break;
+            case OP_NOT:
+            case OP_NEGATE:
+                if (emit) emitByte(*code);
+                break;
+            case OP_POPN:
+            case OP_POP_UNDER:
+                if (emit) emitBytes(*code, code[1]);
+                height -= code[1];
+                break;
+            case OP_BUILD_STRING:
+            case OP_BUILD_STRING_LONG:
+                if (emit) emitCount(OP_BUILD_STRING, BODY_COUNT());
+                height -= BODY_COUNT() - 1;
+                break;
+            case OP_CALL:
+            case OP_CALL_LONG:
+            case OP_TAIL_CALL:
+            case OP_TAIL_CALL_LONG:
+                // a call in tail position of the body is not one at the call site
+                if (emit) emitCount(OP_CALL, BODY_COUNT());
+                height -= BODY_COUNT();
+                break;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP:
+            case OP_CHECK_CALLEE:
+            case OP_CHECK_CALLEE_LONG: {
+                // the body has no far jumps (addInlineBody), so every jump operand is two bytes, and comes last
+                int next = offset + opcodeLength(*code);
+                int target = next + (body->code[next - 2] << 8 | body->code[next - 1]);
+                if (target > body->length) return false;
+                pending[pendingCount][0] = target;
+                if (!emit) pending[pendingCount][1] = -1;
+                else if (*code == OP_JUMP_IF_FALSE || *code == OP_JUMP) pending[pendingCount][1] = emitJump(*code);
+                else pending[pendingCount][1] = emitCheckCallee(makeConstant(constants[BODY_CONSTANT()]), BODY_ARGS());
+                pending[pendingCount][2] = height;
+                pendingCount++;
+                if (*code == OP_JUMP) reachable = false;
+                break;
+            }
+            case OP_GET_PROPERTY:
+            case OP_GET_PROPERTY_LONG:
+                if (emit){
+                    int property = currentChunk()->count;
+                    emitConstant(OP_GET_PROPERTY, makeConstant(constants[BODY_CONSTANT()]));
+                    emitInlineCache(property);
+                }
+                break;
+            case OP_INVOKE:
+            case OP_INVOKE_LONG:
+                if (emit) emitInvoke(makeConstant(constants[BODY_CONSTANT()]), BODY_ARGS());
+                height -= BODY_ARGS();
+                break;
+            default:
+                return false;
+        }
+        offset += opcodeLength(*code);
+    }
+    if (height - 1 > UINT8_MAX) return false;
+    if (!emit) return true;
+    parser.previous.line = line;
+    for (int i = 0; i < body->inlinedCount; i++){
+        InlinedCall* inlined = &body->inlined[i];
+        if (inlined->end > body->length) continue;
+        addInlinedCall(currentChunk(), at[inlined->start], at[inlined->end],
+                       makeConstant(constants[inlined->function]), inlined->line);
+    }
+    emitBytes(OP_POP_UNDER, (uint8_t)(height - 1));
+    return true;
+#undef BODY_CONSTANT
+#undef BODY_COUNT
+#undef BODY_ARGS
+}
+static bool inlineCall(int body, int argCount){
+    // compiles a call, its arguments already on the stack, as a copy of the function's body, if it can be.
+    // The copy only runs while the callee is still that function, which a variable assigned another
+    // function or rebound at runtime is not; the call is made as usual then:
+    //     OP_CHECK_CALLEE function argCount inlined, OP_CALL argCount, OP_JUMP done, inlined: body, OP_POP_UNDER, done:
+    InlineBody* inlined = &inlineBodies[body];
+    if (argCount != inlined->function->arity || !copyBody(inlined, false)) return false;
+    int function = makeConstant(OBJ_VAL(inlined->function));
+    int check = emitCheckCallee(function, argCount);
+    emitCall(argCount);
+    int done = emitJump(OP_JUMP);
+    patchJump(check);
+    int start = currentChunk()->count;
+    int line = parser.previous.line;
+    copyBody(inlined, true);
+    addInlinedCall(currentChunk(), start, currentChunk()->count - 2, function, line);
+    patchJump(done);
+    return true;
+}
 static void call(bool canAssign){
-    uint8_t argCount = argumentList();
-    emitBytes(OP_CALL, argCount);
+    // a property called right away, as in (obj.m)(x), is invoked instead:
+    // the receiver stays on the stack and no bound method is created
+    Chunk* chunk = currentChunk();
+    int offset = current->lastProperty;
+    if (offset >= 0 && offset + opcodeLength(chunk->code[offset]) == chunk->count){
+        // OP_GET_PROPERTY name cache, or OP_GET_PROPERTY_LONG with a three-byte name
+        uint8_t* code = chunk->code + offset;
+        bool wide = *code == OP_GET_PROPERTY_LONG;
+        int name = wide ? (code[1] << 16 | code[2] << 8 | code[3]) : code[1];
+        int cache = wide ? (code[4] << 8 | code[5]) : (code[2] << 8 | code[3]);
+        truncateChunk(chunk, offset);
+        current->lastProperty = -1;
+
+        int argCount = argumentList();
+        // the instruction moves behind the arguments; so does the owner of its inline cache
+        if (cache != NO_INLINE_CACHE) chunk->caches[cache].offset = chunk->count;
+        emitNameAndCount(OP_INVOKE, name, argCount);
+        emitShort(cache);
+        return;
+    }
+    int body = pushedFunction();
+    current->lastFunction = -1;
+
+    bool inPlace = emitInPlace(UPVALUE_IN_PLACE);
+    int argCount = argumentList();
+    if (body != -1 && inlineCall(body, argCount)) return;
+    emitCall(argCount);
+    // not a tail call: the frame the closure reads must outlive it
+    if (inPlace) current->lastCall = -1;
 }
 
 
 static void interpolation(bool canAssign){
     // String interpolation handling
-
-    // Get the index to "string" and "concatenate" constant (required to call native function)
-    uint8_t idxS = syntheticConstant("String");
-    uint8_t idxC = syntheticConstant("concatenate");
-
-    // prepare for concatenate native method invocation
-    emitConstant(OP_GET_STL, idxS);
-
-    int argCount = 0;
+    // every piece of text and every expression is pushed, then OP_BUILD_STRING
+    // formats them all into one string (see 32I). empty pieces of text are left out
+    int count = 0;
     do {
-        // pass the TOKEN_INTERPOLATION to be parsed as a string
-        string(canAssign);
-
-        // get the Lox stringcast native function, evaluate the expression, and call it
-        emitConstant(OP_GET_STL, idxS);
+        // the TOKEN_INTERPOLATION is the text before the expression
+        if (parser.previous.length > 0){
+            string(canAssign);
+            count++;
+        }
         expression();
-        emitBytes(OP_CALL, 1);
+        count++;
 
-        // increment argCount
-        if (argCount > UINT8_MAX - 2){
-            error("Cannot exceed 128 chained string interpolations.");
+        if (count > UINT16_MAX - 2){
+            error("Cannot exceed 65533 pieces in a string interpolation.");
         }
-        argCount += 2;
     } while (match(TOKEN_INTERPOLATION));
 
     // parse ending string
     advance();
-    string(canAssign);
-    argCount++;
+    if (parser.previous.length > 0){
+        string(canAssign);
+        count++;
+    }
 
-    emitBytes(OP_INVOKE, idxC);
-    emitByte(argCount);
+    emitCount(OP_BUILD_STRING, count);
 }
 
 static void dot(bool canAssign){
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     if (canAssign && match(TOKEN_EQUAL)){
         expression();
+        int offset = currentChunk()->count;
         emitConstant(OP_SET_PROPERTY, name);
+        emitInlineCache(offset);
     } else if (match(TOKEN_LEFT_PAREN)){
         // Optimized invocations
-        uint8_t argCount = argumentList();
-        emitConstant(OP_INVOKE, name);
-        emitByte(argCount);
+        // a lambda passed to Array.map, filter or reduce is only called while they run
+        bool arrayCallback = isArrayCallback(name);
+        current->lambdaInPlace = arrayCallback && check(TOKEN_FUN);
+        int argCount = argumentList();
+        if (arrayCallback && argCount == 1) emitInPlace(UPVALUE_IN_PLACE_ARRAY);
+        emitInvoke(name, argCount);
     } else {
+        int offset = currentChunk()->count;
         emitConstant(OP_GET_PROPERTY, name);
+        emitInlineCache(offset);
+        current->lastProperty = offset;
     }
 }
 
 static void array(bool canAssign){
-    uint8_t idxArray = syntheticConstant("Array");
-    uint8_t idxRaw = syntheticConstant("@raw");
+    int idxArray = syntheticConstant("Array");
+    int idxRaw = syntheticConstant("@raw");
     emitConstant(OP_GET_STL, idxArray);
-    uint8_t argCount = 0;
+    int argCount = 0;
     if (!check(TOKEN_RIGHT_BRACKET)){
         do {
             expression();
-            if (argCount == 255){
-                // About to overflow to 256 arguments
-                error("Cannot have more than 255 elements in array literal.");
+            if (argCount == UINT16_MAX){
+                // About to overflow to 65536 arguments
+                error("Cannot have more than 65535 elements in array literal.");
             }
             argCount++;
         } while (match(TOKEN_COMMA));
     }
     consume(TOKEN_RIGHT_BRACKET, "Expect ']' after array contents.");
-    emitConstant(OP_INVOKE, idxRaw);
-    emitByte(argCount);
+    emitInvoke(idxRaw, argCount);
 }
 
 static void subscript(bool canAssign){
-    uint8_t idxGet = syntheticConstant("get");
-    uint8_t idxSet = syntheticConstant("set");
-    uint8_t idxSlice = syntheticConstant("Slice");
-    uint8_t idxRaw = syntheticConstant("@raw");
-
     // left bracket already consumed
-    // emit Slice class onto stack for @raw static invocation
-    emitConstant(OP_GET_STL, idxSlice);
-
+    // a single clause is the index itself; two or three clauses are the
+    // start, end and step of a slice, which the VM builds from the clauses.
     // slice start clause / expression
-    int argCount = 1;
+    uint8_t clauseCount = 1;
     if (check(TOKEN_COLON)){
         // empty start field
         emitByte(OP_NIL);
@@ -798,7 +1351,7 @@ static void subscript(bool canAssign){
     }
     // slice end clause
     if (match(TOKEN_COLON)){
-        argCount++;
+        clauseCount++;
         if (check(TOKEN_COLON) || check(TOKEN_RIGHT_BRACKET)){
             // empty end field
             emitByte(OP_NIL);
@@ -808,7 +1361,7 @@ static void subscript(bool canAssign){
     }
     // slice step clause
     if (match(TOKEN_COLON)){
-        argCount++;
+        clauseCount++;
         if (check(TOKEN_RIGHT_BRACKET)){
             // empty step field
             emitByte(OP_NIL);
@@ -818,8 +1371,6 @@ static void subscript(bool canAssign){
     }
 
     consume(TOKEN_RIGHT_BRACKET, "Expect ']' after subscript.");
-    emitConstant(OP_INVOKE, idxRaw);
-    emitByte(argCount);
 
     if (canAssign){
         int assignInstruction = -1;
@@ -829,8 +1380,7 @@ static void subscript(bool canAssign){
                 // evaluate expression and set variable to value on stack
                 advance();
                 expression();
-                emitConstant(OP_INVOKE, idxSet);
-                emitByte(2);
+                emitBytes(OP_INDEX_SET, clauseCount);
                 return;
             }
             case (TOKEN_PLUS_EQUAL):   assignInstruction = OP_ADD; break;
@@ -841,43 +1391,38 @@ static void subscript(bool canAssign){
         }
         if (assignInstruction != -1){
             // compound assignment operation.
-            // get variable, advance past operator, evaluate expression to the right (PREC_ASSIGN)
+            // get variable (keeping the receiver and index), advance past operator,
+            // evaluate expression to the right (PREC_ASSIGN)
             // apply operation and set variable to value on stack
-            emitBytes(OP_DUPLICATE, 1);
-            emitBytes(OP_DUPLICATE, 1);
-            emitBytes(OP_INVOKE, idxGet);
-            emitByte(1);
+            emitBytes(OP_INDEX_UPDATE, clauseCount);
 
             advance();
             expression();
             emitByte((uint8_t)assignInstruction);
 
-            emitConstant(OP_INVOKE, idxSet);
-            emitByte(2);
+            emitBytes(OP_INDEX_SET, 1);
             return;
         }
     }
     // else, treat as getter
-    emitConstant(OP_INVOKE, idxGet);
-    emitByte(1);
+    emitBytes(OP_INDEX_GET, clauseCount);
 }
 
 static void hashmap(bool canAssign){
-    uint8_t idxHashmap = syntheticConstant("Hashmap");
-    uint8_t idxRaw = syntheticConstant("@raw");
+    int idxHashmap = syntheticConstant("Hashmap");
+    int idxRaw = syntheticConstant("@raw");
     emitConstant(OP_GET_STL, idxHashmap);
-    uint8_t argCount = 0;
+    int argCount = 0;
     do {
         expression();
         consume(TOKEN_COLON, "Expect ':' for key-value pairs in hashmap literal.");
         expression();
-        if (argCount >= UINT8_MAX - 2)
-            error("Hashmap literal can contain no more than 128 entries.");
+        if (argCount >= UINT16_MAX - 2)
+            error("Hashmap literal can contain no more than 32767 entries.");
         argCount += 2;
     } while (match(TOKEN_COMMA));
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after hashmap elements.");
-    emitConstant(OP_INVOKE, idxRaw);
-    emitByte(argCount);
+    emitInvoke(idxRaw, argCount);
 }
 
 
@@ -900,9 +1445,11 @@ static bool tryParseExpression(TokenType terminator){
 
 // PARSER STATEMENT FUNCTIONS
 static void varDeclaration(){
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable("Expect variable name.");
+    Token name = parser.previous;
 
     // Evaluate and emit bytecode for initialization value first
+    int start = currentChunk()->count;
     if (match(TOKEN_EQUAL)){
         expression();
     } else {
@@ -910,6 +1457,8 @@ static void varDeclaration(){
     }
 
     consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    // a variable initialized with a lambda, as in var f = fun(x){ ... };, may have its calls inlined too
+    bindInlineBody(&name, current->lastFunction == start ? pushedFunction() : -1);
     defineVariable(global);
 }
 
@@ -988,6 +1537,37 @@ static void whileStatement(){
 
     endLoopInfo();
 }
+static bool loopBodyCaptures(Token* name){
+    // looks ahead over the body of a for loop, about to be compiled: may a function or class in it
+    // capture the loop variable name? A use of the name anywhere after 'fun' or 'class' counts
+    Scanner saved = saveScanner();
+    Token token = parser.current;
+    bool block = token.type == TOKEN_LEFT_BRACE;
+    int depth = 0;      // of (), [] and {}
+    bool inFunction = false;
+    bool captures = false;
+    while (!captures && token.type != TOKEN_EOF){
+        switch (token.type){
+            case TOKEN_LEFT_PAREN:
+            case TOKEN_LEFT_BRACKET:
+            case TOKEN_LEFT_BRACE:    depth++; break;
+            case TOKEN_RIGHT_PAREN:
+            case TOKEN_RIGHT_BRACKET:
+            case TOKEN_RIGHT_BRACE:   depth--; break;
+            case TOKEN_FUN:
+            case TOKEN_CLASS:         inFunction = true; break;
+            case TOKEN_IDENTIFIER:    captures = inFunction && identifiersEqual(&token, name); break;
+            default: ;
+        }
+        if (depth < 0 || (block && depth == 0)) break;
+        bool ends = !block && depth == 0 && token.type == TOKEN_SEMICOLON;
+        token = scanToken();
+        // a statement without braces may go on with an else clause
+        if (ends && token.type != TOKEN_ELSE) break;
+    }
+    restoreScanner(saved);
+    return captures;
+}
 static void forStatement(){
     // Looping variable belongs to scope of loop
     beginScope();
@@ -1021,35 +1601,41 @@ static void forStatement(){
         emitByte(OP_POP);
     }
 
-    int incrStart = loopStart;
-    if  (!match(TOKEN_RIGHT_PAREN)){
-        // increment clause. evaluate and pop result (treat as statement)
-        int bodyJump = emitJump(OP_JUMP);
-        // Overwrite 'start of loop' to be at the increment clause
-        incrStart = currentChunk()->count;
-        expression();
-        emitByte(OP_POP);
-
+    // the increment clause runs after the body: skip its tokens for now, and compile it there
+    // so every iteration falls from the body into the increment and loops back to the condition
+    bool hasIncrement = !match(TOKEN_RIGHT_PAREN);
+    Scanner incrementScanner;
+    Token incrementToken;
+    if (hasIncrement){
+        incrementScanner = saveScanner();
+        incrementToken = parser.current;
+        Token token = parser.current;
+        int depth = 0;
+        while (token.type != TOKEN_EOF && !(depth == 0 && token.type == TOKEN_RIGHT_PAREN)){
+            if (token.type == TOKEN_LEFT_PAREN || token.type == TOKEN_LEFT_BRACKET || token.type == TOKEN_LEFT_BRACE) depth++;
+            if (token.type == TOKEN_RIGHT_PAREN || token.type == TOKEN_RIGHT_BRACKET || token.type == TOKEN_RIGHT_BRACE) depth--;
+            token = scanToken();
+        }
+        parser.current = token;
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
-
-        emitLoop(loopStart);
-        patchJump(bodyJump);
     }
 
-    // create inner variable if loop variable declared
+    // create inner variable if loop variable declared and a closure in the body may capture it,
     // with value of loop variable
     // create new scope to contain it
+    // (otherwise the body uses the loop variable itself: nothing is copied in or out every iteration)
+    if (loopVariable != -1 && !loopBodyCaptures(&loopVariableName)) loopVariable = -1;
     int innerVariable = -1;
     if (loopVariable != -1){
         beginScope();
-        emitBytes(OP_GET_LOCAL, loopVariable);
+        emitVariable(OP_GET_LOCAL, loopVariable);
         addLocal(loopVariableName);
         markInitialized();
         innerVariable = current->localCount - 1;
     }
 
     LoopInfo loop;
-    initLoopInfo(&loop, incrStart);
+    initLoopInfo(&loop, hasIncrement ? -1 : loopStart);
     // save loop and inner variable information
     loop.loopVariable = loopVariable;
     loop.innerVariable = innerVariable;
@@ -1059,14 +1645,31 @@ static void forStatement(){
     if (loopVariable != -1){
         // set the value of the loop variable to the inner variable at end of statement
         // then loop to increment clause
-        emitBytes(OP_GET_LOCAL, (uint8_t)innerVariable);
-        emitBytes(OP_SET_LOCAL, (uint8_t)loopVariable);
+        emitVariable(OP_GET_LOCAL, innerVariable);
+        emitVariable(OP_SET_LOCAL, loopVariable);
         emitByte(OP_POP);
         // don't forget to close scope opened when inner variable made!
         endScope();
     }
 
-    emitLoop(incrStart);
+    if (hasIncrement){
+        // continue lands on the increment. evaluate and pop result (treat as statement)
+        patchContinues();
+        Scanner bodyScanner = saveScanner();
+        Token bodyPrevious = parser.previous;
+        Token bodyCurrent = parser.current;
+        restoreScanner(incrementScanner);
+        parser.current = incrementToken;
+        expression();
+        emitByte(OP_POP);
+        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+        // carry on after the body
+        restoreScanner(bodyScanner);
+        parser.previous = bodyPrevious;
+        parser.current = bodyCurrent;
+    }
+
+    emitLoop(loopStart);
 
     if (exitJump != -1){
         patchJump(exitJump);
@@ -1102,8 +1705,8 @@ static void continueStatement(){
 
     // assign inner variable to loop variable (if any)
     if (current->loop->loopVariable != -1){
-        emitBytes(OP_GET_LOCAL, (uint8_t)current->loop->innerVariable);
-        emitBytes(OP_SET_LOCAL, (uint8_t)current->loop->loopVariable);
+        emitVariable(OP_GET_LOCAL, current->loop->innerVariable);
+        emitVariable(OP_SET_LOCAL, current->loop->loopVariable);
         emitByte(OP_POP);
     }
 
@@ -1113,12 +1716,44 @@ static void continueStatement(){
     if (current->loop->loopVariable != -1)
         emitByte(current->locals[current->localCount - 1].isCaptured ? OP_CLOSE_UPVALUE : OP_POP);
 
-    // emit jump to loop start
-    emitLoop(current->loop->loopStart);
+    // emit jump to loop start, or forward to the increment
+    if (current->loop->loopStart == -1)
+        writeValueArray(&current->loop->continuepatches, NUMBER_VAL(emitJump(OP_JUMP)));
+    else
+        emitLoop(current->loop->loopStart);
 }
 
 
-static void function(FunctionType type){
+static void emitClosure(Compiler* compiler, ObjFunction* function){
+    // pushes the function compiled by compiler, then releases its upvalues
+    int constant = makeConstant(OBJ_VAL(function));
+    if (function->upvalueCount == 0){
+        // create function object
+        emitConstant(OP_CONSTANT, constant);
+        return;
+    }
+    current->lastClosure = compiler->inPlace ? currentChunk()->count : -1;
+    // create closure object: LONG if the constant or any index does not fit in a byte
+    bool wide = constant > UINT8_MAX;
+    for (int i = 0; i < function->upvalueCount; i++){
+        if (compiler->upvalues[i].index > UINT8_MAX) wide = true;
+    }
+    if (wide){
+        emitByte(OP_CLOSURE_LONG);
+        emitLong(constant);
+    } else {
+        emitBytes(OP_CLOSURE, (uint8_t)constant);
+    }
+    for (int i = 0; i < function->upvalueCount; i++){
+        emitByte(compiler->upvalues[i].isLocal ? UPVALUE_LOCAL : UPVALUE_INHERITED);
+        if (wide) emitShort(compiler->upvalues[i].index);
+        else emitByte((uint8_t)compiler->upvalues[i].index);
+    }
+    FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalueCapacity);
+}
+
+static int function(FunctionType type){
+    // compiles a function and pushes it; returns its body in inlineBodies, or -1 if its calls may not be inlined
     Compiler compiler;
     initCompiler(&compiler, type);
 
@@ -1128,10 +1763,10 @@ static void function(FunctionType type){
     if (!check(TOKEN_RIGHT_PAREN)){
         do {
             current->function->arity++;
-            if (current->function->arity > 255){
-                error("Cannot have more than 255 parameters.");
+            if (current->function->arity > UINT16_MAX){
+                error("Cannot have more than 65535 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
+            int constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
@@ -1146,22 +1781,15 @@ static void function(FunctionType type){
 
     ObjFunction* function = endCompiler();
 
-    if (function->upvalueCount > 0){
-        // create closure object
-        emitConstant(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
-        for (int i = 0; i < function->upvalueCount; i++){
-            emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-            emitByte(compiler.upvalues[i].index);
-        }
-    } else {
-        // create function object
-        emitConstant(OP_CONSTANT, makeConstant(OBJ_VAL(function)));
-    }
+    emitClosure(&compiler, function);
+    return compiler.inlineBody;
 }
 static void functionDeclaration(){
-    uint8_t global = parseVariable("Expect function name.");
+    int global = parseVariable("Expect function name.");
+    Token name = parser.previous;
     markInitialized();
-    function(TYPE_FUNCTION);
+    int body = function(TYPE_FUNCTION);
+    bindInlineBody(&name, body);
     defineVariable(global);
 }
 static void returnStatement(){
@@ -1179,6 +1807,13 @@ static void returnStatement(){
         }
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        // a call right before the return is in tail position; it may reuse this call frame
+        // (not inside a try block, whose handler needs this frame to catch what the call throws)
+        Chunk* chunk = currentChunk();
+        if (current->lastCall >= 0 && current->lastCall + opcodeLength(chunk->code[current->lastCall]) == chunk->count
+                && current->tryDepth == 0){
+            chunk->code[current->lastCall] = chunk->code[current->lastCall] == OP_CALL ? OP_TAIL_CALL : OP_TAIL_CALL_LONG;
+        }
         emitByte(OP_RETURN);
     }
 }
@@ -1186,12 +1821,17 @@ static void returnStatement(){
 static void lambda(bool canAssign){
     // Function literal with randomly-generated name
     // We came here from the Pratt parser
-    function(TYPE_LAMBDA);
+    int offset = currentChunk()->count;
+    int body = function(TYPE_LAMBDA);
+    if (body != -1){
+        current->lastFunction = offset;
+        current->functionBody = body;
+    }
 }
 
 static void method(FunctionType type){
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    int nameConstant = identifierConstant(&parser.previous);
     FunctionType funcType = type;
     if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0){
         if (type == TYPE_STATIC_METHOD)
@@ -1205,7 +1845,7 @@ static void method(FunctionType type){
 static void classDeclaration(){
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    int nameConstant = identifierConstant(&parser.previous);
     declareVariable();
 
     emitConstant(OP_CLASS, nameConstant);
@@ -1221,25 +1861,24 @@ static void classDeclaration(){
         Opcode instruction;
         if (match(TOKEN_LEFT_BRACKET)){
             // multiple inheritance
-            uint8_t idxArray = syntheticConstant("Array");
-            uint8_t idxRaw = syntheticConstant("@raw");
+            int idxArray = syntheticConstant("Array");
+            int idxRaw = syntheticConstant("@raw");
             emitConstant(OP_GET_STL, idxArray);
 
-            uint8_t argCount = 0;
+            int argCount = 0;
             do {
                 consume(TOKEN_IDENTIFIER, "Expect superclass name.");
                 variable(false);
-                if (argCount == 255){
-                    // About to overflow to 256 arguments
-                    error("Cannot have more than 255 elements in array literal.");
+                if (argCount == UINT16_MAX){
+                    // About to overflow to 65536 arguments
+                    error("Cannot have more than 65535 elements in array literal.");
                 } else argCount++;
                 if (identifiersEqual(&parser.previous, &className))
                     error("A class cannot inherit itself.");
             } while (match(TOKEN_COMMA));
             consume(TOKEN_RIGHT_BRACKET, "Expect ']' after superclass array.");
 
-            emitConstant(OP_INVOKE, idxRaw);
-            emitByte(argCount);
+            emitInvoke(idxRaw, argCount);
             
             classCompiler.type = SUPERCLASS_MULTIPLE;
             instruction = OP_INHERIT_MULTIPLE;
@@ -1311,24 +1950,21 @@ static void super_ (bool canAssign){
         consume(TOKEN_LEFT_BRACKET, "Expect '[' after 'super' for multiple inheritance.");
         expression();
         consume(TOKEN_RIGHT_BRACKET, "Expect ']' after subscript.");
-        uint8_t idxGet = syntheticConstant("get");
-        emitConstant(OP_INVOKE, idxGet);
-        emitByte(1);
+        emitBytes(OP_INDEX_GET, 1);
     }
     int returnJump = emitJump(OP_JUMP);
     patchJump(superjump);
 
     consume(TOKEN_DOT, "Expect '.' after super expression.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     namedVariable(syntheticToken("this"), false);
     if (match(TOKEN_LEFT_PAREN)){
-        uint8_t argCount = argumentList();
+        int argCount = argumentList();
         emitLoop(superstart);
         patchJump(returnJump);
-        emitConstant(OP_SUPER_INVOKE, name);
-        emitByte(argCount);
+        emitNameAndCount(OP_SUPER_INVOKE, name, argCount);
     } else {
         emitLoop(superstart);
         patchJump(returnJump);
@@ -1338,48 +1974,40 @@ static void super_ (bool canAssign){
 
 
 static void tryStatement(){
-    Compiler compiler;
-    initCompiler(&compiler, TYPE_TRY_BLOCK);
-    
-    consume(TOKEN_LEFT_BRACE, "Expect '{' after 'try'.");
+    // The try block is compiled inline: entering it costs nothing.
+    // Its code range goes into the chunk's handler table instead, which throwValue() searches
+    // for the catch block and the stack depth to cut back to.
+    Chunk* chunk = currentChunk();
+    int depth = current->localCount;
+    int start = chunk->count;
 
-    // Everything goes into block scope
+    consume(TOKEN_LEFT_BRACE, "Expect '{' after 'try'.");
+    current->tryDepth++;
     beginScope();
     block();
-    ObjFunction* function = endCompiler();
-    function->fromTry = true;
-
-    if (function->upvalueCount > 0){
-        // create closure object
-        emitConstant(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
-        for (int i = 0; i < function->upvalueCount; i++){
-            emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-            emitByte(compiler.upvalues[i].index);
-        }
-    } else {
-        // create function object
-        emitConstant(OP_CONSTANT, makeConstant(OBJ_VAL(function)));
-    }
-
-    // Function/closure object is on the stack. Try call
-    emitByte(OP_TRY_CALL);
+    endScope();
+    current->tryDepth--;
 
-    // Emit pop and jump operand (will be skipped if exception thrown)
-    emitByte(OP_POP);
-    int catchJump = emitJump(OP_JUMP);
+    int end = chunk->count;
+    int skipCatch = emitJump(OP_JUMP);
+    // nested try blocks were added while compiling the block, so inner ranges come first
+    addHandler(chunk, start, end, chunk->count, depth);
+    // the catch block is reached from the handler table, like a jump target
+    current->lastCall = -1;
+    current->lastProperty = -1;
 
-    // Parse catch clause (no need to parse as function)
+    // the exception is pushed where the try block's locals started: that slot is the catch variable
     beginScope();
     consume(TOKEN_CATCH, "Expect 'catch' after try clause.");
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'catch'.");
-    uint8_t localIdx = parseVariable("Expect variable name.");
+    int localIdx = parseVariable("Expect variable name.");
     defineVariable(localIdx);
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after identifier.");
     consume(TOKEN_LEFT_BRACE, "Expect '{' before catch block.");
     block();
     endScope();
 
-    patchJump(catchJump);
+    patchJump(skipCatch);
 }
 static void throwStatement(){
     expression();
@@ -1588,6 +2216,7 @@ ObjFunction* compile(const char* source, bool evalExpr){
     }
 
     ObjFunction* function = endCompiler();
+    freeInlineBodies();
     return !parser.hasError ? function : NULL;
 }
 
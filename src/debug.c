@@ -1,7 +1,9 @@
 #include <stdio.h>
 
 #include "debug.h"
+#include "ir.h"
 #include "object.h"
+#include "vm.h"
 
 // PRIVATE FUNCTIONS
 
@@ -9,30 +11,100 @@ static int simpleInstruction(const char* name, int offset){
     printf("%s\n", name);
     return offset + 1;
 }
+static int readOperand(Chunk* chunk, int offset, int width){
+    // the big-endian operand of width bytes at offset
+    int operand = 0;
+    for (int i = 0; i < width; i++) operand = operand << 8 | chunk->code[offset + i];
+    return operand;
+}
+// LONG instructions (chunk.h) take three-byte constants and two-byte slots and counts
+static int constantWidth(Chunk* chunk, int offset){
+    return isLongOpcode(chunk->code[offset]) ? 3 : 1;
+}
+static int countWidth(Chunk* chunk, int offset){
+    return isLongOpcode(chunk->code[offset]) ? 2 : 1;
+}
 static int constantInstruction(const char* name, Chunk* chunk, int offset){
-    uint8_t constant = chunk->code[offset + 1];
+    int width = constantWidth(chunk, offset);
+    int constant = readOperand(chunk, offset + 1, width);
     printf("%-16s %4d '", name, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
-    return offset + 2;
+    return offset + 1 + width;
 }
 static int byteInstruction(const char* name, Chunk* chunk, int offset){
-    uint8_t constant = chunk->code[offset + 1];
+    int width = countWidth(chunk, offset);
+    int constant = readOperand(chunk, offset + 1, width);
     printf("%-16s %4d \n", name, constant);
-    return offset + 2;
+    return offset + 1 + width;
+}
+static int globalSlotInstruction(const char* name, Chunk* chunk, int offset){
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    if (slot < vm.globalCount) printValue(vm.globalSlots[slot].name);
+    printf("'\n");
+    return offset + 3;
+}
+static int jumpInstruction(const char* name, Chunk* chunk, int offset){
+    printf("%-16s %04d -> %04d\n", name, offset, jumpTarget(chunk, offset));
+    return offset + opcodeLength(chunk->code[offset]);
 }
-static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset){
-    uint16_t jump = (uint16_t)chunk->code[offset + 1] | chunk->code[offset + 2];
-    printf("%-16s %04d -> %04d\n", name, offset, offset + 3 + (sign * jump));
+static int localConstantInstruction(const char* name, Chunk* chunk, int offset){
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
     return offset + 3;
 }
+static int twoByteInstruction(const char* name, Chunk* chunk, int offset){
+    printf("%-16s %4d %4d\n", name, chunk->code[offset + 1], chunk->code[offset + 2]);
+    return offset + 3;
+}
+static int outerLocalInstruction(const char* name, Chunk* chunk, int offset){
+    // upvalue, then the slot it stands for
+    int width = countWidth(chunk, offset);
+    int upvalue = readOperand(chunk, offset + 1, width);
+    int slot = readOperand(chunk, offset + 1 + width, width);
+    printf("%-16s %4d %4d\n", name, upvalue, slot);
+    return offset + 1 + 2 * width;
+}
 static int invokeInstruction(const char* name, Chunk* chunk, int offset){
-    uint8_t constant = chunk->code[offset + 1];
-    uint8_t argCount = chunk->code[offset + 2];
+    int width = constantWidth(chunk, offset);
+    int constant = readOperand(chunk, offset + 1, width);
+    int argCount = readOperand(chunk, offset + 1 + width, countWidth(chunk, offset));
     printf("%-16s %4d '", name, constant);
     printValue(chunk->constants.values[constant]);
     printf("' (%d args)\n", argCount);
-    return offset + 3;
+    return offset + 1 + width + countWidth(chunk, offset);
+}
+static int checkCalleeInstruction(const char* name, Chunk* chunk, int offset){
+    int width = constantWidth(chunk, offset);
+    int constant = readOperand(chunk, offset + 1, width);
+    int argCount = readOperand(chunk, offset + 1 + width, countWidth(chunk, offset));
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' (%d args) -> %04d\n", argCount, jumpTarget(chunk, offset));
+    return offset + opcodeLength(chunk->code[offset]);
+}
+static int cachedConstantInstruction(const char* name, Chunk* chunk, int offset){
+    int width = constantWidth(chunk, offset);
+    int constant = readOperand(chunk, offset + 1, width);
+    int cache = readOperand(chunk, offset + 1 + width, 2);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' [ic %d]\n", cache);
+    return offset + 3 + width;
+}
+static int cachedInvokeInstruction(const char* name, Chunk* chunk, int offset){
+    int width = constantWidth(chunk, offset);
+    int constant = readOperand(chunk, offset + 1, width);
+    int argCount = readOperand(chunk, offset + 1 + width, countWidth(chunk, offset));
+    int cache = readOperand(chunk, offset + 1 + width + countWidth(chunk, offset), 2);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' (%d args) [ic %d]\n", argCount, cache);
+    return offset + 3 + width + countWidth(chunk, offset);
 }
 
 
@@ -44,6 +116,16 @@ void disassembleChunk(Chunk* chunk, const char* name){
         // offset is incremented in disassembleInstruction
         offset = disassembleInstruction(chunk, offset);
     }
+    for (int i = 0; i < chunk->handlerCount; i++){
+        ExceptionHandler* handler = &chunk->handlers[i];
+        printf("try %04d-%04d catch %04d depth %d\n", handler->start, handler->end, handler->handler, handler->depth);
+    }
+    for (int i = 0; i < chunk->inlinedCount; i++){
+        InlinedCall* inlined = &chunk->inlined[i];
+        printf("inlined %04d-%04d ", inlined->start, inlined->end);
+        printValue(chunk->constants.values[inlined->function]);
+        printf(" line %d\n", inlined->line);
+    }
 }
 
 int disassembleInstruction(Chunk* chunk, int offset){
@@ -62,6 +144,8 @@ int disassembleInstruction(Chunk* chunk, int offset){
     switch (instruction){
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
+        case OP_CONSTANT_LONG:
+            return constantInstruction("OP_CONSTANT_LONG", chunk, offset);
 
         case OP_NIL:       return simpleInstruction("OP_NIL", offset);
         case OP_TRUE:      return simpleInstruction("OP_TRUE", offset);
@@ -70,23 +154,53 @@ int disassembleInstruction(Chunk* chunk, int offset){
         case OP_POP:       return simpleInstruction("OP_POP", offset);
         case OP_POPN:
             return byteInstruction("OP_POPN", chunk, offset);
+        case OP_POP_UNDER:
+            return byteInstruction("OP_POP_UNDER", chunk, offset);
 
         case OP_DEFINE_GLOBAL:
             return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        case OP_DEFINE_GLOBAL_LONG:
+            return constantInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
         case OP_GET_GLOBAL:
             return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL_LONG:
+            return constantInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
         case OP_SET_GLOBAL:
             return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_SET_GLOBAL_LONG:
+            return constantInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+        case OP_GET_GLOBAL_SLOT:
+            return globalSlotInstruction("OP_GET_GLOBAL_SLOT", chunk, offset);
+        case OP_SET_GLOBAL_SLOT:
+            return globalSlotInstruction("OP_SET_GLOBAL_SLOT", chunk, offset);
         case OP_GET_LOCAL:
             return  byteInstruction("OP_GET_LOCAL", chunk, offset);
+        case OP_GET_LOCAL_LONG:
+            return byteInstruction("OP_GET_LOCAL_LONG", chunk, offset);
         case OP_SET_LOCAL:
             return  byteInstruction("OP_SET_LOCAL", chunk, offset);
+        case OP_SET_LOCAL_LONG:
+            return byteInstruction("OP_SET_LOCAL_LONG", chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+        case OP_GET_UPVALUE_LONG:
+            return byteInstruction("OP_GET_UPVALUE_LONG", chunk, offset);
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+        case OP_SET_UPVALUE_LONG:
+            return byteInstruction("OP_SET_UPVALUE_LONG", chunk, offset);
+        case OP_GET_OUTER_LOCAL:
+            return outerLocalInstruction("OP_GET_OUTER_LOCAL", chunk, offset);
+        case OP_GET_OUTER_LOCAL_LONG:
+            return outerLocalInstruction("OP_GET_OUTER_LOCAL_LONG", chunk, offset);
+        case OP_SET_OUTER_LOCAL:
+            return outerLocalInstruction("OP_SET_OUTER_LOCAL", chunk, offset);
+        case OP_SET_OUTER_LOCAL_LONG:
+            return outerLocalInstruction("OP_SET_OUTER_LOCAL_LONG", chunk, offset);
         case OP_GET_STL:
             return constantInstruction("OP_GET_STL", chunk, offset);
+        case OP_GET_STL_LONG:
+            return constantInstruction("OP_GET_STL_LONG", chunk, offset);
 
         case OP_EQUAL:      return simpleInstruction("OP_EQUAL", offset);
         case OP_GREATER:    return simpleInstruction("OP_GREATER", offset);
@@ -100,29 +214,63 @@ int disassembleInstruction(Chunk* chunk, int offset){
         case OP_NOT:        return simpleInstruction("OP_NOT", offset);
         case OP_NEGATE:     return simpleInstruction("OP_NEGATE", offset);
 
+        case OP_GREATER_NUM:    return simpleInstruction("OP_GREATER_NUM", offset);
+        case OP_LESS_NUM:       return simpleInstruction("OP_LESS_NUM", offset);
+        case OP_ADD_NUM:        return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_SUBTRACT_NUM:   return simpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM:   return simpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OP_DIVIDE_NUM:     return simpleInstruction("OP_DIVIDE_NUM", offset);
+
         case OP_PRINT:      return simpleInstruction("OP_PRINT", offset);
+        case OP_BUILD_STRING:
+            return byteInstruction("OP_BUILD_STRING", chunk, offset);
+        case OP_BUILD_STRING_LONG:
+            return byteInstruction("OP_BUILD_STRING_LONG", chunk, offset);
 
         case OP_JUMP_IF_FALSE:
-            return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+            return jumpInstruction("OP_JUMP_IF_FALSE", chunk, offset);
+        case OP_JUMP_IF_FALSE_LONG:
+            return jumpInstruction("OP_JUMP_IF_FALSE_LONG", chunk, offset);
         case OP_JUMP:
-            return jumpInstruction("OP_JUMP", 1, chunk, offset);
+            return jumpInstruction("OP_JUMP", chunk, offset);
+        case OP_JUMP_LONG:
+            return jumpInstruction("OP_JUMP_LONG", chunk, offset);
         case OP_LOOP:
-            return jumpInstruction("OP_LOOP", -1, chunk, offset);
+            return jumpInstruction("OP_LOOP", chunk, offset);
+        case OP_LOOP_LONG:
+            return jumpInstruction("OP_LOOP_LONG", chunk, offset);
 
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
-        case OP_CLOSURE: {
-            offset++;
-            uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
+        case OP_CALL_LONG:
+            return byteInstruction("OP_CALL_LONG", chunk, offset);
+        case OP_CHECK_CALLEE:
+            return checkCalleeInstruction("OP_CHECK_CALLEE", chunk, offset);
+        case OP_CHECK_CALLEE_LONG:
+            return checkCalleeInstruction("OP_CHECK_CALLEE_LONG", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
+        case OP_TAIL_CALL_LONG:
+            return byteInstruction("OP_TAIL_CALL_LONG", chunk, offset);
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG: {
+            int width = countWidth(chunk, offset);
+            int constant = readOperand(chunk, offset + 1, constantWidth(chunk, offset));
+            offset += 1 + constantWidth(chunk, offset);
+            printf("%-16s %4d ", instruction == OP_CLOSURE ? "OP_CLOSURE" : "OP_CLOSURE_LONG", constant);
             printValue(chunk->constants.values[constant]);
             printf("\n");
             ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+            static const char* kinds[] = {
+                [UPVALUE_INHERITED] = "upvalue", [UPVALUE_LOCAL] = "local  ",
+                [UPVALUE_IN_PLACE] = "in place", [UPVALUE_IN_PLACE_ARRAY] = "in place (array)"
+            };
             for (int j = 0; j < function->upvalueCount; j++){
-                int isLocal = chunk->code[offset++];
-                int index = chunk->code[offset++];
+                int kind = chunk->code[offset];
+                int index = readOperand(chunk, offset + 1, width);
                 printf("%04d      |                     %s %d\n",
-                    offset - 2, isLocal ? "local  " : "upvalue", index);
+                    offset, kind <= UPVALUE_IN_PLACE_ARRAY ? kinds[kind] : "?", index);
+                offset += 1 + width;
             }
             return offset;
         }
@@ -131,31 +279,65 @@ int disassembleInstruction(Chunk* chunk, int offset){
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
 
-        case OP_TRY_CALL:
-            return simpleInstruction("OP_TRY_CALL", offset);
         case OP_THROW:
             return simpleInstruction("OP_THROW", offset);
             
         case OP_CLASS:
             return constantInstruction("OP_CLASS", chunk, offset);
+        case OP_CLASS_LONG:
+            return constantInstruction("OP_CLASS_LONG", chunk, offset);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return cachedConstantInstruction("OP_GET_PROPERTY", chunk, offset);
+        case OP_GET_PROPERTY_LONG:
+            return cachedConstantInstruction("OP_GET_PROPERTY_LONG", chunk, offset);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return cachedConstantInstruction("OP_SET_PROPERTY", chunk, offset);
+        case OP_SET_PROPERTY_LONG:
+            return cachedConstantInstruction("OP_SET_PROPERTY_LONG", chunk, offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_METHOD_LONG:
+            return constantInstruction("OP_METHOD_LONG", chunk, offset);
         case OP_STATIC_METHOD:
             return constantInstruction("OP_STATIC_METHOD", chunk, offset);
+        case OP_STATIC_METHOD_LONG:
+            return constantInstruction("OP_STATIC_METHOD_LONG", chunk, offset);
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", chunk, offset);
+            return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
+        case OP_INVOKE_LONG:
+            return cachedInvokeInstruction("OP_INVOKE_LONG", chunk, offset);
         case OP_INHERIT:
             return simpleInstruction("OP_INHERIT", offset);
         case OP_INHERIT_MULTIPLE:
             return simpleInstruction("OP_INHERIT_MULTIPLE", offset);
         case OP_GET_SUPER:
             return constantInstruction("OP_GET_SUPER", chunk, offset);
+        case OP_GET_SUPER_LONG:
+            return constantInstruction("OP_GET_SUPER_LONG", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+        case OP_SUPER_INVOKE_LONG:
+            return invokeInstruction("OP_SUPER_INVOKE_LONG", chunk, offset);
+
+        case OP_INDEX_GET:
+            return byteInstruction("OP_INDEX_GET", chunk, offset);
+        case OP_INDEX_SET:
+            return byteInstruction("OP_INDEX_SET", chunk, offset);
+        case OP_INDEX_UPDATE:
+            return byteInstruction("OP_INDEX_UPDATE", chunk, offset);
+
+        case OP_ADD_LOCAL_CONSTANT:
+            return localConstantInstruction("OP_ADD_LOCAL_CONSTANT", chunk, offset);
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            return localConstantInstruction("OP_SUBTRACT_LOCAL_CONSTANT", chunk, offset);
+        case OP_LESS_LOCAL_CONSTANT:
+            return localConstantInstruction("OP_LESS_LOCAL_CONSTANT", chunk, offset);
+        case OP_LESS_LOCAL_LOCAL:
+            return twoByteInstruction("OP_LESS_LOCAL_LOCAL", chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_JUMP_IF_FALSE_POP:
+            return jumpInstruction("OP_JUMP_IF_FALSE_POP", chunk, offset);
 
         default:
             // If this reaches, something went wrong.
@@ -172,4 +354,267 @@ void dumpRaw(Chunk* chunk, const char* name){
             printf("\n");
         printf("0x%02x ", chunk->code[i]);
     }
-}
\ No newline at end of file
+}
+
+
+// INSTRUMENTATION HOOKS
+
+void traceExecution(CallFrame* frame, uint8_t* ip){
+    // prints the stack, then disassembles the instruction about to execute
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++){
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    Chunk* chunk = &getFrameFunction(frame)->chunk;
+    disassembleInstruction(chunk, (int)(ip - chunk->code));
+}
+
+// dynamic opcode and opcode-pair counts, gathered by profileExecution
+static uint64_t opcodeCounts[UINT8_COUNT];
+static uint64_t opcodePairCounts[UINT8_COUNT][UINT8_COUNT];
+static int previousOpcode = -1;
+
+void profileExecution(CallFrame* frame, uint8_t* ip){
+    (void)frame;
+    opcodeCounts[*ip]++;
+    if (previousOpcode != -1) opcodePairCounts[previousOpcode][*ip]++;
+    previousOpcode = *ip;
+}
+
+static const char* opcodeName(uint8_t opcode){
+    static const char* names[UINT8_COUNT] = {
+        [OP_CONSTANT] = "OP_CONSTANT",
+        [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+        [OP_NIL] = "OP_NIL",
+        [OP_TRUE] = "OP_TRUE",
+        [OP_FALSE] = "OP_FALSE",
+        [OP_DUPLICATE] = "OP_DUPLICATE",
+        [OP_POP] = "OP_POP",
+        [OP_POPN] = "OP_POPN",
+        [OP_POP_UNDER] = "OP_POP_UNDER",
+
+        [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+        [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+        [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+        [OP_GET_GLOBAL_LONG] = "OP_GET_GLOBAL_LONG",
+        [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+        [OP_SET_GLOBAL_LONG] = "OP_SET_GLOBAL_LONG",
+        [OP_GET_GLOBAL_SLOT] = "OP_GET_GLOBAL_SLOT",
+        [OP_SET_GLOBAL_SLOT] = "OP_SET_GLOBAL_SLOT",
+        [OP_GET_LOCAL] = "OP_GET_LOCAL",
+        [OP_GET_LOCAL_LONG] = "OP_GET_LOCAL_LONG",
+        [OP_SET_LOCAL] = "OP_SET_LOCAL",
+        [OP_SET_LOCAL_LONG] = "OP_SET_LOCAL_LONG",
+        [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+        [OP_GET_UPVALUE_LONG] = "OP_GET_UPVALUE_LONG",
+        [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+        [OP_SET_UPVALUE_LONG] = "OP_SET_UPVALUE_LONG",
+        [OP_GET_OUTER_LOCAL] = "OP_GET_OUTER_LOCAL",
+        [OP_GET_OUTER_LOCAL_LONG] = "OP_GET_OUTER_LOCAL_LONG",
+        [OP_SET_OUTER_LOCAL] = "OP_SET_OUTER_LOCAL",
+        [OP_SET_OUTER_LOCAL_LONG] = "OP_SET_OUTER_LOCAL_LONG",
+        [OP_GET_STL] = "OP_GET_STL",
+        [OP_GET_STL_LONG] = "OP_GET_STL_LONG",
+
+        [OP_EQUAL] = "OP_EQUAL",
+        [OP_GREATER] = "OP_GREATER",
+        [OP_LESS] = "OP_LESS",
+        [OP_ADD] = "OP_ADD",
+        [OP_SUBTRACT] = "OP_SUBTRACT",
+        [OP_MULTIPLY] = "OP_MULTIPLY",
+        [OP_DIVIDE] = "OP_DIVIDE",
+        [OP_NOT] = "OP_NOT",
+        [OP_NEGATE] = "OP_NEGATE",
+
+        [OP_GREATER_NUM] = "OP_GREATER_NUM",
+        [OP_LESS_NUM] = "OP_LESS_NUM",
+        [OP_ADD_NUM] = "OP_ADD_NUM",
+        [OP_SUBTRACT_NUM] = "OP_SUBTRACT_NUM",
+        [OP_MULTIPLY_NUM] = "OP_MULTIPLY_NUM",
+        [OP_DIVIDE_NUM] = "OP_DIVIDE_NUM",
+
+        [OP_PRINT] = "OP_PRINT",
+        [OP_BUILD_STRING] = "OP_BUILD_STRING",
+        [OP_BUILD_STRING_LONG] = "OP_BUILD_STRING_LONG",
+        [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+        [OP_JUMP_IF_FALSE_LONG] = "OP_JUMP_IF_FALSE_LONG",
+        [OP_JUMP] = "OP_JUMP",
+        [OP_JUMP_LONG] = "OP_JUMP_LONG",
+        [OP_LOOP] = "OP_LOOP",
+        [OP_LOOP_LONG] = "OP_LOOP_LONG",
+
+        [OP_CALL] = "OP_CALL",
+        [OP_CALL_LONG] = "OP_CALL_LONG",
+        [OP_TAIL_CALL] = "OP_TAIL_CALL",
+        [OP_TAIL_CALL_LONG] = "OP_TAIL_CALL_LONG",
+        [OP_CHECK_CALLEE] = "OP_CHECK_CALLEE",
+        [OP_CHECK_CALLEE_LONG] = "OP_CHECK_CALLEE_LONG",
+        [OP_CLOSURE] = "OP_CLOSURE",
+        [OP_CLOSURE_LONG] = "OP_CLOSURE_LONG",
+        [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+        [OP_RETURN] = "OP_RETURN",
+
+        [OP_THROW] = "OP_THROW",
+
+        [OP_CLASS] = "OP_CLASS",
+        [OP_CLASS_LONG] = "OP_CLASS_LONG",
+        [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+        [OP_GET_PROPERTY_LONG] = "OP_GET_PROPERTY_LONG",
+        [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+        [OP_SET_PROPERTY_LONG] = "OP_SET_PROPERTY_LONG",
+        [OP_METHOD] = "OP_METHOD",
+        [OP_METHOD_LONG] = "OP_METHOD_LONG",
+        [OP_STATIC_METHOD] = "OP_STATIC_METHOD",
+        [OP_STATIC_METHOD_LONG] = "OP_STATIC_METHOD_LONG",
+        [OP_INVOKE] = "OP_INVOKE",
+        [OP_INVOKE_LONG] = "OP_INVOKE_LONG",
+        [OP_INHERIT] = "OP_INHERIT",
+        [OP_INHERIT_MULTIPLE] = "OP_INHERIT_MULTIPLE",
+        [OP_GET_SUPER] = "OP_GET_SUPER",
+        [OP_GET_SUPER_LONG] = "OP_GET_SUPER_LONG",
+        [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+        [OP_SUPER_INVOKE_LONG] = "OP_SUPER_INVOKE_LONG",
+        [OP_INDEX_GET] = "OP_INDEX_GET",
+        [OP_INDEX_SET] = "OP_INDEX_SET",
+        [OP_INDEX_UPDATE] = "OP_INDEX_UPDATE",
+
+        [OP_ADD_LOCAL_CONSTANT] = "OP_ADD_LOCAL_CONSTANT",
+        [OP_SUBTRACT_LOCAL_CONSTANT] = "OP_SUBTRACT_LOCAL_CONSTANT",
+        [OP_LESS_LOCAL_CONSTANT] = "OP_LESS_LOCAL_CONSTANT",
+        [OP_LESS_LOCAL_LOCAL] = "OP_LESS_LOCAL_LOCAL",
+        [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+        [OP_JUMP_IF_FALSE_POP] = "OP_JUMP_IF_FALSE_POP"
+    };
+    return names[opcode] != NULL ? names[opcode] : "<unknown>";
+}
+
+void printProfile(){
+    // prints every executed opcode, then the most frequent opcode pairs, onto stderr
+    #define PROFILE_TOP_PAIRS 16
+
+    uint64_t total = 0;
+    for (int i = 0; i < UINT8_COUNT; i++) total += opcodeCounts[i];
+    fprintf(stderr, "== opcode profile (%llu instructions) ==\n", (unsigned long long)total);
+    if (total == 0) return;
+    for (int i = 0; i < UINT8_COUNT; i++){
+        if (opcodeCounts[i] == 0) continue;
+        fprintf(stderr, "%-20s %12llu %6.2f%%\n", opcodeName((uint8_t)i),
+            (unsigned long long)opcodeCounts[i], 100.0 * opcodeCounts[i] / total);
+    }
+
+    // selection of the most frequent pairs; the pair table is left untouched
+    int top[PROFILE_TOP_PAIRS];
+    int topCount = 0;
+    for (int pair = 0; pair < UINT8_COUNT * UINT8_COUNT; pair++){
+        uint64_t count = opcodePairCounts[pair >> 8][pair & 0xff];
+        if (count == 0) continue;
+        int pos = topCount < PROFILE_TOP_PAIRS ? topCount++ : PROFILE_TOP_PAIRS;
+        while (pos > 0 && opcodePairCounts[top[pos - 1] >> 8][top[pos - 1] & 0xff] < count){
+            if (pos < PROFILE_TOP_PAIRS) top[pos] = top[pos - 1];
+            pos--;
+        }
+        if (pos < PROFILE_TOP_PAIRS) top[pos] = pair;
+    }
+    fprintf(stderr, "== most frequent opcode pairs ==\n");
+    for (int i = 0; i < topCount; i++){
+        uint64_t count = opcodePairCounts[top[i] >> 8][top[i] & 0xff];
+        fprintf(stderr, "%-20s %-20s %12llu %6.2f%%\n", opcodeName((uint8_t)(top[i] >> 8)),
+            opcodeName((uint8_t)(top[i] & 0xff)), (unsigned long long)count, 100.0 * count / total);
+    }
+
+    #undef PROFILE_TOP_PAIRS
+}
+
+void printFunctionCode(ObjFunction* function){
+    disassembleChunk(&function->chunk, (function->name != NULL ? function->name->chars : "<script>"));
+}
+
+static void printIrValue(IrFunction* ir, int v){
+    if (v == -1){
+        printf(" -");
+        return;
+    }
+    printf(" v%d", irValue(ir, v));
+}
+static void printIrConstant(IrFunction* ir, int v){
+    IrValue* value = &ir->values[irValue(ir, v)];
+    if (value->lattice != IR_CONSTANT) return;
+    printf(" = ");
+    printValue(value->constant);
+}
+static void printIrInstruction(IrFunction* ir, IrInstruction* instruction){
+    printf("  %04d %s%s", instruction->offset, instruction->fused ? "+" : "", opcodeName(instruction->opcode));
+    if (instruction->operand >= 0) printf(" %d", instruction->operand);
+    // OP_SET_LOCAL to a captured slot is not a store
+    bool stores = instruction->read != -1 && ir->values[instruction->read].kind == IR_STORE
+        && (instruction->opcode == OP_SET_LOCAL || instruction->opcode == OP_SET_LOCAL_LONG);
+    printf(" (");
+    if (stores) printIrValue(ir, ir->values[instruction->read].inputs);
+    else if (instruction->read != -1) printIrValue(ir, instruction->read);
+    for (int a = 0; a < instruction->argCount; a++) printIrValue(ir, ir->args[instruction->args + a]);
+    printf(" )");
+    if (stores) printf(" -> v%d", instruction->read);
+    for (int r = 0; r < instruction->resultCount; r++){
+        printf("%s v%d", r == 0 ? " ->" : "", instruction->result + r);
+    }
+    if (instruction->resultCount == 1) printIrConstant(ir, instruction->result);
+    else if (instruction->read != -1) printIrConstant(ir, instruction->read);
+    switch (instruction->rewrite){
+        case IR_LOAD_CONSTANT:
+            printf("  [literal]");
+            break;
+        case IR_LOAD_SLOT:
+            printf("  [OP_GET_LOCAL %d]", instruction->rewriteOperand);
+            break;
+        case IR_REMOVE:
+            printf("  [dead store]");
+            break;
+        default:
+            break;
+    }
+    printf("\n");
+}
+
+void printFunctionIr(ObjFunction* function){
+    printf("== %s ==\n", function->name != NULL ? function->name->chars : "<script>");
+    IrFunction ir;
+    if (!buildIr(&ir, &function->chunk, function->arity)){
+        printf("(no SSA form)\n");
+        return;
+    }
+    optimizeIr(&ir);
+    for (int b = 0; b < ir.blockCount; b++){
+        IrBlock* block = &ir.blocks[b];
+        printf("b%d %04d", b, block->start);
+        if (!block->reachable){
+            printf(" unreachable\n");
+            continue;
+        }
+        if (block->catchDepth >= 0) printf(" catch");
+        if (block->predCount > 0) printf(" <-");
+        for (int p = 0; p < block->predCount; p++){
+            if (block->preds[p] == -1) printf(" entry");
+            else printf(" b%d", block->preds[p]);
+        }
+        if (block->successorCount > 0) printf(" ->");
+        for (int s = 0; s < block->successorCount; s++) printf(" b%d", block->successors[s]);
+        printf("\n");
+
+        for (int slot = 0; slot < block->height; slot++){
+            int v = block->entry[slot];
+            IrValue* value = &ir.values[v];
+            if (value->kind != IR_PHI || value->block != b || value->replacement != v) continue;
+            printf("  v%d = phi", v);
+            for (int p = 0; p < block->predCount; p++) printIrValue(&ir, ir.inputs[value->inputs + p]);
+            printf(" (slot %d)", slot);
+            printIrConstant(&ir, v);
+            printf("\n");
+        }
+        for (int i = block->first; i < block->end; i++){
+            printIrInstruction(&ir, &ir.instructions[i]);
+        }
+    }
+    freeIr(&ir);
+}
@@ -2,10 +2,22 @@
 #define clox_debug_h
 
 #include "chunk.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
 
 void dumpRaw(Chunk* chunk, const char* name);
 
+// INSTRUMENTATION HOOKS
+// (installed through vm.instructionHook and vm.compileHook)
+
+void traceExecution(CallFrame* frame, uint8_t* ip);
+void profileExecution(CallFrame* frame, uint8_t* ip);
+void printProfile();
+
+void printFunctionCode(ObjFunction* function);
+// the SSA form of the function and what the optimizer would do with it (ir.h)
+void printFunctionIr(ObjFunction* function);
+
 #endif
\ No newline at end of file
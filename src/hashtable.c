@@ -60,6 +60,13 @@ uint32_t getHash(Value value){
             case OBJ_INSTANCE:
             case OBJ_BOUND_METHOD:
                 return HASH_POINTER(AS_OBJ(value));
+            case OBJ_EXCEPTION:
+            case OBJ_ARRAY_SLICE:
+                return 0;    // no hash of their own
+            case OBJ_UPVALUE:
+            case OBJ_SHAPE:
+            case OBJ_TYPE_COUNT:
+                break;    // Unreachable: never keys.
         }
     }
     return 0;    // Unreachable.
@@ -208,8 +215,8 @@ ObjString* tableFindString(HashTable* table, const char* string, int length, uin
 void tableRemoveWhite(HashTable* table){
     for (int i = 0; i < table->capacity; i++){
         Entry* entry = &table->entries[i];
-        if (!IS_EMPTY(entry->key) && IS_OBJ(entry->value) && !(isMarked(AS_OBJ(entry->value))) ){
-            // storing reference to unreachable object. delete entry
+        if (IS_OBJ(entry->key) && !isMarked(AS_OBJ(entry->key))){
+            // unreachable key (interned string about to be freed). delete entry
             tableDelete(table, entry->key);
         }
     }
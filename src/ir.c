@@ -0,0 +1,910 @@
+#include <stdlib.h>
+
+#include "ir.h"
+#include "object.h"
+#include "optimizer.h"
+
+// The IR's arrays live outside the garbage collector, like the optimizer's: nothing here is a Lox object
+// (constants stay reachable through the chunk).
+#define IR_GROW(type, array, count, capacity) \
+    do { \
+        if ((count) + 1 > (capacity)){ \
+            (capacity) = (capacity) < 8 ? 8 : (capacity) * 2; \
+            (array) = realloc((array), sizeof(type) * (capacity)); \
+            if ((array) == NULL) exit(1); \
+        } \
+    } while (false)
+
+typedef struct {
+    IrFunction* ir;
+    int block;
+    int* slots;         // the value in each slot
+    int height;
+    int capacity;
+    bool failed;
+} Builder;
+
+
+// VALUES AND INSTRUCTIONS
+
+static int newValue(IrFunction* ir, IrValueKind kind, int block, int slot){
+    IR_GROW(IrValue, ir->values, ir->valueCount, ir->valueCapacity);
+    IrValue* value = &ir->values[ir->valueCount];
+    value->kind = kind;
+    value->block = block;
+    value->slot = slot;
+    value->instruction = -1;
+    value->inputs = -1;
+    value->replacement = ir->valueCount;
+    value->lattice = IR_UNDEFINED;
+    value->constant = NIL_VAL();
+    value->caught = false;
+    value->live = false;
+    return ir->valueCount++;
+}
+int irValue(IrFunction* ir, int v){
+    while (ir->values[v].replacement != v) v = ir->values[v].replacement;
+    return v;
+}
+static int rootOf(IrFunction* ir, int v){
+    // the value a chain of stores and loads copied
+    while (ir->values[v].kind != IR_PHI && ir->values[v].inputs != -1) v = ir->values[v].inputs;
+    return v;
+}
+static bool isCaptured(IrFunction* ir, int slot){
+    return slot < ir->slotCount && ir->captured[slot];
+}
+
+static void push(Builder* builder, int value){
+    IR_GROW(int, builder->slots, builder->height, builder->capacity);
+    builder->slots[builder->height++] = value;
+}
+static void popArgs(Builder* builder, IrInstruction* instruction, int count, bool keep){
+    // the top count values become the instruction's operands, bottom first; keep leaves them on the stack
+    IrFunction* ir = builder->ir;
+    if (count > builder->height){
+        builder->failed = true;
+        return;
+    }
+    instruction->args = ir->argCount;
+    instruction->argCount = count;
+    for (int i = builder->height - count; i < builder->height; i++){
+        IR_GROW(int, ir->args, ir->argCount, ir->argCapacity);
+        ir->args[ir->argCount++] = builder->slots[i];
+    }
+    if (!keep) builder->height -= count;
+}
+static void pushResults(Builder* builder, int instruction, int count){
+    IrFunction* ir = builder->ir;
+    ir->instructions[instruction].result = ir->valueCount;
+    ir->instructions[instruction].resultCount = count;
+    for (int i = 0; i < count; i++){
+        int value = newValue(ir, IR_RESULT, builder->block, builder->height);
+        ir->values[value].instruction = instruction;
+        push(builder, value);
+    }
+}
+static int addInstruction(IrFunction* ir, int offset, uint8_t opcode, bool fused){
+    IR_GROW(IrInstruction, ir->instructions, ir->instructionCount, ir->instructionCapacity);
+    IrInstruction* instruction = &ir->instructions[ir->instructionCount];
+    instruction->offset = offset;
+    instruction->opcode = opcode;
+    instruction->fused = fused;
+    instruction->operand = -1;
+    instruction->args = ir->argCount;
+    instruction->argCount = 0;
+    instruction->result = -1;
+    instruction->resultCount = 0;
+    instruction->read = -1;
+    instruction->copySlot = -1;
+    instruction->copyValue = -1;
+    instruction->rewrite = IR_KEEP;
+    instruction->rewriteOperand = -1;
+    return ir->instructionCount++;
+}
+
+
+// BUILDING
+
+static int readOperand(uint8_t* code, int width){
+    int operand = 0;
+    for (int i = 0; i < width; i++) operand = operand << 8 | code[i];
+    return operand;
+}
+static bool isBranch(int opcode){
+    switch (opcode){
+        case OP_JUMP:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_JUMP_IF_FALSE_POP:
+        case OP_LOOP:
+        case OP_LOOP_LONG:
+        case OP_CHECK_CALLEE:
+        case OP_CHECK_CALLEE_LONG:
+            return true;
+        default:
+            return false;
+    }
+}
+static bool fallsThrough(int opcode){
+    switch (opcode){
+        case OP_JUMP:
+        case OP_JUMP_LONG:
+        case OP_LOOP:
+        case OP_LOOP_LONG:
+        case OP_RETURN:
+        case OP_THROW:
+            return false;
+        default:
+            return true;
+    }
+}
+
+static void simulate(Builder* builder, int offset, uint8_t opcode, uint8_t* operands, bool fused){
+    // follows one instruction (or one part of a superinstruction) through the slots
+    IrFunction* ir = builder->ir;
+    int i = addInstruction(ir, offset, opcode, fused);
+    IrInstruction* instruction = &ir->instructions[i];
+    int constantWidth = isLongOpcode(opcode) ? 3 : 1;
+    int countWidth = isLongOpcode(opcode) ? 2 : 1;
+
+    switch (opcode){
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            instruction->operand = readOperand(operands, constantWidth);
+            pushResults(builder, i, 1);
+            break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_GLOBAL_SLOT:
+        case OP_GET_UPVALUE:
+        case OP_GET_UPVALUE_LONG:
+        case OP_GET_OUTER_LOCAL:
+        case OP_GET_OUTER_LOCAL_LONG:
+        case OP_GET_STL:
+        case OP_GET_STL_LONG:
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
+        case OP_CLASS:
+        case OP_CLASS_LONG:
+            pushResults(builder, i, 1);
+            break;
+        case OP_DUPLICATE: {
+            int depth = operands[0];
+            instruction->operand = depth;
+            if (depth >= builder->height){
+                builder->failed = true;
+                break;
+            }
+            instruction->read = builder->slots[builder->height - 1 - depth];
+            push(builder, instruction->read);
+            break;
+        }
+        case OP_POP:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_THROW:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_METHOD:
+        case OP_METHOD_LONG:
+        case OP_STATIC_METHOD:
+        case OP_STATIC_METHOD_LONG:
+        case OP_INHERIT:
+        case OP_INHERIT_MULTIPLE:
+            popArgs(builder, instruction, 1, false);
+            break;
+        case OP_POPN:
+            instruction->operand = operands[0];
+            popArgs(builder, instruction, operands[0], false);
+            break;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_SLOT:
+        case OP_SET_UPVALUE:
+        case OP_SET_UPVALUE_LONG:
+        case OP_SET_OUTER_LOCAL:
+        case OP_SET_OUTER_LOCAL_LONG:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+            popArgs(builder, instruction, 1, true);
+            break;
+        case OP_JUMP:
+        case OP_JUMP_LONG:
+        case OP_LOOP:
+        case OP_LOOP_LONG:
+            break;
+
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG: {
+            int slot = readOperand(operands, countWidth);
+            instruction->operand = slot;
+            if (slot >= builder->height){
+                builder->failed = true;
+            } else if (isCaptured(ir, slot)){
+                // a closure may have changed it: a value of its own
+                pushResults(builder, i, 1);
+            } else {
+                int value = builder->slots[slot];
+                instruction->read = value;
+                if (ir->values[value].kind == IR_STORE){
+                    // copy propagation: the same value may still be in the slot it was copied from
+                    for (int lower = 0; lower < slot; lower++){
+                        if (!isCaptured(ir, lower) && rootOf(ir, builder->slots[lower]) == rootOf(ir, value)){
+                            instruction->copySlot = lower;
+                            instruction->copyValue = builder->slots[lower];
+                            break;
+                        }
+                    }
+                }
+                // a copy of its own: using it is not reading the slot again
+                pushResults(builder, i, 1);
+                ir->values[builder->slots[builder->height - 1]].inputs = value;
+            }
+            break;
+        }
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG: {
+            int slot = readOperand(operands, countWidth);
+            instruction->operand = slot;
+            if (slot >= builder->height - 1){
+                builder->failed = true;
+            } else if (isCaptured(ir, slot)){
+                popArgs(builder, instruction, 1, true);
+            } else {
+                int store = newValue(ir, IR_STORE, builder->block, slot);
+                ir->values[store].inputs = builder->slots[builder->height - 1];
+                ir->values[store].instruction = i;
+                instruction->read = store;
+                builder->slots[slot] = store;
+            }
+            break;
+        }
+
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_GREATER_NUM:
+        case OP_LESS_NUM:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_LONG:
+        case OP_GET_SUPER:
+        case OP_GET_SUPER_LONG:
+            popArgs(builder, instruction, 2, false);
+            pushResults(builder, i, 1);
+            break;
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_LONG:
+            popArgs(builder, instruction, 1, false);
+            pushResults(builder, i, 1);
+            break;
+
+        case OP_CALL:
+        case OP_CALL_LONG:
+        case OP_TAIL_CALL:
+        case OP_TAIL_CALL_LONG:
+            instruction->operand = readOperand(operands, countWidth);
+            popArgs(builder, instruction, instruction->operand + 1, false);
+            pushResults(builder, i, 1);
+            break;
+        case OP_INVOKE:
+        case OP_INVOKE_LONG:
+            instruction->operand = readOperand(operands + constantWidth, countWidth);
+            popArgs(builder, instruction, instruction->operand + 1, false);
+            pushResults(builder, i, 1);
+            break;
+        case OP_CHECK_CALLEE:
+        case OP_CHECK_CALLEE_LONG:
+            // only compares the callee with a constant
+            break;
+        case OP_BUILD_STRING:
+        case OP_BUILD_STRING_LONG:
+            instruction->operand = readOperand(operands, countWidth);
+            popArgs(builder, instruction, instruction->operand, false);
+            pushResults(builder, i, 1);
+            break;
+        case OP_POP_UNDER:
+            instruction->operand = operands[0];
+            popArgs(builder, instruction, operands[0] + 1, false);
+            pushResults(builder, i, 1);
+            break;
+        case OP_SUPER_INVOKE:
+        case OP_SUPER_INVOKE_LONG:
+            // the superclass sits above the arguments
+            instruction->operand = readOperand(operands + constantWidth, countWidth);
+            popArgs(builder, instruction, instruction->operand + 2, false);
+            pushResults(builder, i, 1);
+            break;
+        case OP_INDEX_GET:
+            instruction->operand = operands[0];
+            popArgs(builder, instruction, operands[0] + 1, false);
+            pushResults(builder, i, 1);
+            break;
+        case OP_INDEX_SET:
+            instruction->operand = operands[0];
+            popArgs(builder, instruction, operands[0] + 2, false);
+            pushResults(builder, i, 1);
+            break;
+        case OP_INDEX_UPDATE:
+            // leaves the receiver and the key beneath the value
+            instruction->operand = operands[0];
+            popArgs(builder, instruction, operands[0] + 1, false);
+            pushResults(builder, i, 3);
+            break;
+
+        default:
+            builder->failed = true;
+            break;
+    }
+}
+
+static void findCaptures(IrFunction* ir){
+    // slots any closure in the chunk captures, in any scope
+    Chunk* chunk = ir->chunk;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)){
+        uint8_t opcode = chunk->code[offset];
+        if (opcode != OP_CLOSURE && opcode != OP_CLOSURE_LONG) continue;
+        int constantWidth = opcode == OP_CLOSURE_LONG ? 3 : 1;
+        int slotWidth = opcode == OP_CLOSURE_LONG ? 2 : 1;
+        ObjFunction* function = AS_FUNCTION(chunk->constants.values[readOperand(chunk->code + offset + 1, constantWidth)]);
+        uint8_t* upvalue = chunk->code + offset + 1 + constantWidth;
+        for (int i = 0; i < function->upvalueCount; i++, upvalue += 1 + slotWidth){
+            if (!upvalue[0]) continue;
+            int slot = readOperand(upvalue + 1, slotWidth);
+            if (slot >= ir->slotCount){
+                ir->captured = realloc(ir->captured, sizeof(bool) * (slot + 1));
+                if (ir->captured == NULL) exit(1);
+                for (int s = ir->slotCount; s <= slot; s++) ir->captured[s] = false;
+                ir->slotCount = slot + 1;
+            }
+            ir->captured[slot] = true;
+        }
+    }
+}
+
+static void addPred(IrBlock* block, int pred){
+    for (int i = 0; i < block->predCount; i++){
+        if (block->preds[i] == pred) return;
+    }
+    IR_GROW(int, block->preds, block->predCount, block->predCapacity);
+    block->preds[block->predCount++] = pred;
+}
+static bool findBlocks(IrFunction* ir){
+    // splits the code at jump targets, after transfers, and at the bounds of try blocks
+    Chunk* chunk = ir->chunk;
+    bool* leader = calloc(chunk->count + 1, sizeof(bool));
+    int* blockAt = malloc(sizeof(int) * (chunk->count + 1));
+    if (leader == NULL || blockAt == NULL) exit(1);
+    leader[0] = true;
+    for (int offset = 0; offset < chunk->count; ){
+        int next = offset + instructionLength(chunk, offset);
+        uint8_t opcode = chunk->code[offset];
+        if (isBranch(opcode)){
+            int target = jumpTarget(chunk, offset);
+            if (target < 0 || target >= chunk->count){
+                free(leader);
+                free(blockAt);
+                return false;
+            }
+            leader[target] = true;
+        }
+        if (isBranch(opcode) || !fallsThrough(opcode)) leader[next] = true;
+        offset = next;
+    }
+    for (int h = 0; h < chunk->handlerCount; h++){
+        leader[chunk->handlers[h].start] = true;
+        leader[chunk->handlers[h].end] = true;
+        leader[chunk->handlers[h].handler] = true;
+    }
+
+    int* lastOf = NULL;
+    int lastCapacity = 0;
+    ir->blockCount = 0;
+    int blockCapacity = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)){
+        if (leader[offset]){
+            IR_GROW(IrBlock, ir->blocks, ir->blockCount, blockCapacity);
+            IR_GROW(int, lastOf, ir->blockCount, lastCapacity);
+            IrBlock* block = &ir->blocks[ir->blockCount];
+            block->start = offset;
+            block->first = block->end = 0;
+            block->successorCount = 0;
+            block->preds = NULL;
+            block->predCount = block->predCapacity = 0;
+            block->catchDepth = -1;
+            block->reachable = false;
+            block->height = block->exitHeight = block->jumpHeight = 0;
+            block->entry = block->exit = NULL;
+            ir->blockCount++;
+        }
+        blockAt[offset] = ir->blockCount - 1;
+        lastOf[ir->blockCount - 1] = offset;
+    }
+    free(leader);
+
+    addPred(&ir->blocks[0], -1);
+    for (int b = 0; b < ir->blockCount; b++){
+        IrBlock* block = &ir->blocks[b];
+        uint8_t opcode = chunk->code[lastOf[b]];
+        if (fallsThrough(opcode) && b + 1 < ir->blockCount){
+            block->successors[block->successorCount++] = b + 1;
+        }
+        if (isBranch(opcode)){
+            // the jump edge comes last (see edgeHeight)
+            block->successors[block->successorCount++] = blockAt[jumpTarget(chunk, lastOf[b])];
+        }
+        for (int s = 0; s < block->successorCount; s++){
+            addPred(&ir->blocks[block->successors[s]], b);
+        }
+    }
+    bool valid = true;
+    for (int h = 0; h < chunk->handlerCount; h++){
+        IrBlock* block = &ir->blocks[blockAt[chunk->handlers[h].handler]];
+        block->catchDepth = chunk->handlers[h].depth;
+        // a catch block is only entered by throwing
+        if (block->predCount > 0) valid = false;
+    }
+    free(lastOf);
+    free(blockAt);
+    return valid;
+}
+
+static int edgeHeight(IrFunction* ir, int pred, int block){
+    IrBlock* from = &ir->blocks[pred];
+    bool jumps = isBranch(ir->chunk->code[ir->instructions[from->end - 1].offset])
+        && from->successors[from->successorCount - 1] == block;
+    return jumps ? from->jumpHeight : from->exitHeight;
+}
+
+static int* reversePostorder(IrFunction* ir, int* count){
+    // from the entry and from every catch block
+    int* order = malloc(sizeof(int) * ir->blockCount);
+    int* stack = malloc(sizeof(int) * ir->blockCount);
+    int* next = calloc(ir->blockCount, sizeof(int));
+    bool* seen = calloc(ir->blockCount, sizeof(bool));
+    if (order == NULL || stack == NULL || next == NULL || seen == NULL) exit(1);
+    int finished = 0;
+    for (int root = 0; root < ir->blockCount; root++){
+        if (root > 0 && ir->blocks[root].catchDepth < 0) continue;
+        if (seen[root]) continue;
+        int top = 0;
+        stack[top++] = root;
+        seen[root] = true;
+        while (top > 0){
+            IrBlock* block = &ir->blocks[stack[top - 1]];
+            if (next[stack[top - 1]] < block->successorCount){
+                int successor = block->successors[next[stack[top - 1]]++];
+                if (!seen[successor]){
+                    seen[successor] = true;
+                    stack[top++] = successor;
+                }
+            } else {
+                order[finished++] = stack[--top];
+            }
+        }
+    }
+    for (int i = 0; i < finished / 2; i++){
+        int swap = order[i];
+        order[i] = order[finished - 1 - i];
+        order[finished - 1 - i] = swap;
+    }
+    free(stack);
+    free(next);
+    free(seen);
+    *count = finished;
+    return order;
+}
+
+static void buildBlock(Builder* builder, int b){
+    IrFunction* ir = builder->ir;
+    IrBlock* block = &ir->blocks[b];
+    Chunk* chunk = ir->chunk;
+    builder->block = b;
+    builder->height = 0;
+
+    // the slots on entry
+    if (block->catchDepth >= 0){
+        // whatever the try block left in them, then the exception
+        for (int slot = 0; slot <= block->catchDepth; slot++){
+            push(builder, newValue(ir, IR_CATCH, b, slot));
+        }
+    } else if (block->predCount == 1 && block->preds[0] == -1){
+        for (int slot = 0; slot < ir->paramCount; slot++) push(builder, ir->params[slot]);
+    } else if (block->predCount == 1){
+        IrBlock* pred = &ir->blocks[block->preds[0]];
+        int height = edgeHeight(ir, block->preds[0], b);
+        for (int slot = 0; slot < height; slot++) push(builder, pred->exit[slot]);
+    } else {
+        // a phi for every slot; their inputs are only known once every predecessor is built
+        int height = -1;
+        for (int p = 0; p < block->predCount && height < 0; p++){
+            int pred = block->preds[p];
+            if (pred == -1) height = ir->paramCount;
+            else if (ir->blocks[pred].exit != NULL) height = edgeHeight(ir, pred, b);
+        }
+        for (int slot = 0; slot < height; slot++){
+            push(builder, newValue(ir, IR_PHI, b, slot));
+        }
+    }
+    block->reachable = true;
+    block->height = builder->height;
+    block->entry = malloc(sizeof(int) * (block->height + 1));
+    if (block->entry == NULL) exit(1);
+    for (int slot = 0; slot < block->height; slot++) block->entry[slot] = builder->slots[slot];
+
+    block->first = ir->instructionCount;
+    int end = b + 1 < ir->blockCount ? ir->blocks[b + 1].start : chunk->count;
+    for (int offset = block->start; offset < end && !builder->failed; offset += instructionLength(chunk, offset)){
+        // a catch block may read whatever is below its try block's depth, from anywhere in the try block
+        for (int h = 0; h < chunk->handlerCount; h++){
+            ExceptionHandler* handler = &chunk->handlers[h];
+            if (offset < handler->start || offset >= handler->end) continue;
+            for (int slot = 0; slot < handler->depth && slot < builder->height; slot++){
+                ir->values[builder->slots[slot]].caught = true;
+            }
+        }
+
+        uint8_t opcode = chunk->code[offset];
+        const Superinstruction* fused = findSuperinstruction(opcode);
+        if (fused == NULL){
+            simulate(builder, offset, opcode, chunk->code + offset + 1, false);
+            if (isBranch(opcode)) block->jumpHeight = builder->height;
+            continue;
+        }
+        uint8_t* operands = chunk->code + offset + 1;
+        for (int p = 0; p < fused->partCount && !builder->failed; p++){
+            simulate(builder, offset, fused->parts[p], operands, true);
+            // OP_JUMP_IF_FALSE_POP only pops when it falls through
+            if (isBranch(fused->parts[p])) block->jumpHeight = builder->height;
+            operands += opcodeLength(fused->parts[p]) - 1;
+        }
+    }
+    block->end = ir->instructionCount;
+    block->exitHeight = builder->height;
+    int saved = block->exitHeight > block->jumpHeight ? block->exitHeight : block->jumpHeight;
+    block->exit = malloc(sizeof(int) * (saved + 1));
+    if (block->exit == NULL) exit(1);
+    for (int slot = 0; slot < saved; slot++) block->exit[slot] = builder->slots[slot];
+}
+
+static bool linkPhis(IrFunction* ir){
+    // every phi takes the value its slot has at the end of each predecessor
+    for (int b = 0; b < ir->blockCount; b++){
+        IrBlock* block = &ir->blocks[b];
+        if (!block->reachable || block->catchDepth >= 0) continue;
+        for (int p = 0; p < block->predCount; p++){
+            int pred = block->preds[p];
+            int height = pred == -1 ? ir->paramCount
+                : ir->blocks[pred].reachable ? edgeHeight(ir, pred, b) : block->height;
+            if (height != block->height) return false;
+        }
+        if (block->predCount < 2) continue;
+        for (int slot = 0; slot < block->height; slot++){
+            IrValue* phi = &ir->values[block->entry[slot]];
+            phi->inputs = ir->inputCount;
+            for (int p = 0; p < block->predCount; p++){
+                int pred = block->preds[p];
+                int input = pred == -1 ? ir->params[slot]
+                    : ir->blocks[pred].reachable ? ir->blocks[pred].exit[slot] : -1;
+                IR_GROW(int, ir->inputs, ir->inputCount, ir->inputCapacity);
+                ir->inputs[ir->inputCount++] = input;
+            }
+        }
+    }
+    return true;
+}
+
+static void removeTrivialPhis(IrFunction* ir){
+    // a phi of one value (and itself, around a loop) is that value
+    bool changed;
+    do {
+        changed = false;
+        for (int v = 0; v < ir->valueCount; v++){
+            IrValue* phi = &ir->values[v];
+            if (phi->kind != IR_PHI || phi->replacement != v) continue;
+            int same = -1;
+            bool trivial = true;
+            int count = ir->blocks[phi->block].predCount;
+            for (int p = 0; p < count && trivial; p++){
+                int input = ir->inputs[phi->inputs + p];
+                if (input == -1) continue;
+                input = irValue(ir, input);
+                if (input == v || input == same) continue;
+                if (same == -1) same = input;
+                else trivial = false;
+            }
+            if (trivial && same != -1){
+                phi->replacement = same;
+                changed = true;
+            }
+        }
+    } while (changed);
+}
+
+bool buildIr(IrFunction* ir, Chunk* chunk, int arity){
+    ir->chunk = chunk;
+    ir->blocks = NULL;
+    ir->blockCount = 0;
+    ir->instructions = NULL;
+    ir->instructionCount = ir->instructionCapacity = 0;
+    ir->values = NULL;
+    ir->valueCount = ir->valueCapacity = 0;
+    ir->args = NULL;
+    ir->argCount = ir->argCapacity = 0;
+    ir->inputs = NULL;
+    ir->inputCount = ir->inputCapacity = 0;
+    ir->captured = NULL;
+    ir->slotCount = 0;
+    ir->paramCount = arity + 1;
+    ir->params = malloc(sizeof(int) * ir->paramCount);
+    if (ir->params == NULL) exit(1);
+    for (int slot = 0; slot < ir->paramCount; slot++){
+        ir->params[slot] = newValue(ir, IR_PARAM, 0, slot);
+    }
+    if (chunk->count == 0 || !findBlocks(ir)){
+        freeIr(ir);
+        return false;
+    }
+    findCaptures(ir);
+
+    Builder builder = {ir, 0, NULL, 0, 0, false};
+    int count;
+    int* order = reversePostorder(ir, &count);
+    for (int i = 0; i < count && !builder.failed; i++){
+        buildBlock(&builder, order[i]);
+    }
+    free(order);
+    free(builder.slots);
+    if (builder.failed || !linkPhis(ir)){
+        freeIr(ir);
+        return false;
+    }
+    removeTrivialPhis(ir);
+    return true;
+}
+
+void freeIr(IrFunction* ir){
+    for (int b = 0; b < ir->blockCount; b++){
+        free(ir->blocks[b].preds);
+        free(ir->blocks[b].entry);
+        free(ir->blocks[b].exit);
+    }
+    free(ir->blocks);
+    free(ir->instructions);
+    free(ir->values);
+    free(ir->args);
+    free(ir->inputs);
+    free(ir->params);
+    free(ir->captured);
+    ir->blocks = NULL;
+    ir->blockCount = 0;
+}
+
+
+// CONSTANT PROPAGATION
+
+static IrLattice meet(IrFunction* ir, IrLattice lattice, Value* constant, int input){
+    // merges what input is known to be into (lattice, constant)
+    IrValue* other = &ir->values[irValue(ir, input)];
+    if (other->lattice == IR_UNDEFINED || lattice == IR_VARYING) return lattice;
+    if (other->lattice == IR_VARYING) return IR_VARYING;
+    if (lattice == IR_UNDEFINED){
+        *constant = other->constant;
+        return IR_CONSTANT;
+    }
+    return sameConstant(*constant, other->constant) ? IR_CONSTANT : IR_VARYING;
+}
+static int genericOperator(int opcode){
+    switch (opcode){
+        case OP_GREATER_NUM:  return OP_GREATER;
+        case OP_LESS_NUM:     return OP_LESS;
+        case OP_ADD_NUM:      return OP_ADD;
+        case OP_SUBTRACT_NUM: return OP_SUBTRACT;
+        case OP_MULTIPLY_NUM: return OP_MULTIPLY;
+        case OP_DIVIDE_NUM:   return OP_DIVIDE;
+        default:              return opcode;
+    }
+}
+static IrLattice evaluate(IrFunction* ir, IrValue* value){
+    // what the instruction that pushes value computes
+    IrInstruction* instruction = &ir->instructions[value->instruction];
+    int opcode = genericOperator(instruction->opcode);
+    switch (opcode){
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            value->constant = ir->chunk->constants.values[instruction->operand];
+            return IR_CONSTANT;
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG: {
+            if (value->inputs == -1) return IR_VARYING;
+            IrValue* read = &ir->values[irValue(ir, value->inputs)];
+            value->constant = read->constant;
+            return read->lattice;
+        }
+        case OP_NIL:   value->constant = NIL_VAL(); return IR_CONSTANT;
+        case OP_TRUE:  value->constant = BOOL_VAL(true); return IR_CONSTANT;
+        case OP_FALSE: value->constant = BOOL_VAL(false); return IR_CONSTANT;
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE: {
+            Value operands[2] = {NIL_VAL(), NIL_VAL()};
+            for (int i = 0; i < instruction->argCount; i++){
+                IrValue* operand = &ir->values[irValue(ir, ir->args[instruction->args + i])];
+                if (operand->lattice != IR_CONSTANT) return operand->lattice;
+                operands[i] = operand->constant;
+            }
+            return foldOperator(opcode, operands[0], operands[1], &value->constant) ? IR_CONSTANT : IR_VARYING;
+        }
+        default:
+            return IR_VARYING;
+    }
+}
+static void propagateConstants(IrFunction* ir){
+    for (int v = 0; v < ir->valueCount; v++){
+        IrValueKind kind = ir->values[v].kind;
+        ir->values[v].lattice = kind == IR_PARAM || kind == IR_CATCH ? IR_VARYING : IR_UNDEFINED;
+    }
+    bool changed;
+    do {
+        changed = false;
+        for (int v = 0; v < ir->valueCount; v++){
+            IrValue* value = &ir->values[v];
+            if (value->replacement != v || value->lattice == IR_VARYING) continue;
+            IrLattice lattice = value->lattice;
+            switch (value->kind){
+                case IR_PHI: {
+                    lattice = IR_UNDEFINED;
+                    int count = ir->blocks[value->block].predCount;
+                    for (int p = 0; p < count; p++){
+                        int input = ir->inputs[value->inputs + p];
+                        if (input != -1 && irValue(ir, input) != v) lattice = meet(ir, lattice, &value->constant, input);
+                    }
+                    break;
+                }
+                case IR_STORE: {
+                    IrValue* stored = &ir->values[irValue(ir, value->inputs)];
+                    lattice = stored->lattice;
+                    value->constant = stored->constant;
+                    break;
+                }
+                case IR_RESULT:
+                    lattice = evaluate(ir, value);
+                    break;
+                default:
+                    break;
+            }
+            if (lattice != value->lattice) changed = true;
+            value->lattice = lattice;
+        }
+    } while (changed);
+}
+
+
+// LOWERING DECISIONS
+
+static int findConstant(Chunk* chunk, Value value){
+    // only the first 256 constants are reachable from a narrow OP_CONSTANT
+    int count = chunk->constants.count < UINT8_MAX + 1 ? chunk->constants.count : UINT8_MAX + 1;
+    for (int i = 0; i < count; i++){
+        if (sameConstant(chunk->constants.values[i], value)) return i;
+    }
+    return -1;
+}
+static void markLive(IrFunction* ir, int v, int* worklist){
+    // v is read back: so are the stores any phi it goes through merges
+    int count = 0;
+    worklist[count++] = v;
+    while (count > 0){
+        IrValue* value = &ir->values[worklist[--count]];
+        if (value->live) continue;
+        value->live = true;
+        if (value->kind != IR_PHI) continue;
+        int inputs = ir->blocks[value->block].predCount;
+        for (int p = 0; p < inputs; p++){
+            int input = ir->inputs[value->inputs + p];
+            if (input != -1 && !ir->values[input].live) worklist[count++] = input;
+        }
+    }
+}
+
+void optimizeIr(IrFunction* ir){
+    propagateConstants(ir);
+    Chunk* chunk = ir->chunk;
+
+    // reads of constants become literals, reads of copies read the original
+    int newConstants = 0;
+    for (int b = 0; b < ir->blockCount; b++){
+        IrBlock* block = &ir->blocks[b];
+        if (!block->reachable) continue;
+        for (int i = block->first; i < block->end; i++){
+            IrInstruction* instruction = &ir->instructions[i];
+            if (instruction->fused || instruction->read == -1) continue;
+            if (instruction->opcode != OP_GET_LOCAL && instruction->opcode != OP_GET_LOCAL_LONG) continue;
+            IrValue* value = &ir->values[irValue(ir, instruction->read)];
+            if (value->lattice == IR_CONSTANT){
+                // a literal, or a constant the chunk has (or still has room for)
+                bool fits = IS_NIL(value->constant) || IS_BOOL(value->constant);
+                if (!fits){
+                    int constant = findConstant(chunk, value->constant);
+                    fits = constant != -1 ? constant <= UINT8_MAX : chunk->constants.count + newConstants <= UINT8_MAX;
+                    if (constant == -1 && fits) newConstants++;
+                }
+                if (fits){
+                    instruction->rewrite = IR_LOAD_CONSTANT;
+                    continue;
+                }
+            }
+            if (instruction->copySlot >= 0 && instruction->copySlot <= UINT8_MAX){
+                instruction->rewrite = IR_LOAD_SLOT;
+                instruction->rewriteOperand = instruction->copySlot;
+            }
+        }
+    }
+
+    // dead store elimination: an OP_SET_LOCAL whose value is never read back from its slot
+    int* worklist = malloc(sizeof(int) * (ir->valueCount + ir->inputCount + 1));
+    if (worklist == NULL) exit(1);
+    for (int v = 0; v < ir->valueCount; v++){
+        if (ir->values[v].caught) markLive(ir, v, worklist);
+    }
+    for (int b = 0; b < ir->blockCount; b++){
+        IrBlock* block = &ir->blocks[b];
+        if (!block->reachable) continue;
+        for (int i = block->first; i < block->end; i++){
+            IrInstruction* instruction = &ir->instructions[i];
+            switch (instruction->opcode){
+                case OP_GET_LOCAL:
+                case OP_GET_LOCAL_LONG:
+                    if (instruction->rewrite == IR_LOAD_SLOT) markLive(ir, instruction->copyValue, worklist);
+                    else if (instruction->rewrite == IR_KEEP && instruction->read != -1) markLive(ir, instruction->read, worklist);
+                    break;
+                case OP_DUPLICATE:
+                    markLive(ir, instruction->read, worklist);
+                    break;
+                case OP_POP:
+                case OP_POPN:
+                case OP_CLOSE_UPVALUE:
+                    // a slot going out of scope is not a read
+                    break;
+                default:
+                    for (int a = 0; a < instruction->argCount; a++){
+                        markLive(ir, ir->args[instruction->args + a], worklist);
+                    }
+                    break;
+            }
+        }
+    }
+    free(worklist);
+    for (int b = 0; b < ir->blockCount; b++){
+        IrBlock* block = &ir->blocks[b];
+        if (!block->reachable) continue;
+        for (int i = block->first; i < block->end; i++){
+            IrInstruction* instruction = &ir->instructions[i];
+            if (instruction->fused || instruction->read == -1 || ir->values[instruction->read].live) continue;
+            if (instruction->opcode == OP_SET_LOCAL || instruction->opcode == OP_SET_LOCAL_LONG){
+                instruction->rewrite = IR_REMOVE;
+            }
+        }
+    }
+}
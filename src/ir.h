@@ -0,0 +1,114 @@
+#ifndef clox_ir_h
+#define clox_ir_h
+
+#include "chunk.h"
+
+// SSA form of a function's bytecode: a mid-level IR for optimizations that see more than one
+// instruction at a time. It is built from a finished chunk, not by the parser: the frame's slots
+// (locals and temporaries alike) are followed through every instruction, so each value that is
+// pushed or stored gets a name of its own, and slots merge through phis where control flow joins.
+// Slots captured by a closure may change behind the function's back, so they are left alone.
+// optimizeIr() decides how each instruction is lowered back into the chunk; the peephole
+// optimizer applies that (optimizer.c), and --print-ir dumps it (debug.c).
+
+typedef enum {
+    IR_PARAM,       // a slot on entry: the callee, then the arguments
+    IR_CATCH,       // a slot on entry to a catch block
+    IR_PHI,         // a slot where control flow joins
+    IR_RESULT,      // pushed by an instruction (OP_GET_LOCAL pushes a copy of the slot's value)
+    IR_STORE        // written to a slot by OP_SET_LOCAL: a copy of the value stored
+} IrValueKind;
+
+typedef enum {
+    IR_UNDEFINED,   // not seen yet (constant propagation is optimistic)
+    IR_CONSTANT,
+    IR_VARYING
+} IrLattice;
+
+typedef struct {
+    IrValueKind kind;
+    int block;
+    int slot;           // IR_PARAM, IR_CATCH, IR_PHI, IR_STORE: the slot it lives in
+    int instruction;    // IR_RESULT, IR_STORE: the instruction that defines it
+    int inputs;         // IR_PHI: its first input in IrFunction.inputs, one per predecessor
+                        // IR_STORE: the value stored; IR_RESULT of OP_GET_LOCAL: the value read (-1 if captured)
+    int replacement;    // a phi whose inputs are all one value stands for it; itself otherwise
+    IrLattice lattice;
+    Value constant;
+    bool caught;        // in a slot a catch block may read
+    bool live;          // IR_STORE: read back from its slot
+} IrValue;
+
+typedef enum {
+    IR_KEEP,
+    IR_LOAD_CONSTANT,   // OP_GET_LOCAL of a constant becomes a literal
+    IR_LOAD_SLOT,       // OP_GET_LOCAL of a copy reads the value where it was copied from
+    IR_REMOVE           // OP_SET_LOCAL that nothing reads
+} IrRewrite;
+
+typedef struct {
+    int offset;         // bytecode instruction it comes from; a superinstruction yields one per part
+    uint8_t opcode;     // the part, for superinstructions
+    bool fused;         // part of a superinstruction, which is never rewritten
+    int operand;        // slot, constant or count (-1 if none)
+    int args;           // first value it pops, in IrFunction.args
+    int argCount;
+    int result;         // first value it pushes, -1 if none
+    int resultCount;
+    int read;           // OP_GET_LOCAL: the value in the slot; OP_DUPLICATE: the value pushed; OP_SET_LOCAL: the IR_STORE
+    int copySlot;       // OP_GET_LOCAL of an IR_STORE: a lower slot holding the same value, or -1
+    int copyValue;
+    IrRewrite rewrite;
+    int rewriteOperand; // IR_LOAD_SLOT: the slot
+} IrInstruction;
+
+typedef struct {
+    int start;          // bytecode offset
+    int first;          // instructions [first, end), if reachable
+    int end;
+    int successors[2];
+    int successorCount;
+    int* preds;         // -1 stands for the function entry
+    int predCount;
+    int predCapacity;
+    int catchDepth;     // catch blocks: the stack depth of their try block; -1 otherwise
+    bool reachable;
+    int height;         // stack height on entry
+    int* entry;         // the value of each slot on entry
+    int exitHeight;     // stack height on the way out, falling through or jumping
+    int jumpHeight;     // (they differ for OP_JUMP_IF_FALSE_POP)
+    int* exit;
+} IrBlock;
+
+typedef struct {
+    Chunk* chunk;
+    IrBlock* blocks;
+    int blockCount;
+    IrInstruction* instructions;
+    int instructionCount;
+    int instructionCapacity;
+    IrValue* values;
+    int valueCount;
+    int valueCapacity;
+    int* args;
+    int argCount;
+    int argCapacity;
+    int* inputs;
+    int inputCount;
+    int inputCapacity;
+    int* params;        // the values of the entry block's slots
+    int paramCount;
+    bool* captured;     // slots a closure captures
+    int slotCount;
+} IrFunction;
+
+// Builds the SSA form of chunk, a function taking arity arguments.
+// Returns false, with nothing left to free, for code it cannot follow.
+bool buildIr(IrFunction* ir, Chunk* chunk, int arity);
+// Constant propagation, copy propagation and dead store elimination: sets the rewrite of every instruction
+void optimizeIr(IrFunction* ir);
+// The value v stands for, once trivial phis are gone
+int irValue(IrFunction* ir, int v);
+void freeIr(IrFunction* ir);
+
+#endif
@@ -0,0 +1,779 @@
+#include "jit.h"
+
+#ifdef VM_JIT
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+
+// Machine code is generated into a growing buffer, then copied into its own mmap'd pages
+// that are made executable (and read-only) once the function is done.
+// Calling convention of the generated code: JitStatus code(int frameIndex)
+// Registers, kept across the whole function (all callee-saved in the System V ABI):
+//     rbx  stack top            r12  frame slots          r13  frame index
+//     r14  QNAN (EMPTY_VAL)     r15  &vm
+// rbx and r12 are reloaded after every helper call, since the stack and frames may have moved.
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+#define STACK_TOP   RBX
+#define SLOTS       R12
+#define FRAME_INDEX R13
+#define QNAN_REG    R14
+#define VM_REG      R15
+
+// condition codes (the low nibble of jcc and setcc)
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_AE 0x3
+#define CC_ALWAYS -1
+
+// opcodes of reg/reg ALU instructions, and /digit extensions of the immediate forms
+#define ALU_ADD 0x01
+#define ALU_AND 0x21
+#define ALU_SUB 0x29
+#define ALU_CMP 0x39
+#define ALU_MOV 0x89
+#define IMM_ADD 0
+#define IMM_SUB 5
+
+typedef enum {
+    PATCH_JUMP,    // target is a bytecode offset
+    PATCH_BAIL,    // target is the bytecode offset to resume the interpreter at
+    PATCH_EXIT     // target is one of the exits below
+} PatchKind;
+#define EXIT_THREW  0
+#define EXIT_RETURN 1
+
+typedef struct {
+    int at;    // offset of a rel32 in the code
+    PatchKind kind;
+    int target;
+} JitPatch;
+
+typedef struct {
+    ObjFunction* function;
+    uint8_t* code;
+    int count;
+    int capacity;
+    int* labels;    // machine code offset of every instruction, by bytecode offset
+    int* stubs;     // bail-out stub of every instruction that has one, or -1
+    JitPatch* patches;
+    int patchCount;
+    int patchCapacity;
+} Emitter;
+
+
+// RAW EMISSION
+
+static void emitByte(Emitter* e, uint8_t byte){
+    if (e->count == e->capacity){
+        e->capacity = e->capacity < 256 ? 256 : e->capacity * 2;
+        e->code = (uint8_t*)realloc(e->code, e->capacity);
+        if (e->code == NULL) exit(1);
+    }
+    e->code[e->count++] = byte;
+}
+static void emitRaw(Emitter* e, const char* bytes, int length){
+    for (int i = 0; i < length; i++){
+        emitByte(e, (uint8_t)bytes[i]);
+    }
+}
+static void emit32(Emitter* e, uint32_t value){
+    for (int i = 0; i < 4; i++){
+        emitByte(e, (uint8_t)(value >> (8 * i)));
+    }
+}
+static void emit64(Emitter* e, uint64_t value){
+    emit32(e, (uint32_t)value);
+    emit32(e, (uint32_t)(value >> 32));
+}
+static void patch32(Emitter* e, int at, int32_t value){
+    memcpy(e->code + at, &value, sizeof(int32_t));
+}
+static void addPatch(Emitter* e, PatchKind kind, int target){
+    // the rel32 just emitted gets its target once all the code is laid out
+    if (e->patchCount == e->patchCapacity){
+        e->patchCapacity = GROW_CAPACITY(e->patchCapacity);
+        e->patches = (JitPatch*)realloc(e->patches, sizeof(JitPatch) * e->patchCapacity);
+        if (e->patches == NULL) exit(1);
+    }
+    e->patches[e->patchCount++] = (JitPatch){e->count - 4, kind, target};
+}
+
+
+// INSTRUCTION ENCODING (64-bit operands unless stated)
+
+static void emitRex(Emitter* e, int reg, int base){
+    emitByte(e, 0x48 | (reg >> 3) << 2 | (base >> 3));
+}
+static void emitMemory(Emitter* e, int reg, int base, int32_t disp){
+    // ModRM (and SIB) for [base + disp]
+    bool shortDisp = disp >= -128 && disp <= 127;
+    emitByte(e, (shortDisp ? 0x40 : 0x80) | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) emitByte(e, 0x24);
+    if (shortDisp) emitByte(e, (uint8_t)disp);
+    else emit32(e, (uint32_t)disp);
+}
+static void emitLoad(Emitter* e, int dst, int base, int32_t disp){
+    emitRex(e, dst, base);
+    emitByte(e, 0x8B);
+    emitMemory(e, dst, base, disp);
+}
+static void emitStore(Emitter* e, int base, int32_t disp, int src){
+    emitRex(e, src, base);
+    emitByte(e, 0x89);
+    emitMemory(e, src, base, disp);
+}
+static void emitLea(Emitter* e, int dst, int base, int32_t disp){
+    emitRex(e, dst, base);
+    emitByte(e, 0x8D);
+    emitMemory(e, dst, base, disp);
+}
+static void emitCmpMemory(Emitter* e, int reg, int base, int32_t disp){
+    // cmp reg, [base + disp]
+    emitRex(e, reg, base);
+    emitByte(e, 0x3B);
+    emitMemory(e, reg, base, disp);
+}
+static void emitAlu(Emitter* e, uint8_t opcode, int dst, int src){
+    emitRex(e, src, dst);
+    emitByte(e, opcode);
+    emitByte(e, 0xC0 | (src & 7) << 3 | (dst & 7));
+}
+static void emitAluImm(Emitter* e, int extension, int reg, int32_t imm){
+    emitRex(e, 0, reg);
+    if (imm >= -128 && imm <= 127){
+        emitByte(e, 0x83);
+        emitByte(e, 0xC0 | extension << 3 | (reg & 7));
+        emitByte(e, (uint8_t)imm);
+    } else {
+        emitByte(e, 0x81);
+        emitByte(e, 0xC0 | extension << 3 | (reg & 7));
+        emit32(e, (uint32_t)imm);
+    }
+}
+static void emitMovImm(Emitter* e, int reg, uint64_t imm){
+    emitRex(e, 0, reg);
+    emitByte(e, 0xB8 + (reg & 7));
+    emit64(e, imm);
+}
+static void emitMovImm32(Emitter* e, int reg, uint32_t imm){
+    // 32-bit move (zero extended), for int arguments. reg < R8
+    emitByte(e, 0xB8 + reg);
+    emit32(e, imm);
+}
+static void emitPushReg(Emitter* e, int reg){
+    if (reg >= R8) emitByte(e, 0x41);
+    emitByte(e, 0x50 + (reg & 7));
+}
+static void emitPopReg(Emitter* e, int reg){
+    if (reg >= R8) emitByte(e, 0x41);
+    emitByte(e, 0x58 + (reg & 7));
+}
+static void emitCall(Emitter* e, void* function){
+    emitMovImm(e, RAX, (uint64_t)(uintptr_t)function);
+    emitRaw(e, "\xFF\xD0", 2);                    // call rax
+}
+static void emitJump(Emitter* e, int cc, PatchKind kind, int target){
+    if (cc == CC_ALWAYS){
+        emitByte(e, 0xE9);
+    } else {
+        emitByte(e, 0x0F);
+        emitByte(e, 0x80 + cc);
+    }
+    emit32(e, 0);
+    addPatch(e, kind, target);
+}
+static int emitShortJump(Emitter* e, int cc){
+    // forward jump inside a template; returns the offset to patch it from
+    emitByte(e, cc == CC_ALWAYS ? 0xEB : 0x70 + cc);
+    emitByte(e, 0);
+    return e->count;
+}
+static void patchShortJump(Emitter* e, int from){
+    e->code[from - 1] = (uint8_t)(e->count - from);
+}
+
+
+// TEMPLATE BUILDING BLOCKS
+
+static void emitLoadFrame(Emitter* e, int reg){
+    // reg = &vm.frames[frameIndex] (frames move when the call stack grows). clobbers rcx
+    emitLoad(e, reg, VM_REG, offsetof(VM, frames));
+    emitRaw(e, "\x49\x6B\xCD", 3);                // imul rcx, r13, sizeof(CallFrame)
+    emitByte(e, (uint8_t)sizeof(CallFrame));
+    emitAlu(e, ALU_ADD, reg, RCX);
+}
+static void emitSaveIp(Emitter* e, uint8_t* ip){
+    // frame->ip = ip, for stack traces and for the interpreter to resume at
+    emitLoadFrame(e, RDX);
+    emitMovImm(e, RAX, (uint64_t)(uintptr_t)ip);
+    emitStore(e, RDX, offsetof(CallFrame, ip), RAX);
+}
+static void emitSyncStack(Emitter* e){
+    emitStore(e, VM_REG, offsetof(VM, stackTop), STACK_TOP);
+}
+static void emitReload(Emitter* e){
+    emitLoad(e, STACK_TOP, VM_REG, offsetof(VM, stackTop));
+    emitLoadFrame(e, RDX);
+    emitLoad(e, SLOTS, RDX, offsetof(CallFrame, slots));
+}
+static void emitHelperResult(Emitter* e, PatchKind kind, int target){
+    // jumps away if the helper returned false
+    emitRaw(e, "\x84\xC0", 2);                    // test al, al
+    emitJump(e, CC_E, kind, target);
+}
+static void emitStackGuard(Emitter* e, int offset){
+    // bails out if one more value does not fit on the stack; the interpreter grows it
+    emitCmpMemory(e, STACK_TOP, VM_REG, offsetof(VM, stackEnd));
+    emitJump(e, CC_AE, PATCH_BAIL, offset);
+}
+static void emitPush(Emitter* e, int reg){
+    emitStore(e, STACK_TOP, 0, reg);
+    emitAluImm(e, IMM_ADD, STACK_TOP, 8);
+}
+static void emitNumberGuard(Emitter* e, int reg, int offset){
+    // bails out unless reg holds a number: (value & QNAN) != QNAN
+    emitAlu(e, ALU_MOV, RCX, reg);
+    emitAlu(e, ALU_AND, RCX, QNAN_REG);
+    emitAlu(e, ALU_CMP, RCX, QNAN_REG);
+    emitJump(e, CC_E, PATCH_BAIL, offset);
+}
+static void emitBoolResult(Emitter* e, int32_t disp){
+    // [rbx + disp] = al ? TRUE_VAL : FALSE_VAL
+    emitRaw(e, "\x0F\xB6\xC0", 3);                // movzx eax, al
+    emitRaw(e, "\x49\x8D\x44\x06\x02", 5);        // lea rax, [r14 + rax + TAG_FALSE]
+    emitStore(e, STACK_TOP, disp, RAX);
+}
+static void emitOperands(Emitter* e, int offset, bool numbers, uint8_t* fused){
+    // rax, xmm0 = a and rdx, xmm1 = b of a binary operator: the two values on top of the stack,
+    // or for a fused superinstruction, a local and a constant (or a second local)
+    if (fused == NULL){
+        emitLoad(e, RAX, STACK_TOP, -16);
+        emitLoad(e, RDX, STACK_TOP, -8);
+    } else {
+        emitStackGuard(e, offset);
+        emitLoad(e, RAX, SLOTS, 8 * fused[1]);
+        if (*fused == OP_LESS_LOCAL_LOCAL) emitLoad(e, RDX, SLOTS, 8 * fused[2]);
+        else emitMovImm(e, RDX, e->function->chunk.constants.values[fused[2]]);
+    }
+    if (!numbers) return;
+    emitNumberGuard(e, RAX, offset);
+    emitNumberGuard(e, RDX, offset);
+    emitRaw(e, "\x66\x48\x0F\x6E\xC0", 5);        // movq xmm0, rax
+    emitRaw(e, "\x66\x48\x0F\x6E\xCA", 5);        // movq xmm1, rdx
+}
+
+
+// OPCODE TEMPLATES
+
+static void emitArithmetic(Emitter* e, int offset, uint8_t sseOpcode, uint8_t* fused){
+    // the result replaces both operands, or is pushed by a superinstruction
+    emitOperands(e, offset, true, fused);
+    emitRaw(e, "\xF2\x0F", 2);                    // addsd/subsd/mulsd/divsd xmm0, xmm1
+    emitByte(e, sseOpcode);
+    emitByte(e, 0xC1);
+    emitRaw(e, "\x66\x48\x0F\x7E\xC0", 5);        // movq rax, xmm0
+    emitStore(e, STACK_TOP, fused == NULL ? -16 : 0, RAX);
+    emitAluImm(e, fused == NULL ? IMM_SUB : IMM_ADD, STACK_TOP, 8);
+}
+static void emitComparison(Emitter* e, int offset, bool greater, uint8_t* fused){
+    emitOperands(e, offset, true, fused);
+    if (greater) emitRaw(e, "\x66\x0F\x2E\xC1", 4);    // ucomisd xmm0, xmm1
+    else         emitRaw(e, "\x66\x0F\x2E\xC8", 4);    // ucomisd xmm1, xmm0
+    emitRaw(e, "\x0F\x97\xC0", 3);                // seta al (false if unordered)
+    emitBoolResult(e, fused == NULL ? -16 : 0);
+    emitAluImm(e, fused == NULL ? IMM_SUB : IMM_ADD, STACK_TOP, 8);
+}
+static void emitEqual(Emitter* e){
+    // numbers compare as doubles, everything else bitwise (see valuesEqual)
+    emitOperands(e, 0, false, NULL);
+    emitAlu(e, ALU_MOV, RCX, RAX);
+    emitAlu(e, ALU_AND, RCX, QNAN_REG);
+    emitAlu(e, ALU_CMP, RCX, QNAN_REG);
+    int aNotNumber = emitShortJump(e, CC_E);
+    emitAlu(e, ALU_MOV, RCX, RDX);
+    emitAlu(e, ALU_AND, RCX, QNAN_REG);
+    emitAlu(e, ALU_CMP, RCX, QNAN_REG);
+    int bNotNumber = emitShortJump(e, CC_E);
+    emitRaw(e, "\x66\x48\x0F\x6E\xC0", 5);        // movq xmm0, rax
+    emitRaw(e, "\x66\x48\x0F\x6E\xCA", 5);        // movq xmm1, rdx
+    emitRaw(e, "\x66\x0F\x2E\xC1", 4);            // ucomisd xmm0, xmm1
+    emitRaw(e, "\x0F\x94\xC0", 3);                // sete al
+    emitRaw(e, "\x0F\x9B\xC1", 3);                // setnp cl
+    emitRaw(e, "\x20\xC8", 2);                    // and al, cl
+    int done = emitShortJump(e, CC_ALWAYS);
+    patchShortJump(e, aNotNumber);
+    patchShortJump(e, bNotNumber);
+    emitAlu(e, ALU_CMP, RAX, RDX);
+    emitRaw(e, "\x0F\x94\xC0", 3);                // sete al
+    patchShortJump(e, done);
+    emitBoolResult(e, -16);
+    emitAluImm(e, IMM_SUB, STACK_TOP, 8);
+}
+static void emitFalsey(Emitter* e){
+    // al = isFalsey(rax). clobbers rcx, rdx
+    emitLea(e, RCX, QNAN_REG, TAG_NIL);
+    emitAlu(e, ALU_CMP, RAX, RCX);
+    emitRaw(e, "\x0F\x94\xC2", 3);                // sete dl
+    emitLea(e, RCX, QNAN_REG, TAG_FALSE);
+    emitAlu(e, ALU_CMP, RAX, RCX);
+    emitRaw(e, "\x0F\x94\xC0", 3);                // sete al
+    emitRaw(e, "\x08\xD0", 2);                    // or al, dl
+}
+static void emitGetUpvalue(Emitter* e, int slot, bool set){
+    // rax = ((ObjClosure*)frame->function)->upvalues[slot]->location
+    emitLoadFrame(e, RAX);
+    emitLoad(e, RAX, RAX, offsetof(CallFrame, function));
+    emitLoad(e, RAX, RAX, offsetof(ObjClosure, upvalues));
+    emitLoad(e, RAX, RAX, slot * (int)sizeof(ObjUpvalue*));
+    emitLoad(e, RAX, RAX, offsetof(ObjUpvalue, location));
+    if (set){
+        emitLoad(e, RDX, STACK_TOP, -8);
+        emitStore(e, RAX, 0, RDX);
+    } else {
+        emitLoad(e, RDX, RAX, 0);
+        emitPush(e, RDX);
+    }
+}
+static void emitOuterLocal(Emitter* e, int upvalue, int slot, bool set){
+    // rax = jitOuterLocal(upvalue, slot); then as emitGetUpvalue
+    emitMovImm32(e, RDI, upvalue);
+    emitMovImm32(e, RSI, slot);
+    emitCall(e, (void*)jitOuterLocal);
+    if (set){
+        emitLoad(e, RDX, STACK_TOP, -8);
+        emitStore(e, RAX, 0, RDX);
+    } else {
+        emitLoad(e, RDX, RAX, 0);
+        emitPush(e, RDX);
+    }
+}
+static void emitFullHelper(Emitter* e, uint8_t* next, void* helper){
+    // helper performs the whole instruction, or returns false if it threw
+    // its arguments are already in rdi and rsi (saving ip clobbers rax, rcx and rdx)
+    emitSaveIp(e, next);
+    emitSyncStack(e);
+    emitCall(e, helper);
+    emitHelperResult(e, PATCH_EXIT, EXIT_THREW);
+    emitReload(e);
+}
+
+static int countOperand(uint8_t* ip){
+    // the slot or count of an instruction, two bytes wide in its LONG variant
+    return isLongOpcode(*ip) ? (ip[1] << 8 | ip[2]) : ip[1];
+}
+static int secondCountOperand(uint8_t* ip){
+    // the count that follows the first, as in OP_GET_OUTER_LOCAL upvalue, slot
+    return isLongOpcode(*ip) ? (ip[3] << 8 | ip[4]) : ip[2];
+}
+
+static void emitInstruction(Emitter* e, int offset){
+    Chunk* chunk = &e->function->chunk;
+    uint8_t* ip = chunk->code + offset;
+    uint8_t* next = ip + instructionLength(chunk, offset);
+    switch (*ip){
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE: {
+            Value value = *ip == OP_CONSTANT ? chunk->constants.values[ip[1]]
+                        : *ip == OP_NIL ? NIL_VAL() : BOOL_VAL(*ip == OP_TRUE);
+            emitStackGuard(e, offset);
+            emitMovImm(e, RAX, value);
+            emitPush(e, RAX);
+            return;
+        }
+        case OP_CONSTANT_LONG:
+            emitStackGuard(e, offset);
+            emitMovImm(e, RAX, chunk->constants.values[ip[1] << 16 | ip[2] << 8 | ip[3]]);
+            emitPush(e, RAX);
+            return;
+        case OP_DUPLICATE:
+            emitStackGuard(e, offset);
+            emitLoad(e, RAX, STACK_TOP, -8 - 8 * ip[1]);
+            emitPush(e, RAX);
+            return;
+        case OP_POP:
+            emitAluImm(e, IMM_SUB, STACK_TOP, 8);
+            return;
+        case OP_POPN:
+            emitAluImm(e, IMM_SUB, STACK_TOP, 8 * ip[1]);
+            return;
+        case OP_POP_UNDER:
+            emitLoad(e, RAX, STACK_TOP, -8);
+            emitStore(e, STACK_TOP, -8 - 8 * ip[1], RAX);
+            emitAluImm(e, IMM_SUB, STACK_TOP, 8 * ip[1]);
+            return;
+
+        case OP_GET_GLOBAL_SLOT: {
+            int32_t disp = ((ip[1] << 8) | ip[2]) * (int32_t)sizeof(GlobalSlot);
+            emitStackGuard(e, offset);
+            emitLoad(e, RAX, VM_REG, offsetof(VM, globalSlots));
+            emitLoad(e, RDX, RAX, disp + offsetof(GlobalSlot, value));
+            emitAlu(e, ALU_CMP, RDX, QNAN_REG);
+            int defined = emitShortJump(e, CC_NE);
+            emitLoad(e, RDX, RAX, disp + offsetof(GlobalSlot, stl));
+            emitAlu(e, ALU_CMP, RDX, QNAN_REG);
+            emitJump(e, CC_E, PATCH_BAIL, offset);
+            patchShortJump(e, defined);
+            emitPush(e, RDX);
+            return;
+        }
+        case OP_SET_GLOBAL_SLOT: {
+            int32_t disp = ((ip[1] << 8) | ip[2]) * (int32_t)sizeof(GlobalSlot) + offsetof(GlobalSlot, value);
+            emitLoad(e, RAX, VM_REG, offsetof(VM, globalSlots));
+            emitCmpMemory(e, QNAN_REG, RAX, disp);
+            emitJump(e, CC_E, PATCH_BAIL, offset);
+            emitLoad(e, RDX, STACK_TOP, -8);
+            emitStore(e, RAX, disp, RDX);
+            return;
+        }
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+            emitStackGuard(e, offset);
+            emitLoad(e, RAX, SLOTS, 8 * countOperand(ip));
+            emitPush(e, RAX);
+            return;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG:
+            emitLoad(e, RAX, STACK_TOP, -8);
+            emitStore(e, SLOTS, 8 * countOperand(ip), RAX);
+            return;
+        case OP_GET_UPVALUE:
+        case OP_GET_UPVALUE_LONG:
+            emitStackGuard(e, offset);
+            emitGetUpvalue(e, countOperand(ip), false);
+            return;
+        case OP_SET_UPVALUE:
+        case OP_SET_UPVALUE_LONG:
+            emitGetUpvalue(e, countOperand(ip), true);
+            return;
+        case OP_GET_OUTER_LOCAL:
+        case OP_GET_OUTER_LOCAL_LONG:
+            emitStackGuard(e, offset);
+            emitOuterLocal(e, countOperand(ip), secondCountOperand(ip), false);
+            return;
+        case OP_SET_OUTER_LOCAL:
+        case OP_SET_OUTER_LOCAL_LONG:
+            emitOuterLocal(e, countOperand(ip), secondCountOperand(ip), true);
+            return;
+        case OP_GET_STL:
+            emitMovImm(e, RDI, chunk->constants.values[ip[1]]);
+            emitFullHelper(e, next, (void*)jitGetStl);
+            return;
+
+        case OP_EQUAL:
+            emitEqual(e);
+            return;
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+            emitComparison(e, offset, true, NULL);
+            return;
+        case OP_LESS:
+        case OP_LESS_NUM:
+            emitComparison(e, offset, false, NULL);
+            return;
+        case OP_ADD:
+        case OP_ADD_NUM:
+            emitArithmetic(e, offset, 0x58, NULL);
+            return;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM:
+            emitArithmetic(e, offset, 0x5C, NULL);
+            return;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:
+            emitArithmetic(e, offset, 0x59, NULL);
+            return;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM:
+            emitArithmetic(e, offset, 0x5E, NULL);
+            return;
+        case OP_NOT:
+            emitLoad(e, RAX, STACK_TOP, -8);
+            emitFalsey(e);
+            emitBoolResult(e, -8);
+            return;
+        case OP_NEGATE:
+            emitLoad(e, RAX, STACK_TOP, -8);
+            emitNumberGuard(e, RAX, offset);
+            emitRaw(e, "\x48\x0F\xBA\xF8\x3F", 5);    // btc rax, 63
+            emitStore(e, STACK_TOP, -8, RAX);
+            return;
+
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_JUMP_IF_FALSE_POP: {
+            int target = jumpTarget(chunk, offset);
+            emitLoad(e, RAX, STACK_TOP, -8);
+            emitLea(e, RCX, QNAN_REG, TAG_NIL);
+            emitAlu(e, ALU_CMP, RAX, RCX);
+            emitJump(e, CC_E, PATCH_JUMP, target);
+            emitLea(e, RCX, QNAN_REG, TAG_FALSE);
+            emitAlu(e, ALU_CMP, RAX, RCX);
+            emitJump(e, CC_E, PATCH_JUMP, target);
+            if (*ip == OP_JUMP_IF_FALSE_POP) emitAluImm(e, IMM_SUB, STACK_TOP, 8);
+            return;
+        }
+        case OP_JUMP:
+        case OP_JUMP_LONG:
+            emitJump(e, CC_ALWAYS, PATCH_JUMP, jumpTarget(chunk, offset));
+            return;
+        case OP_LOOP:
+        case OP_LOOP_LONG: {
+            // safepoint: dec dword [r15 + budget], calling out only when it reaches zero
+            emitByte(e, 0x41);
+            emitByte(e, 0xFF);
+            emitMemory(e, 1, VM_REG, offsetof(VM, budget));
+            int pending = emitShortJump(e, CC_NE);
+            emitSaveIp(e, next);
+            emitSyncStack(e);
+            emitCall(e, (void*)jitSafepoint);
+            emitHelperResult(e, PATCH_EXIT, EXIT_THREW);
+            emitReload(e);
+            patchShortJump(e, pending);
+            emitJump(e, CC_ALWAYS, PATCH_JUMP, jumpTarget(chunk, offset));
+            return;
+        }
+
+        case OP_BUILD_STRING:
+        case OP_BUILD_STRING_LONG:
+            emitMovImm32(e, RDI, countOperand(ip));
+            emitFullHelper(e, next, (void*)jitBuildString);
+            return;
+
+        case OP_CALL:
+        case OP_CALL_LONG:
+            emitSaveIp(e, next);
+            emitSyncStack(e);
+            emitMovImm32(e, RDI, countOperand(ip));
+            emitCall(e, (void*)jitCall);
+            emitHelperResult(e, PATCH_EXIT, EXIT_THREW);
+            emitReload(e);
+            return;
+        case OP_CHECK_CALLEE:
+        case OP_CHECK_CALLEE_LONG: {
+            // the callee is a function (never a number), so it is the constant if it is the same bits
+            int wide = isLongOpcode(*ip);
+            int constant = wide ? (ip[1] << 16 | ip[2] << 8 | ip[3]) : ip[1];
+            int argCount = wide ? (ip[4] << 8 | ip[5]) : ip[2];
+            emitLoad(e, RAX, STACK_TOP, -8 - 8 * argCount);
+            emitMovImm(e, RDX, chunk->constants.values[constant]);
+            emitAlu(e, ALU_CMP, RAX, RDX);
+            emitJump(e, CC_E, PATCH_JUMP, jumpTarget(chunk, offset));
+            return;
+        }
+        case OP_TAIL_CALL:
+        case OP_TAIL_CALL_LONG:
+            // anything but JIT_RETURNED ends this machine code, with the same status
+            emitSaveIp(e, next);
+            emitSyncStack(e);
+            emitMovImm32(e, RDI, countOperand(ip));
+            emitCall(e, (void*)jitTailCall);
+            emitRaw(e, "\x83\xF8\x01", 3);            // cmp eax, JIT_RETURNED
+            emitJump(e, CC_NE, PATCH_EXIT, EXIT_RETURN);
+            emitReload(e);
+            return;
+        case OP_INVOKE: {
+            uint16_t cacheIndex = (ip[3] << 8) | ip[4];
+            emitSaveIp(e, next);
+            emitSyncStack(e);
+            emitMovImm(e, RDI, chunk->constants.values[ip[1]]);
+            emitMovImm32(e, RSI, ip[2]);
+            emitMovImm(e, RDX, cacheIndex == NO_INLINE_CACHE ? 0 : (uint64_t)(uintptr_t)&chunk->caches[cacheIndex]);
+            emitCall(e, (void*)jitInvoke);
+            emitHelperResult(e, PATCH_EXIT, EXIT_THREW);
+            emitReload(e);
+            return;
+        }
+        case OP_CLOSURE:
+            emitSyncStack(e);
+            emitMovImm(e, RDI, (uint64_t)(uintptr_t)ip);
+            emitCall(e, (void*)jitClosure);
+            emitReload(e);
+            return;
+        case OP_CLOSE_UPVALUE:
+            emitLea(e, RDI, STACK_TOP, -8);
+            emitCall(e, (void*)jitCloseUpvalues);
+            emitAluImm(e, IMM_SUB, STACK_TOP, 8);
+            return;
+        case OP_RETURN: {
+            emitLoad(e, RAX, VM_REG, offsetof(VM, openUpvalues));
+            emitRaw(e, "\x48\x85\xC0", 3);            // test rax, rax
+            int closed = emitShortJump(e, CC_E);
+            emitAlu(e, ALU_MOV, RDI, SLOTS);
+            emitCall(e, (void*)jitCloseUpvalues);
+            patchShortJump(e, closed);
+            // the result replaces the callee; the frame is popped
+            emitLoad(e, RAX, STACK_TOP, -8);
+            emitStore(e, SLOTS, 0, RAX);
+            emitLea(e, RAX, SLOTS, 8);
+            emitStore(e, VM_REG, offsetof(VM, stackTop), RAX);
+            emitByte(e, 0x41);                         // dec dword [r15 + frameCount]
+            emitByte(e, 0xFF);
+            emitMemory(e, 1, VM_REG, offsetof(VM, frameCount));
+            emitMovImm32(e, RAX, JIT_RETURNED);
+            emitJump(e, CC_ALWAYS, PATCH_EXIT, EXIT_RETURN);
+            return;
+        }
+
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY: {
+            uint16_t cacheIndex = (ip[2] << 8) | ip[3];
+            emitMovImm(e, RDI, chunk->constants.values[ip[1]]);
+            emitMovImm(e, RSI, cacheIndex == NO_INLINE_CACHE ? 0 : (uint64_t)(uintptr_t)&chunk->caches[cacheIndex]);
+            emitFullHelper(e, next, *ip == OP_GET_PROPERTY ? (void*)jitGetProperty : (void*)jitSetProperty);
+            return;
+        }
+        case OP_INDEX_GET:
+        case OP_INDEX_SET:
+        case OP_INDEX_UPDATE:
+            emitMovImm32(e, RDI, ip[1]);
+            emitFullHelper(e, next, *ip == OP_INDEX_GET ? (void*)jitIndexGet
+                                  : *ip == OP_INDEX_SET ? (void*)jitIndexSet : (void*)jitIndexUpdate);
+            return;
+
+
+        case OP_ADD_LOCAL_CONSTANT:
+            emitArithmetic(e, offset, 0x58, ip);
+            return;
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            emitArithmetic(e, offset, 0x5C, ip);
+            return;
+        case OP_LESS_LOCAL_CONSTANT:
+        case OP_LESS_LOCAL_LOCAL:
+            emitComparison(e, offset, false, ip);
+            return;
+        case OP_SET_LOCAL_POP:
+            emitLoad(e, RAX, STACK_TOP, -8);
+            emitStore(e, SLOTS, 8 * ip[1], RAX);
+            emitAluImm(e, IMM_SUB, STACK_TOP, 8);
+            return;
+
+        default:
+            break;
+    }
+    // no template: hand the frame to the interpreter
+    emitJump(e, CC_ALWAYS, PATCH_BAIL, offset);
+}
+
+static void emitBailStub(Emitter* e, int offset){
+    // resumes the interpreter at the instruction, and returns whatever it ends with
+    emitSaveIp(e, e->function->chunk.code + offset);
+    emitSyncStack(e);
+    emitAlu(e, ALU_MOV, RDI, FRAME_INDEX);
+    emitCall(e, (void*)jitResume);
+    emitRaw(e, "\x0F\xB6\xC0", 3);                // movzx eax, al
+    emitJump(e, CC_ALWAYS, PATCH_EXIT, EXIT_RETURN);
+}
+
+
+// COMPILATION
+
+bool jitCompile(ObjFunction* function){
+    // compiles function to machine code. returns false if it could not be mapped
+    Chunk* chunk = &function->chunk;
+    Emitter e = {0};
+    e.function = function;
+    e.labels = (int*)malloc(sizeof(int) * chunk->count);
+    e.stubs = (int*)malloc(sizeof(int) * chunk->count);
+    if (e.labels == NULL || e.stubs == NULL) exit(1);
+    for (int i = 0; i < chunk->count; i++){
+        e.labels[i] = -1;
+        e.stubs[i] = -1;
+    }
+
+    // prologue: five pushes keep rsp 16-byte aligned for helper calls
+    emitPushReg(&e, RBX);
+    emitPushReg(&e, R12);
+    emitPushReg(&e, R13);
+    emitPushReg(&e, R14);
+    emitPushReg(&e, R15);
+    emitRaw(&e, "\x4C\x63\xEF", 3);               // movsxd r13, edi
+    emitMovImm(&e, QNAN_REG, QNAN);
+    emitMovImm(&e, VM_REG, (uint64_t)(uintptr_t)&vm);
+    emitReload(&e);
+
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)){
+        e.labels[offset] = e.count;
+        emitInstruction(&e, offset);
+    }
+
+    int exits[2];
+    exits[EXIT_THREW] = e.count;
+    emitRaw(&e, "\x31\xC0", 2);                   // xor eax, eax (JIT_THREW)
+    exits[EXIT_RETURN] = e.count;
+    emitPopReg(&e, R15);
+    emitPopReg(&e, R14);
+    emitPopReg(&e, R13);
+    emitPopReg(&e, R12);
+    emitPopReg(&e, RBX);
+    emitByte(&e, 0xC3);                           // ret
+
+    // bail stubs are emitted out of line, one per instruction that needs one
+    // (stubs add patches of their own, so patchCount is read on every iteration)
+    for (int i = 0; i < e.patchCount; i++){
+        JitPatch patch = e.patches[i];
+        int target;
+        if (patch.kind == PATCH_JUMP){
+            target = e.labels[patch.target];
+        } else if (patch.kind == PATCH_EXIT){
+            target = exits[patch.target];
+        } else {
+            if (e.stubs[patch.target] < 0){
+                e.stubs[patch.target] = e.count;
+                emitBailStub(&e, patch.target);
+            }
+            target = e.stubs[patch.target];
+        }
+        patch32(&e, patch.at, target - (patch.at + 4));
+    }
+
+    void* code = mmap(NULL, e.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    bool success = code != MAP_FAILED;
+    if (success){
+        memcpy(code, e.code, e.count);
+        if (mprotect(code, e.count, PROT_READ | PROT_EXEC) == 0){
+            function->jitCode = code;
+            function->jitSize = e.count;
+        } else {
+            munmap(code, e.count);
+            success = false;
+        }
+    }
+    free(e.code);
+    free(e.labels);
+    free(e.stubs);
+    free(e.patches);
+    return success;
+}
+
+void jitFree(ObjFunction* function){
+    // code installed by --emit-c programs (jitSize 0) is not ours to unmap
+    if (function->jitCode != NULL && function->jitSize > 0){
+        munmap(function->jitCode, function->jitSize);
+        function->jitCode = NULL;
+        function->jitSize = 0;
+    }
+}
+
+#endif
+
+bool jitRun(ObjFunction* function, int frameIndex){
+    // runs the frame at frameIndex as native code until it returns or throws
+    for (;;){
+        JitStatus status = ((JitCode)function->jitCode)(frameIndex);
+        if (status != JIT_REPLACED) return status == JIT_RETURNED;
+        // a tail call replaced the frame. keep going in native code if the callee has some
+        function = getFrameFunction(&vm.frames[frameIndex]);
+        if (function->jitCode != NULL) continue;
+        #ifdef VM_JIT
+        if (vm.jitEnabled && ++function->callCount == JIT_THRESHOLD && jitCompile(function)) continue;
+        #endif
+        return jitResume(frameIndex);
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "vm.h"
+
+// Native code: functions whose ObjFunction carries jitCode run it instead of their bytecode.
+// The code comes from the baseline JIT (VM_JIT builds), or from C generated by --emit-c (aot.h).
+// It runs its frame to completion, nested on the C stack; past JIT_DEPTH_MAX levels of nesting,
+// calls stay in the interpreter.
+#define JIT_DEPTH_MAX (RUN_DEPTH_MAX / 2)
+
+// what the native code of a frame returns
+typedef enum {
+    JIT_THREW,       // an exception was not caught above the frame; it is on top of the stack
+    JIT_RETURNED,    // the frame returned, its result replaces the callee on the stack
+    JIT_REPLACED     // a tail call reused the frame for another function
+} JitStatus;
+typedef JitStatus (*JitCode)(int frameIndex);
+
+bool jitRun(ObjFunction* function, int frameIndex);
+
+#ifdef VM_JIT
+// Baseline JIT: a function is compiled to x86-64 machine code on its JIT_THRESHOLD-th call.
+// Every opcode becomes a fixed template; jumps become direct jumps, and the stack top and frame
+// slots live in registers. Opcodes without a template (and failed guards) bail out: the frame
+// is handed back to the interpreter at that instruction and finishes there.
+#define JIT_THRESHOLD 100
+
+bool jitCompile(ObjFunction* function);
+void jitFree(ObjFunction* function);
+#endif
+
+// Runtime helpers called from native code (defined in vm.c)
+// The frame running as native code is always the top frame when they are called.
+// Helpers returning bool return false when an exception was thrown (it is on top of the stack),
+// except jitResume, which returns false if the frame threw.
+bool jitResume(int frameIndex);
+bool jitCall(int argCount);
+JitStatus jitTailCall(int argCount);
+bool jitInvoke(Value name, int argCount, InlineCache* cache);
+bool jitSafepoint();
+bool jitSuperInvoke(Value name, int argCount);
+void jitClosure(uint8_t* ip);
+void jitCloseUpvalues(Value* last);
+Value* jitOuterLocal(int upvalue, int slot);
+void jitDefineGlobal(Value name);
+bool jitGetGlobal(Value name);
+bool jitSetGlobal(Value name);
+bool jitGetStl(Value name);
+bool jitOperator(Protocol protocol);
+bool jitPrint();
+bool jitBuildString(int count);
+void jitThrow();
+void jitClass(Value name);
+void jitMethod(Value name, bool isStatic);
+bool jitInherit(bool multiple);
+bool jitGetProperty(Value name, InlineCache* cache);
+bool jitSetProperty(Value name, InlineCache* cache);
+bool jitGetSuper(Value name);
+bool jitIndexGet(int count);
+bool jitIndexSet(int count);
+bool jitIndexUpdate(int count);
+
+#endif
@@ -1,11 +1,46 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "aot.h"
 #include "common.h"
+#include "compiler.h"
+#include "debug.h"
 #include "io.h"
 #include "vm.h"
 
+// Instrumentation selected from the command line
+// (reinstalled every time the VM is initialized)
+static InstructionHook instructionHook = NULL;
+static CompileHook compileHook = NULL;
+static int maxFrames = FRAMES_MAX;
+static bool useJit = true;
+static bool optimize = false;
+static bool emitCode = false;
+static long timeLimit = 0;    // milliseconds of CPU time, 0 for none
+static clock_t deadline;
+
+static bool checkDeadline(){
+    // safepoint hook of --time-limit
+    return clock() < deadline;
+}
+
+static void startVM(){
+    initVM();
+    vm.instructionHook = instructionHook;
+    vm.compileHook = compileHook;
+    vm.maxFrames = maxFrames;
+    vm.optimizeCode = optimize;
+    if (timeLimit > 0){
+        deadline = clock() + (clock_t)(timeLimit * (CLOCKS_PER_SEC / 1000.0));
+        vm.safepointHook = checkDeadline;
+    }
+    #ifdef VM_JIT
+    vm.jitEnabled = useJit;
+    #endif
+}
+
 static void repl(){
     char line[1024];
     for (;;){
@@ -17,7 +52,7 @@ static void repl(){
         if (memcmp(line, "exit\n", 5) == 0) break;
         if (memcmp(line, "reset\n", 5) == 0){
             freeVM();
-            initVM();
+            startVM();
             continue;
         }
         interpret(line, true);
@@ -29,19 +64,82 @@ static void runFile(const char* path){
     interpret(source, false);
 }
 
+static void emitFile(const char* path){
+    // prints the script as a C program instead of running it (see aot.h)
+    char* source = readFile(path);
+    ObjFunction* script = compile(source, false);
+    if (script == NULL) return;
+    emitC(script, source, readFile("src/stl.lox"), stdout);
+}
+
+static void usage(){
+    fprintf(stderr, "Usage: ./lox.sh [options] [path]\n");
+    fprintf(stderr, "    |  ./lox.sh [options]       \n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    --trace       print the stack and each instruction as it executes\n");
+    fprintf(stderr, "    --profile     print opcode and opcode-pair counts on exit\n");
+    fprintf(stderr, "    --print-code  print the disassembly of every compiled function\n");
+    fprintf(stderr, "    --print-ir    print the SSA form of every compiled function\n");
+    fprintf(stderr, "    --max-depth N limit the call depth to N frames (default %d)\n", FRAMES_MAX);
+    fprintf(stderr, "    --time-limit MS interrupt the script after MS milliseconds of CPU time\n");
+    fprintf(stderr, "    --no-jit      run everything in the interpreter\n");
+    fprintf(stderr, "    --optimize    run the peephole optimizer over compiled code, report bytes saved on exit\n");
+    fprintf(stderr, "    --emit-c      print the script as a C program instead of running it\n");
+    exit(1);
+}
+
 int main(int argc, const char *argv[]) {
     
-    initVM();
-    if (argc == 1){
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--trace") == 0){
+            if (instructionHook != NULL) usage();
+            instructionHook = traceExecution;
+        } else if (strcmp(argv[i], "--profile") == 0){
+            if (instructionHook != NULL) usage();
+            instructionHook = profileExecution;
+        } else if (strcmp(argv[i], "--print-code") == 0){
+            if (compileHook != NULL) usage();
+            compileHook = printFunctionCode;
+        } else if (strcmp(argv[i], "--print-ir") == 0){
+            if (compileHook != NULL) usage();
+            compileHook = printFunctionIr;
+        } else if (strcmp(argv[i], "--max-depth") == 0){
+            if (i + 1 == argc) usage();
+            maxFrames = atoi(argv[++i]);
+            if (maxFrames < 1) usage();
+        } else if (strcmp(argv[i], "--time-limit") == 0){
+            if (i + 1 == argc) usage();
+            timeLimit = atol(argv[++i]);
+            if (timeLimit < 1) usage();
+        } else if (strcmp(argv[i], "--no-jit") == 0){
+            useJit = false;
+        } else if (strcmp(argv[i], "--optimize") == 0){
+            optimize = true;
+        } else if (strcmp(argv[i], "--emit-c") == 0){
+            emitCode = true;
+        } else if (argv[i][0] == '-' || path != NULL){
+            usage();
+        } else {
+            path = argv[i];
+        }
+    }
+
+    if (emitCode && path == NULL) usage();
+
+    startVM();
+    if (emitCode){
+        emitFile(path);
+    } else if (path == NULL){
         repl();
-    } else if (argc == 2){
-        runFile(argv[1]);
     } else {
-        fprintf(stderr, "Usage: ./lox.sh [path]\n");
-        fprintf(stderr, "    |  ./lox.sh       \n");
-        exit(1);
+        runFile(path);
     }
+    long bytesOptimized = vm.bytesOptimized;
     freeVM();
 
+    if (instructionHook == profileExecution) printProfile();
+    if (optimize && !emitCode) fprintf(stderr, "Peephole optimizer: %ld bytes saved.\n", bytesOptimized);
+
     return 0;
-}
\ No newline at end of file
+}
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
 #include "vm.h"
@@ -52,6 +53,9 @@ void freeObject(Obj* object){
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
+            #ifdef VM_JIT
+            jitFree(function);
+            #endif
             freeChunk(&function->chunk);
             FREE(ObjFunction, function);
             break;
@@ -76,11 +80,20 @@ void freeObject(Obj* object){
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
+            FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
             FREE(ObjInstance, object);
             break;
         }
         case OBJ_BOUND_METHOD: {
+            // bound methods are short-lived and come and go in bulk: keep a few for newBoundMethod
+            if (vm.boundMethodPoolCount < BOUND_METHOD_POOL_MAX){
+                ObjBoundMethod* bound = (ObjBoundMethod*)object;
+                bound->method = (Obj*)vm.boundMethodPool;
+                vm.boundMethodPool = bound;
+                vm.boundMethodPoolCount++;
+                vm.bytesAllocated -= sizeof(ObjBoundMethod);
+                break;
+            }
             FREE(ObjBoundMethod, object);
             break;
         }
@@ -105,6 +118,15 @@ void freeObject(Obj* object){
             FREE(ObjHashmap, hashmap);
             break;
         }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            freeTable(&shape->slots);
+            freeTable(&shape->transitions);
+            FREE(ObjShape, shape);
+            break;
+        }
+        case OBJ_TYPE_COUNT:
+            break;    // Unreachable: not a type.
     }
 }
 
@@ -116,6 +138,13 @@ void freeObjects(){
         freeObject(object);
         object = next;
     }
+    // pooled bound methods are no longer counted in vm.bytesAllocated
+    while (vm.boundMethodPool != NULL){
+        ObjBoundMethod* next = (ObjBoundMethod*)vm.boundMethodPool->method;
+        free(vm.boundMethodPool);
+        vm.boundMethodPool = next;
+    }
+    vm.boundMethodPoolCount = 0;
     free(vm.grayStack);
 }
 
@@ -171,8 +200,20 @@ static void markRoots(){
     
     // mark all global variables and STL
     markTable(&vm.stl);
-    markTable(&vm.globals);
+    markTable(&vm.globalIndices);
+    for (int i = 0; i < vm.globalCount; i++){
+        markValue(vm.globalSlots[i].name);
+        markValue(vm.globalSlots[i].value);
+        markValue(vm.globalSlots[i].stl);
+    }
     markValue(vm.initString);
+    for (int i = 0; i < PROTOCOL_COUNT; i++){
+        markValue(vm.protocolNames[i]);
+    }
+    for (int i = 0; i < SYNTH_KIND_COUNT; i++){
+        markObject((Obj*)vm.synthClasses[i]);
+    }
+    markObject((Obj*)vm.rootShape);
 
     // mark compiler roots
     markCompilerRoots();
@@ -197,6 +238,16 @@ static void blackenObject(Obj* object){
             ObjFunction* function = (ObjFunction*)object;
             markObject((Obj*)function->name);
             markArray(&function->chunk.constants);
+            // inline caches keep their classes alive, so a cached class pointer is never reused
+            for (int i = 0; i < function->chunk.cacheCount; i++){
+                InlineCache* cache = &function->chunk.caches[i];
+                for (int j = 0; j < cache->count; j++){
+                    markObject(cache->ways[j].klass);
+                    markValue(cache->ways[j].method);
+                }
+                markObject(cache->shape);
+                markObject(cache->transition);
+            }
             break;
         }
         case OBJ_CLOSURE: {
@@ -213,12 +264,18 @@ static void blackenObject(Obj* object){
             markObject((Obj*)klass->name);
             markTable(&klass->methods);
             markTable(&klass->statics);
+            for (int i = 0; i < PROTOCOL_COUNT; i++){
+                markValue(klass->protocols[i]);
+            }
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
+            markObject((Obj*)instance->shape);
+            for (int i = 0; i < instance->shape->count; i++){
+                markValue(instance->fields[i]);
+            }
             break;
         }
         case OBJ_BOUND_METHOD: {
@@ -247,7 +304,17 @@ static void blackenObject(Obj* object){
             markTable(&hashmap->data);
             break;
         }
-        
+        case OBJ_SHAPE: {
+            // transitions keep every shape reachable from the root alive
+            ObjShape* shape = (ObjShape*)object;
+            markObject((Obj*)shape->parent);
+            markValue(shape->name);
+            markTable(&shape->slots);
+            markTable(&shape->transitions);
+            break;
+        }
+        case OBJ_TYPE_COUNT:
+            break;    // Unreachable: not a type.
     }
 }
 static void traceReferences(){
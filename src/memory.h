@@ -20,6 +20,9 @@
 #define FREE_ARRAY(type, ptr, oldCount) \
     (type*)reallocate(ptr, oldCount * sizeof(type), 0)
 
+// freed bound methods kept by the GC for reuse
+#define BOUND_METHOD_POOL_MAX 64
+
 void* reallocate(void* ptr, size_t oldSize, size_t newSize);
 void freeObjects();
 
@@ -16,63 +16,19 @@ Value clockNative(int argCount, Value* args){
 
 Value typeNative(int argCount, Value* args){
     Value value = args[0];
+    if (IS_NIL(value)) return NIL_VAL();
+    if (IS_CLASS(value)) return value;
+    if (IS_INSTANCE(value)) return OBJ_VAL(AS_INSTANCE(value)->klass);
 
-    // if a synth identified, the string is already interned. this is safe.
-    ObjString* synth = NULL;
-
-    if (IS_NIL(value)){
-        return NIL_VAL();
-    } else if (IS_BOOL(value)){
-        synth = copyString("Boolean", 7);
-    } else if (IS_NUMBER(value)){
-        synth = copyString("Number", 6);
-    } else {
-        switch(OBJ_TYPE(value)){
-            case OBJ_STRING: {
-                synth = copyString("String", 6);
-                break;
-            }
-            case OBJ_NATIVE:
-            case OBJ_FUNCTION:
-            case OBJ_CLOSURE:
-            case OBJ_BOUND_METHOD: {
-                synth = copyString("Function", 8);
-                break;
-            }
-            case OBJ_CLASS:
-                return value;
-            case OBJ_INSTANCE:
-                return OBJ_VAL(AS_INSTANCE(value)->klass);
-
-            case OBJ_EXCEPTION:{
-                synth = copyString("Exception", 9);
-                break;
-            }
-            case OBJ_ARRAY: {
-                synth = copyString("Array", 5);
-                break;
-            }
-            case OBJ_ARRAY_SLICE: {
-                synth = copyString("Slice", 5);
-                break;
-            }
-            case OBJ_HASHMAP: {
-                synth = copyString("Hashmap", 7);
-            }
-            default: ;    // Fallthrough
-        }
-    }
-    if (synth != NULL){
-        // the sentinels must be in the STL.
-        Value klass;
-        tableGet(&vm.stl, OBJ_VAL(synth), &klass);
-        return klass;
-    }
+    // synth classes are looked up once, when the STL is loaded
+    ObjClass* synth = synthClass(value);
+    if (synth != NULL) return OBJ_VAL(synth);
     return EMPTY_VAL();
 }
 
 Value hasMethodNative(int argCount, Value* args){
     Value klass = typeNative(1, &args[0]);
+    if (!IS_CLASS(klass)) return NIL_VAL();
     Value output;
     if (tableGet(&AS_CLASS(klass)->methods, args[1], &output))
         return output;
@@ -139,7 +95,7 @@ Value stringPrimitiveNative(int argCount, Value* args){
                 return OBJ_VAL(printFunctionToString( OBJ_VAL(AS_BOUND_METHOD(value)->method) ));
 
             case OBJ_CLASS:
-                return OBJ_VAL(printToString("<class %s>", AS_CLASS(value)->name));
+                return OBJ_VAL(printToString("<class %s>", AS_CLASS(value)->name->chars));
             case OBJ_INSTANCE:
                 return OBJ_VAL(printToString("<%s instance>", AS_INSTANCE(value)->klass->name->chars));
 
@@ -154,6 +110,10 @@ Value stringPrimitiveNative(int argCount, Value* args){
                 return OBJ_VAL(copyString("<Slice object>", 14));
             case OBJ_HASHMAP:
                 return OBJ_VAL(copyString("<Hashmap object>", 16));
+            case OBJ_UPVALUE:
+            case OBJ_SHAPE:
+            case OBJ_TYPE_COUNT:
+                break;    // Unreachable: never Lox values.
         }
     }
     return OBJ_VAL(copyString("", 0));
@@ -161,15 +121,18 @@ Value stringPrimitiveNative(int argCount, Value* args){
 Value stringNative(int argCount, Value* args){
     // EMPTY_VAL can also signify that native function has passed execution to non-native function
     Value value = args[0];
-    Value toStringName = OBJ_VAL(copyString("toString", 8));
-    args[1] = toStringName;
+    args[1] = vm.protocolNames[PROTOCOL_TO_STRING];
     Value hasToString = hasMethodNative(2, args);
     if (!IS_NIL(hasToString)){
-        // rearrange for call signature of toString().
-        args[-1] = args[0];
-        pop();
-        callValue(hasToString, 0);
-        return EMPTY_VAL();
+        // call toString() with the value as 'this'. the call may relocate the stack,
+        // so an exception is written to the receiver slot by its position
+        int receiver = (int)(args - 1 - vm.stack);
+        Value result;
+        if (!vmCallMethod(value, hasToString, 0, NULL, &result)){
+            vm.stack[receiver] = result;
+            return EMPTY_VAL();
+        }
+        return result;
     }
     return stringPrimitiveNative(argCount, args);
 }
@@ -194,9 +157,7 @@ Value concatenateNative(int argCount, Value* args){
     return(OBJ_VAL(result));
 }
 Value stringAddNative(int argCount, Value* args){
-    Value stringSentinel;
-    tableGet(&vm.stl, OBJ_VAL(copyString("String", 6)), &stringSentinel);
-    if (typeNative(1, &args[0]) != stringSentinel){
+    if (!IS_STRING(args[0])){
         args[-1] = OBJ_VAL(copyString("Operand not a string.", 21));
         return EMPTY_VAL();
     }
@@ -207,6 +168,7 @@ Value stringGetNative(int argCount, Value* args){
     ObjString* str = AS_STRING(args[-1]);
     if (IS_NUMBER(args[0])){
         int idx = stringCheckIndex(args, str, args[0]);
+        if (idx == -1) return EMPTY_VAL();
         return OBJ_VAL(copyString(&str->chars[idx], 1));
     }
     else if (IS_ARRAY_SLICE(args[0])){
@@ -472,6 +434,94 @@ Value arrayLengthNative(int argCount, Value* args){
     return NUMBER_VAL(AS_ARRAY(args[-1])->data.count);
 }
 
+// higher-order array methods call back into Lox through vmCall, which may relocate the stack.
+// they keep the position of the receiver slot to report exceptions, instead of args.
+static bool checkCallback(Value* args, Value fn, int arity){
+    // writes an exception and returns false unless fn is a function taking arity arguments
+    int fnArity;
+    if (IS_BOUND_METHOD(fn)) fn = OBJ_VAL(AS_BOUND_METHOD(fn)->method);
+    if (IS_CLOSURE(fn)) fnArity = AS_CLOSURE(fn)->function->arity;
+    else if (IS_FUNCTION(fn)) fnArity = AS_FUNCTION(fn)->arity;
+    else if (IS_NATIVE(fn)) fnArity = AS_NATIVE(fn)->arity;
+    else {
+        writeException(args, OBJ_VAL(printToString("Argument must be a function.")));
+        return false;
+    }
+    if (fnArity != arity && fnArity != -1){
+        writeException(args, OBJ_VAL(printToString(arity == 1 ? "Function must take in exactly one argument."
+                                                                : "Function must take in exactly two arguments.")));
+        return false;
+    }
+    return true;
+}
+Value arrayMapNative(int argCount, Value* args){
+    if (!checkCallback(args, args[0], 1)) return EMPTY_VAL();
+    int receiver = (int)(args - 1 - vm.stack);
+    ObjArray* array = AS_ARRAY(args[-1]);
+    Value fn = args[0];
+
+    // the result is filled in place, so that no allocation happens while a result is unanchored
+    int length = array->data.count;
+    ObjArray* result = newArray();
+    push(OBJ_VAL(result));
+    for (int i = 0; i < length; i++){
+        writeValueArray(&result->data, NIL_VAL());
+    }
+    for (int i = 0; i < length && i < array->data.count; i++){
+        Value element = array->data.values[i];
+        Value output;
+        if (!vmCall(fn, 1, &element, &output)){
+            pop();
+            vm.stack[receiver] = output;
+            return EMPTY_VAL();
+        }
+        result->data.values[i] = output;
+    }
+    return pop();
+}
+Value arrayFilterNative(int argCount, Value* args){
+    if (!checkCallback(args, args[0], 1)) return EMPTY_VAL();
+    int receiver = (int)(args - 1 - vm.stack);
+    ObjArray* array = AS_ARRAY(args[-1]);
+    Value fn = args[0];
+
+    ObjArray* result = newArray();
+    push(OBJ_VAL(result));
+    for (int i = 0; i < array->data.count; i++){
+        Value element = array->data.values[i];
+        Value output;
+        if (!vmCall(fn, 1, &element, &output)){
+            pop();
+            vm.stack[receiver] = output;
+            return EMPTY_VAL();
+        }
+        if (!isFalsey(output)) writeValueArray(&result->data, element);
+    }
+    return pop();
+}
+Value arrayReduceNative(int argCount, Value* args){
+    if (!checkCallback(args, args[0], 2)) return EMPTY_VAL();
+    ObjArray* array = AS_ARRAY(args[-1]);
+    if (array->data.count < 1){
+        writeException(args, OBJ_VAL(printToString("Array must have a minimum length of 2.")));
+        return EMPTY_VAL();
+    }
+    int receiver = (int)(args - 1 - vm.stack);
+    Value fn = args[0];
+
+    // the accumulator is anchored in its own stack slot between calls
+    int accumulator = (int)(vm.stackTop - vm.stack);
+    push(array->data.values[0]);
+    for (int i = 1; i < array->data.count; i++){
+        Value pair[2] = {vm.stack[accumulator], array->data.values[i]};
+        if (!vmCall(fn, 2, pair, &vm.stack[accumulator])){
+            vm.stack[receiver] = pop();
+            return EMPTY_VAL();
+        }
+    }
+    return pop();
+}
+
 
 // SLICE SYNTH METHODS
 
@@ -598,7 +648,7 @@ ImportInfo buildSTL(){
             IMPORT_NATIVE("init", exceptionInitNative, 1),
             IMPORT_NATIVE("payload", exceptionPayloadNative, 0),
 
-        IMPORT_SYNTH("Array", 8),
+        IMPORT_SYNTH("Array", 11),
             IMPORT_STATIC("@raw", arrayRawNative, -1),
             IMPORT_NATIVE("init", arrayInitNative, -1),
             IMPORT_NATIVE("get", arrayGetNative, 1),
@@ -607,6 +657,9 @@ ImportInfo buildSTL(){
             IMPORT_NATIVE("insert", arrayInsertNative, 2),
             IMPORT_NATIVE("delete", arrayDeleteNative, 1),
             IMPORT_NATIVE("length", arrayLengthNative, 0),
+            IMPORT_NATIVE("map", arrayMapNative, 1),
+            IMPORT_NATIVE("filter", arrayFilterNative, 1),
+            IMPORT_NATIVE("reduce", arrayReduceNative, 1),
 
         IMPORT_SYNTH("Slice", 2),
             IMPORT_STATIC("@raw", sliceRawNative, -1),
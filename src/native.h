@@ -53,5 +53,6 @@ Value typeNative(int argCount, Value* args);
 Value hasMethodNative(int argCount, Value* args);
 
 Value stringPrimitiveNative(int argCount, Value* args);
+Value sliceInitNative(int argCount, Value* args);
 
 #endif
\ No newline at end of file
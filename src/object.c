@@ -12,10 +12,7 @@
 #define ALLOCATE_OBJ(type, objectType) \
     (type*)allocateObject(sizeof(type), objectType)
 
-static Obj* allocateObject(size_t size, ObjType type){
-    // allocate and assign object type
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
-
+static void linkObject(Obj* object, ObjType type){
     // initialize fields to default values, chain to vm.objects as head of linked list
     #ifdef OBJ_HEADER_COMPRESSION
     object->header = ((uint64_t)vm.objects << 8)  | (uint64_t)type;
@@ -27,6 +24,11 @@ static Obj* allocateObject(size_t size, ObjType type){
     object->next = vm.objects;
     vm.objects = object;
     #endif
+}
+static Obj* allocateObject(size_t size, ObjType type){
+    // allocate and assign object type
+    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    linkObject(object, type);
 
     #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -106,6 +108,7 @@ ObjString* printFunctionToString(Value value){
         case OBJ_NATIVE:    return printToString("<fn %s>", AS_NATIVE(value)->name->chars);
         case OBJ_FUNCTION:  return printToString("<fn %s>", AS_FUNCTION(value)->name->chars);
         case OBJ_CLOSURE:   return printToString("<fn %s>", AS_CLOSURE(value)->function->name->chars);
+        default:            break;    // Unreachable: only callables are passed here.
     }
     return takeString("", 0);
 }
@@ -124,8 +127,10 @@ ObjFunction* newFunction(){
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
-    function->fromTry = false;
     function->name = NULL;
+    function->callCount = 0;
+    function->jitCode = NULL;
+    function->jitSize = 0;
     initChunk(&function->chunk);
     setIsLocked((Obj*)function, true);
     return function;
@@ -151,6 +156,17 @@ ObjClosure* newClosure(ObjFunction* function){
     closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
     closure->function = function;
+    closure->frame = -1;
+    setIsLocked((Obj*)closure, true);
+
+    return closure;
+}
+ObjClosure* newInPlaceClosure(ObjFunction* function, int frame){
+    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    closure->upvalues = NULL;
+    closure->upvalueCount = 0;
+    closure->function = function;
+    closure->frame = frame;
     setIsLocked((Obj*)closure, true);
 
     return closure;
@@ -162,22 +178,101 @@ ObjClass* newClass(ObjString* name){
     klass->name = name;
     initTable(&klass->methods);
     initTable(&klass->statics);
+    for (int i = 0; i < PROTOCOL_COUNT; i++){
+        klass->protocols[i] = EMPTY_VAL();
+    }
     setIsLocked((Obj*)klass, true);
     return klass;
 }
+void updateProtocols(ObjClass* klass){
+    for (int i = 0; i < PROTOCOL_COUNT; i++){
+        Value method;
+        klass->protocols[i] = tableGet(&klass->methods, vm.protocolNames[i], &method) ? method : EMPTY_VAL();
+    }
+}
+
+// OBJSHAPE METHODS
+ObjShape* newShape(ObjShape* parent, Value name){
+    // creates the shape reached from parent by adding field name
+    // (parent is NULL for the root shape, which has no fields)
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->count = 0;
+    initTable(&shape->slots);
+    initTable(&shape->transitions);
+    if (parent == NULL) return shape;
+
+    push(OBJ_VAL(shape));
+    tableAddAll(&parent->slots, &shape->slots);
+    tableSet(&shape->slots, name, NUMBER_VAL(parent->count));
+    shape->count = parent->count + 1;
+    tableSet(&parent->transitions, name, OBJ_VAL(shape));
+    pop();
+    return shape;
+}
+int shapeSlot(ObjShape* shape, Value name){
+    // returns the slot of field name, or -1 if the shape does not have it
+    Value slot;
+    if (!tableGet(&shape->slots, name, &slot)) return -1;
+    return (int)AS_NUMBER(slot);
+}
+ObjShape* shapeTransition(ObjShape* shape, Value name){
+    // returns the shape with field name added, creating it on first use
+    Value child;
+    if (tableGet(&shape->transitions, name, &child)) return AS_SHAPE(child);
+    return newShape(shape, name);
+}
 
 // OBJINSTANCE METHODS
 ObjInstance* newInstance(ObjClass* klass){
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = vm.rootShape;
+    instance->fields = NULL;
+    instance->fieldCapacity = 0;
     instance->hash = -1;
     return instance;
 }
+bool getField(ObjInstance* instance, Value name, Value* value){
+    int slot = shapeSlot(instance->shape, name);
+    if (slot < 0) return false;
+    *value = instance->fields[slot];
+    return true;
+}
+void setField(ObjInstance* instance, Value name, Value value){
+    // the instance and value must be reachable, as adding a field may allocate
+    int slot = shapeSlot(instance->shape, name);
+    if (slot >= 0){
+        instance->fields[slot] = value;
+        return;
+    }
+    appendField(instance, shapeTransition(instance->shape, name), value);
+}
+void appendField(ObjInstance* instance, ObjShape* shape, Value value){
+    // moves instance to shape, a direct child of its current shape, storing value in the new slot
+    if (shape->count > instance->fieldCapacity){
+        int oldCapacity = instance->fieldCapacity;
+        int capacity = oldCapacity < 4 ? 4 : oldCapacity * 2;
+        instance->fields = GROW_ARRAY(Value, instance->fields, oldCapacity, capacity);
+        instance->fieldCapacity = capacity;
+    }
+    instance->fields[shape->count - 1] = value;
+    instance->shape = shape;
+}
 
 // OBJBOUNDMETHOD METHODS
 ObjBoundMethod* newBoundMethod(Value receiver, Obj* method){
-    ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+    // bound methods freed by the GC are reused before anything new is allocated (see freeObject)
+    ObjBoundMethod* bound = vm.boundMethodPool;
+    if (bound != NULL){
+        vm.boundMethodPool = (ObjBoundMethod*)bound->method;
+        vm.boundMethodPoolCount--;
+        vm.bytesAllocated += sizeof(ObjBoundMethod);
+        linkObject((Obj*)bound, OBJ_BOUND_METHOD);
+    } else {
+        bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+    }
     bound->receiver = receiver;
     bound->method = method;
     return bound;
@@ -282,7 +377,10 @@ void printObject(Value value){
                 printValue(hashmap->data.entries[i].value);
             }
             printf(" }");
+            break;
         }
+        case OBJ_SHAPE:
+            printf("<shape>"); break;
         default: break;    // Unreachable.
     }
 }
\ No newline at end of file
@@ -23,7 +23,9 @@ typedef enum {
     OBJ_EXCEPTION,
     OBJ_ARRAY,
     OBJ_ARRAY_SLICE,
-    OBJ_HASHMAP
+    OBJ_HASHMAP,
+    OBJ_SHAPE,
+    OBJ_TYPE_COUNT
 } ObjType;
 
 #ifdef OBJ_HEADER_COMPRESSION
@@ -137,9 +139,11 @@ typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
-    bool fromTry;
     Chunk chunk;
     ObjString* name;
+    int callCount;      // calls so far, towards JIT_THRESHOLD
+    void* jitCode;      // machine code from the JIT, or NULL
+    size_t jitSize;
 } ObjFunction;
 ObjFunction* newFunction();
 
@@ -159,27 +163,71 @@ typedef struct {
     ObjFunction* function;
     ObjUpvalue** upvalues;
     int upvalueCount;
+    int frame;          // in-place closures: the frame whose locals it reads (OP_GET_OUTER_LOCAL); -1 otherwise
 } ObjClosure;
 ObjClosure* newClosure(ObjFunction* function);
+// A closure that never outlives the call of the frame that creates it: no upvalues are captured
+ObjClosure* newInPlaceClosure(ObjFunction* function, int frame);
 
 
+// Methods the VM calls on its own: operator overloads, printing, subscripts and initializers
+// their names are interned once in vm.protocolNames
+typedef enum {
+    PROTOCOL_ADD,
+    PROTOCOL_SUBTRACT,
+    PROTOCOL_MULTIPLY,
+    PROTOCOL_DIVIDE,
+    PROTOCOL_LESS,
+    PROTOCOL_GREATER,
+    PROTOCOL_TO_STRING,
+    PROTOCOL_GET,
+    PROTOCOL_SET,
+    PROTOCOL_INIT,
+    PROTOCOL_COUNT
+} Protocol;
+
 // ObjClass encapsulates a user-defined Lox class
+// protocols caches which protocol methods the class implements (EMPTY_VAL if not)
+// and must be refreshed with updateProtocols whenever methods changes
 typedef struct {
     Obj obj;
     ObjString* name;
     HashTable methods;
     HashTable statics;
+    Value protocols[PROTOCOL_COUNT];
 } ObjClass;
 ObjClass* newClass(ObjString* name);
+void updateProtocols(ObjClass* klass);
+
+// ObjShapes (hidden classes) describe the field layout of ObjInstances
+// instances that get the same fields in the same order share the same shape
+// shapes form a transition tree rooted at vm.rootShape, and are never mutated once created
+typedef struct ObjShape {
+    Obj obj;
+    struct ObjShape* parent;
+    Value name;               // field added by the transition from parent
+    int count;                // number of fields
+    HashTable slots;          // field name -> slot index
+    HashTable transitions;    // field name -> child ObjShape
+} ObjShape;
+ObjShape* newShape(ObjShape* parent, Value name);
+int shapeSlot(ObjShape* shape, Value name);
+ObjShape* shapeTransition(ObjShape* shape, Value name);
 
 // ObjInstances are created when an ObjClass is called
+// field values are stored by slot, as laid out by the instance's shape
 typedef struct {
     Obj obj;
     ObjClass* klass;
-    HashTable fields;
+    ObjShape* shape;
+    Value* fields;
+    int fieldCapacity;
     uint32_t hash;
 } ObjInstance;
 ObjInstance* newInstance(ObjClass* klass);
+bool getField(ObjInstance* instance, Value name, Value* value);
+void setField(ObjInstance* instance, Value name, Value value);
+void appendField(ObjInstance* instance, ObjShape* shape, Value value);
 
 // ObjBoundMethods bind `this` and `super` to the instance where this method is accessed from
 typedef struct {
@@ -243,6 +291,7 @@ void printObject(Value value);
 #define IS_ARRAY(value)        (isObjType(value, OBJ_ARRAY))
 #define IS_ARRAY_SLICE(value)  (isObjType(value, OBJ_ARRAY_SLICE))
 #define IS_HASHMAP(value)      (isObjType(value, OBJ_HASHMAP))
+#define IS_SHAPE(value)        (isObjType(value, OBJ_SHAPE))
 
 static inline bool isObjType(Value value, ObjType type){
     return IS_OBJ(value) && (objType(AS_OBJ(value)) == type);
@@ -263,5 +312,6 @@ static inline bool isObjType(Value value, ObjType type){
 #define AS_ARRAY(value)        ((ObjArray*)AS_OBJ(value))
 #define AS_ARRAY_SLICE(value)  ((ObjArraySlice*)AS_OBJ(value))
 #define AS_HASHMAP(value)      ((ObjHashmap*)AS_OBJ(value))
+#define AS_SHAPE(value)        ((ObjShape*)AS_OBJ(value))
 
 #endif
\ No newline at end of file
@@ -0,0 +1,647 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "optimizer.h"
+#include "ir.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// The chunk is decoded into a list of instructions, rewritten in rounds until nothing changes,
+// then encoded back in place. The code only shrinks, unless a jump has to be widened to its LONG variant.
+// Instructions are removed by marking them dead; a jump to a dead instruction lands on
+// the next live one. That is only allowed where the removed code has no effect on what follows:
+// a rewrite never removes an instruction that a jump lands on, except the first of the sequence.
+
+typedef struct {
+    int start;          // offset in the original code
+    int length;
+    int line;
+    int jump;           // original offset a jump lands on
+    bool live;
+    bool target;        // a jump or a handler range lands here (recomputed every round)
+    bool rewritten;
+    uint8_t code[8];    // the instruction, if rewritten
+} Instruction;
+
+typedef struct {
+    Chunk* chunk;
+    uint8_t* code;                  // the original code
+    Instruction* instructions;
+    int count;
+    int* index;                     // original offset -> instruction starting there, or -1
+    bool changed;
+} Optimizer;
+
+
+// INSTRUCTIONS
+
+static uint8_t* bytesOf(Optimizer* optimizer, int i){
+    Instruction* instruction = &optimizer->instructions[i];
+    return instruction->rewritten ? instruction->code : optimizer->code + instruction->start;
+}
+static int opcodeOf(Optimizer* optimizer, int i){
+    // the opcode of instruction i, or -1 past the end
+    if (i >= optimizer->count) return -1;
+    return bytesOf(optimizer, i)[0];
+}
+static bool isJump(int opcode){
+    switch (opcode){
+        case OP_JUMP:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_JUMP_IF_FALSE_POP:
+        case OP_LOOP:
+        case OP_LOOP_LONG:
+        case OP_CHECK_CALLEE:
+        case OP_CHECK_CALLEE_LONG:
+            return true;
+        default:
+            return false;
+    }
+}
+static bool isLoop(int opcode){
+    return opcode == OP_LOOP || opcode == OP_LOOP_LONG;
+}
+static int shortJump(int opcode){
+    // the short form of a (possibly LONG) jump
+    switch (opcode){
+        case OP_JUMP_LONG:          return OP_JUMP;
+        case OP_JUMP_IF_FALSE_LONG: return OP_JUMP_IF_FALSE;
+        case OP_LOOP_LONG:          return OP_LOOP;
+        default:                    return opcode;
+    }
+}
+static int nextLive(Optimizer* optimizer, int i){
+    // the live instruction after i, or count
+    for (i++; i < optimizer->count && !optimizer->instructions[i].live; i++);
+    return i;
+}
+static int resolve(Optimizer* optimizer, int offset){
+    // the instruction execution continues at when it reaches the original offset
+    if (offset >= optimizer->chunk->count) return optimizer->count;
+    int i = optimizer->index[offset];
+    if (!optimizer->instructions[i].live) i = nextLive(optimizer, i);
+    return i;
+}
+static bool isFixed(Optimizer* optimizer, int i){
+    // instruction i must stay where it is: it may be reached by a jump, or bound a try block
+    if (i >= optimizer->count) return true;
+    return optimizer->instructions[i].target;
+}
+
+static void removeInstruction(Optimizer* optimizer, int i){
+    Instruction* instruction = &optimizer->instructions[i];
+    instruction->live = false;
+    if (instruction->target){
+        int next = nextLive(optimizer, i);
+        if (next < optimizer->count) optimizer->instructions[next].target = true;
+    }
+    optimizer->changed = true;
+}
+static void rewriteInstruction(Optimizer* optimizer, int i, uint8_t opcode, int operand){
+    // replaces instruction i with opcode and its one-byte operand (-1 for none)
+    Instruction* instruction = &optimizer->instructions[i];
+    instruction->code[0] = opcode;
+    instruction->length = 1;
+    if (operand >= 0) instruction->code[instruction->length++] = (uint8_t)operand;
+    instruction->rewritten = true;
+    optimizer->changed = true;
+}
+static void retarget(Optimizer* optimizer, int i, uint8_t opcode, int jump){
+    // the operands before the jump's own (OP_CHECK_CALLEE) are kept
+    Instruction* instruction = &optimizer->instructions[i];
+    memmove(instruction->code, bytesOf(optimizer, i), instruction->length);
+    instruction->code[0] = opcode;
+    instruction->length = opcodeLength(opcode);
+    instruction->jump = jump;
+    instruction->rewritten = true;
+    optimizer->changed = true;
+    // the new target must survive the rest of the round
+    int target = resolve(optimizer, jump);
+    if (target < optimizer->count) optimizer->instructions[target].target = true;
+}
+
+static void findTargets(Optimizer* optimizer){
+    for (int i = 0; i < optimizer->count; i++){
+        optimizer->instructions[i].target = false;
+    }
+    for (int i = 0; i < optimizer->count; i++){
+        Instruction* instruction = &optimizer->instructions[i];
+        if (!instruction->live) continue;
+        if (!isJump(opcodeOf(optimizer, i))) continue;
+        int target = resolve(optimizer, instruction->jump);
+        if (target < optimizer->count) optimizer->instructions[target].target = true;
+    }
+    // the code a try block guards must not merge with the code around it,
+    // and its catch block is reached from throwValue() like a jump target
+    Chunk* chunk = optimizer->chunk;
+    for (int h = 0; h < chunk->handlerCount; h++){
+        int bounds[] = {chunk->handlers[h].start, chunk->handlers[h].end, chunk->handlers[h].handler};
+        for (int b = 0; b < 3; b++){
+            int target = resolve(optimizer, bounds[b]);
+            if (target < optimizer->count) optimizer->instructions[target].target = true;
+        }
+    }
+}
+
+
+// CONSTANT FOLDING
+
+static bool literalOf(Optimizer* optimizer, int i, Value* value){
+    switch (opcodeOf(optimizer, i)){
+        case OP_CONSTANT: *value = optimizer->chunk->constants.values[bytesOf(optimizer, i)[1]]; return true;
+        case OP_CONSTANT_LONG: {
+            uint8_t* code = bytesOf(optimizer, i);
+            *value = optimizer->chunk->constants.values[code[1] << 16 | code[2] << 8 | code[3]];
+            return true;
+        }
+        case OP_NIL:      *value = NIL_VAL(); return true;
+        case OP_TRUE:     *value = BOOL_VAL(true); return true;
+        case OP_FALSE:    *value = BOOL_VAL(false); return true;
+        default:          return false;
+    }
+}
+bool sameConstant(Value a, Value b){
+    // numbers bitwise, so that 0 and -0 (and NaNs) are told apart
+    if (IS_NUMBER(a) || IS_NUMBER(b)){
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+    return valuesEqual(a, b);
+}
+static bool rewriteLiteral(Optimizer* optimizer, int i, Value value){
+    // makes instruction i push value; false if a new constant does not fit in a byte
+    if (IS_BOOL(value)){
+        rewriteInstruction(optimizer, i, AS_BOOL(value) ? OP_TRUE : OP_FALSE, -1);
+        return true;
+    }
+    if (IS_NIL(value)){
+        rewriteInstruction(optimizer, i, OP_NIL, -1);
+        return true;
+    }
+    ValueArray* constants = &optimizer->chunk->constants;
+    // constants past the first 256 cannot be used narrow, so they are not searched
+    int count = constants->count < UINT8_MAX + 1 ? constants->count : UINT8_MAX + 1;
+    int constant = 0;
+    while (constant < count && !sameConstant(constants->values[constant], value)) constant++;
+    if (constant > UINT8_MAX) return false;
+    if (constant == constants->count) addConstant(optimizer->chunk, value);
+    rewriteInstruction(optimizer, i, OP_CONSTANT, constant);
+    return true;
+}
+static bool foldUnary(int opcode, Value operand, Value* result){
+    switch (opcode){
+        case OP_NOT:
+            *result = BOOL_VAL(isFalsey(operand));
+            return true;
+        case OP_NEGATE:
+            if (!IS_NUMBER(operand)) return false;
+            *result = NUMBER_VAL(-AS_NUMBER(operand));
+            return true;
+        default:
+            return false;
+    }
+}
+static bool foldBinary(int opcode, Value a, Value b, Value* result){
+    if (opcode == OP_EQUAL){
+        *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    }
+    // anything but two numbers may be overloaded, or fail at runtime
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (opcode){
+        case OP_GREATER:  *result = BOOL_VAL(x > y); return true;
+        case OP_LESS:     *result = BOOL_VAL(x < y); return true;
+        case OP_ADD:      *result = NUMBER_VAL(x + y); return true;
+        case OP_SUBTRACT: *result = NUMBER_VAL(x - y); return true;
+        case OP_MULTIPLY: *result = NUMBER_VAL(x * y); return true;
+        case OP_DIVIDE:   *result = NUMBER_VAL(x / y); return true;
+        default:          return false;
+    }
+}
+bool foldOperator(int opcode, Value a, Value b, Value* result){
+    return foldUnary(opcode, a, result) || foldBinary(opcode, a, b, result);
+}
+static bool foldConstants(Optimizer* optimizer, int i){
+    // <literal> NEGATE/NOT, or <literal> <literal> <binary operator>, becomes one literal
+    Value a, b, result;
+    if (!literalOf(optimizer, i, &a)) return false;
+    int j = nextLive(optimizer, i);
+    if (isFixed(optimizer, j)) return false;
+    if (foldUnary(opcodeOf(optimizer, j), a, &result)){
+        if (!rewriteLiteral(optimizer, i, result)) return false;
+        removeInstruction(optimizer, j);
+        return true;
+    }
+    int k = nextLive(optimizer, j);
+    if (!literalOf(optimizer, j, &b) || isFixed(optimizer, k)) return false;
+    if (!foldBinary(opcodeOf(optimizer, k), a, b, &result)) return false;
+    if (!rewriteLiteral(optimizer, i, result)) return false;
+    removeInstruction(optimizer, j);
+    removeInstruction(optimizer, k);
+    return true;
+}
+static bool foldCondition(Optimizer* optimizer, int i){
+    // a literal tested by OP_JUMP_IF_FALSE: the jump is always or never taken
+    Value value;
+    if (!literalOf(optimizer, i, &value)) return false;
+    int j = nextLive(optimizer, i);
+    if (opcodeOf(optimizer, j) != OP_JUMP_IF_FALSE || isFixed(optimizer, j)) return false;
+    if (isFalsey(value)){
+        // the value stays for the OP_POP at the target
+        retarget(optimizer, j, OP_JUMP, optimizer->instructions[j].jump);
+        return true;
+    }
+    // pushed, not taken, popped
+    int k = nextLive(optimizer, j);
+    if (opcodeOf(optimizer, k) != OP_POP || isFixed(optimizer, k)) return false;
+    removeInstruction(optimizer, i);
+    removeInstruction(optimizer, j);
+    removeInstruction(optimizer, k);
+    return true;
+}
+
+
+// STACK TRAFFIC
+
+static bool isPurePush(int opcode){
+    // pushes one value and does nothing else
+    switch (opcode){
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_DUPLICATE:
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+        case OP_GET_UPVALUE:
+        case OP_GET_UPVALUE_LONG:
+        case OP_GET_OUTER_LOCAL:
+        case OP_GET_OUTER_LOCAL_LONG:
+            return true;
+        default:
+            return false;
+    }
+}
+static int popCount(Optimizer* optimizer, int i){
+    switch (opcodeOf(optimizer, i)){
+        case OP_POP:  return 1;
+        case OP_POPN: return bytesOf(optimizer, i)[1];
+        default:      return 0;
+    }
+}
+static bool removePushPop(Optimizer* optimizer, int i){
+    // a value popped right after it is pushed
+    if (!isPurePush(opcodeOf(optimizer, i))) return false;
+    int j = nextLive(optimizer, i);
+    if (isFixed(optimizer, j) || popCount(optimizer, j) == 0) return false;
+    removeInstruction(optimizer, i);
+    if (popCount(optimizer, j) == 1){
+        removeInstruction(optimizer, j);
+    } else {
+        rewriteInstruction(optimizer, j, OP_POPN, popCount(optimizer, j) - 1);
+    }
+    return true;
+}
+static bool mergePops(Optimizer* optimizer, int i){
+    // consecutive OP_POP/OP_POPN become one OP_POPN
+    int count = popCount(optimizer, i);
+    if (count == 0) return false;
+    int j = nextLive(optimizer, i);
+    if (isFixed(optimizer, j) || popCount(optimizer, j) == 0) return false;
+    if (count + popCount(optimizer, j) > UINT8_MAX) return false;
+    rewriteInstruction(optimizer, i, OP_POPN, count + popCount(optimizer, j));
+    removeInstruction(optimizer, j);
+    return true;
+}
+static bool removeReload(Optimizer* optimizer, int i){
+    // SET_LOCAL a; POP; GET_LOCAL a: the set leaves the value on the stack already
+    static const uint8_t reloads[][2] = {
+        {OP_SET_LOCAL, OP_GET_LOCAL},
+        {OP_SET_UPVALUE, OP_GET_UPVALUE},
+    };
+    int opcode = opcodeOf(optimizer, i);
+    int j = nextLive(optimizer, i);
+    int k = nextLive(optimizer, j);
+    if (opcodeOf(optimizer, j) != OP_POP || isFixed(optimizer, j) || isFixed(optimizer, k)) return false;
+    for (int r = 0; r < (int)(sizeof(reloads) / sizeof(reloads[0])); r++){
+        if (opcode == reloads[r][0] && opcodeOf(optimizer, k) == reloads[r][1]
+                && bytesOf(optimizer, i)[1] == bytesOf(optimizer, k)[1]){
+            removeInstruction(optimizer, j);
+            removeInstruction(optimizer, k);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// CONTROL FLOW
+
+static bool threadJump(Optimizer* optimizer, int i){
+    // a jump to a jump goes straight to where the second one goes
+    Instruction* instruction = &optimizer->instructions[i];
+    int opcode = opcodeOf(optimizer, i);
+    if (!isJump(opcode)) return false;
+    int target = resolve(optimizer, instruction->jump);
+    if (target == optimizer->count) return false;
+    int targetOpcode = shortJump(opcodeOf(optimizer, target));
+    Instruction* next = &optimizer->instructions[target];
+
+    if (!isLoop(opcode) && target == nextLive(optimizer, i)){
+        // a jump to the next instruction does nothing (OP_JUMP_IF_FALSE does not pop)
+        removeInstruction(optimizer, i);
+        return true;
+    }
+
+    // OP_JUMP_IF_FALSE leaves the value it tested, so a second test of it jumps too
+    bool follows = targetOpcode == OP_JUMP || (shortJump(opcode) == OP_JUMP_IF_FALSE && targetOpcode == OP_JUMP_IF_FALSE);
+    if (isLoop(opcode)) follows = targetOpcode == OP_LOOP;
+    if (!follows || target == i) return false;
+
+    // the jump keeps its direction, and its distance must fit the operand
+    int jump = next->jump;
+    bool forward = !isLoop(opcode);
+    if (forward ? jump <= instruction->start : jump > instruction->start) return false;
+    int distance = forward ? jump - instruction->start : instruction->start - jump;
+    if (distance > (shortJump(opcode) == opcode ? UINT16_MAX : UINT24_MAX)) return false;
+    if (jump == instruction->jump) return false;
+    retarget(optimizer, i, opcode, jump);
+    return true;
+}
+static bool removeUnreachable(Optimizer* optimizer, int i){
+    // nothing after an unconditional transfer runs until the next jump target
+    switch (opcodeOf(optimizer, i)){
+        case OP_JUMP:
+        case OP_JUMP_LONG:
+        case OP_LOOP:
+        case OP_LOOP_LONG:
+        case OP_RETURN:
+        case OP_THROW:
+            break;
+        default:
+            return false;
+    }
+    bool removed = false;
+    for (int j = nextLive(optimizer, i); !isFixed(optimizer, j); j = nextLive(optimizer, j)){
+        removeInstruction(optimizer, j);
+        removed = true;
+    }
+    return removed;
+}
+
+
+// DECODING AND ENCODING
+
+static void decode(Optimizer* optimizer){
+    Chunk* chunk = optimizer->chunk;
+    optimizer->code = malloc(chunk->count);
+    optimizer->index = malloc(sizeof(int) * chunk->count);
+    optimizer->instructions = malloc(sizeof(Instruction) * chunk->count);
+    if (optimizer->code == NULL || optimizer->index == NULL || optimizer->instructions == NULL) exit(1);
+    memcpy(optimizer->code, chunk->code, chunk->count);
+
+    optimizer->count = 0;
+    for (int offset = 0; offset < chunk->count; ){
+        int length = instructionLength(chunk, offset);
+        Instruction* instruction = &optimizer->instructions[optimizer->count];
+        instruction->start = offset;
+        instruction->length = length;
+        instruction->line = getLine(chunk, offset);
+        instruction->live = true;
+        instruction->rewritten = false;
+        instruction->jump = isJump(chunk->code[offset]) ? jumpTarget(chunk, offset) : -1;
+        for (int i = 0; i < length; i++){
+            optimizer->index[offset + i] = i == 0 ? optimizer->count : -1;
+        }
+        optimizer->count++;
+        offset += length;
+    }
+}
+static void widenJump(Optimizer* optimizer, int i){
+    // turns jump i into its LONG variant, with a three-byte operand
+    Instruction* instruction = &optimizer->instructions[i];
+    instruction->code[0] = bytesOf(optimizer, i)[0] + 1;
+    instruction->length = opcodeLength(instruction->code[0]);
+    instruction->rewritten = true;
+}
+static int layout(Optimizer* optimizer, int* newOffsets){
+    // computes where every instruction goes; returns the new length of the code
+    int count = 0;
+    for (int i = 0; i < optimizer->count; i++){
+        newOffsets[i] = count;
+        if (optimizer->instructions[i].live) count += optimizer->instructions[i].length;
+    }
+    newOffsets[optimizer->count] = count;
+    return count;
+}
+static int jumpDistance(Optimizer* optimizer, int i, int* newOffsets){
+    Instruction* instruction = &optimizer->instructions[i];
+    int end = newOffsets[i] + instruction->length;
+    int target = newOffsets[resolve(optimizer, instruction->jump)];
+    return isLoop(bytesOf(optimizer, i)[0]) ? end - target : target - end;
+}
+static void encode(Optimizer* optimizer){
+    // writes the live instructions back into the chunk
+    Chunk* chunk = optimizer->chunk;
+    int* newOffsets = malloc(sizeof(int) * (optimizer->count + 1));
+    if (newOffsets == NULL) exit(1);
+    int count;
+    bool widened;
+    do {
+        // widening a jump moves everything after it, which may push other jumps out of range
+        count = layout(optimizer, newOffsets);
+        widened = false;
+        for (int i = 0; i < optimizer->count; i++){
+            int opcode = opcodeOf(optimizer, i);
+            if (optimizer->instructions[i].live && isJump(opcode) && shortJump(opcode) == opcode
+                    && opcode != OP_JUMP_IF_FALSE_POP && opcode != OP_CHECK_CALLEE && opcode != OP_CHECK_CALLEE_LONG
+                    && jumpDistance(optimizer, i, newOffsets) > UINT16_MAX){
+                widenJump(optimizer, i);
+                widened = true;
+            }
+        }
+    } while (widened);
+    if (count > chunk->capacity){
+        int oldCapacity = chunk->capacity;
+        chunk->capacity = count;
+        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
+    }
+
+    chunk->lineCount = 0;
+    for (int i = 0; i < optimizer->count; i++){
+        Instruction* instruction = &optimizer->instructions[i];
+        if (!instruction->live) continue;
+        int offset = newOffsets[i];
+        memcpy(chunk->code + offset, bytesOf(optimizer, i), instruction->length);
+        int opcode = chunk->code[offset];
+        if (isJump(opcode)){
+            int distance = jumpDistance(optimizer, i, newOffsets);
+            // the jump operand comes last: three bytes for a LONG jump
+            bool wide = shortJump(opcode) != opcode;
+            uint8_t* operand = chunk->code + offset + instruction->length - (wide ? 3 : 2);
+            if (wide) *operand++ = (distance >> 16) & 0xff;
+            operand[0] = (distance >> 8) & 0xff;
+            operand[1] = distance & 0xff;
+        }
+        // the line table only ever merges: it fits where it was
+        if (chunk->lineCount == 0 || chunk->lines[chunk->lineCount - 1].line != instruction->line){
+            chunk->lines[chunk->lineCount].offset = offset;
+            chunk->lines[chunk->lineCount].line = instruction->line;
+            chunk->lineCount++;
+        }
+    }
+    for (int i = 0; i < chunk->cacheCount; i++){
+        chunk->caches[i].offset = newOffsets[resolve(optimizer, chunk->caches[i].offset)];
+    }
+    for (int i = 0; i < chunk->handlerCount; i++){
+        ExceptionHandler* handler = &chunk->handlers[i];
+        handler->start = newOffsets[resolve(optimizer, handler->start)];
+        handler->end = newOffsets[resolve(optimizer, handler->end)];
+        handler->handler = newOffsets[resolve(optimizer, handler->handler)];
+    }
+    for (int i = 0; i < chunk->inlinedCount; i++){
+        InlinedCall* inlined = &chunk->inlined[i];
+        inlined->start = newOffsets[resolve(optimizer, inlined->start)];
+        inlined->end = newOffsets[resolve(optimizer, inlined->end)];
+    }
+    chunk->count = count;
+    free(newOffsets);
+}
+
+static void freeOptimizer(Optimizer* optimizer){
+    free(optimizer->code);
+    free(optimizer->index);
+    free(optimizer->instructions);
+}
+
+
+// SUPERINSTRUCTIONS
+
+static bool fuse(Optimizer* optimizer, int i, const Superinstruction* fused){
+    // fuses the sequence starting at instruction i, if it matches: all on one line, with nothing jumping in
+    int parts[SUPERINSTRUCTION_PARTS_MAX];
+    int part = i;
+    for (int p = 0; p < fused->partCount; p++){
+        if (opcodeOf(optimizer, part) != fused->parts[p]) return false;
+        if (p > 0 && (isFixed(optimizer, part)
+                || optimizer->instructions[part].line != optimizer->instructions[i].line)) return false;
+        parts[p] = part;
+        part = nextLive(optimizer, part);
+    }
+
+    uint8_t code[sizeof(optimizer->instructions[i].code)];
+    int length = 0;
+    code[length++] = fused->opcode;
+    for (int p = 0; p < fused->partCount; p++){
+        Instruction* instruction = &optimizer->instructions[parts[p]];
+        memcpy(code + length, bytesOf(optimizer, parts[p]) + 1, instruction->length - 1);
+        length += instruction->length - 1;
+        if (p > 0) removeInstruction(optimizer, parts[p]);
+    }
+    Instruction* instruction = &optimizer->instructions[i];
+    memcpy(instruction->code, code, length);
+    instruction->length = length;
+    instruction->rewritten = true;
+    return true;
+}
+
+void widenJumps(Chunk* chunk, ValueArray* farJumps){
+    Optimizer optimizer;
+    optimizer.chunk = chunk;
+    decode(&optimizer);
+    // (offset, target) pairs of jumps whose operand holds a placeholder
+    for (int j = 0; j < farJumps->count; j += 2){
+        int i = optimizer.index[(int)AS_NUMBER(farJumps->values[j])];
+        optimizer.instructions[i].jump = (int)AS_NUMBER(farJumps->values[j + 1]);
+        widenJump(&optimizer, i);
+    }
+    encode(&optimizer);
+    freeOptimizer(&optimizer);
+}
+
+void fuseSuperinstructions(Chunk* chunk){
+    if (chunk->count == 0) return;
+    Optimizer optimizer;
+    optimizer.chunk = chunk;
+    decode(&optimizer);
+    findTargets(&optimizer);
+    for (int i = 0; i < optimizer.count; i = nextLive(&optimizer, i)){
+        for (int f = 0; f < superinstructionCount; f++){
+            if (fuse(&optimizer, i, &superinstructions[f])) break;
+        }
+    }
+    encode(&optimizer);
+    freeOptimizer(&optimizer);
+}
+
+
+// SSA
+
+static void lowerIr(Optimizer* optimizer, IrFunction* ir){
+    // applies what optimizeIr decided (ir.h), before the peephole rules clean up after it
+    bool loaded = true;
+    for (int i = 0; i < ir->instructionCount; i++){
+        IrInstruction* instruction = &ir->instructions[i];
+        int at = optimizer->index[instruction->offset];
+        if (instruction->rewrite == IR_LOAD_CONSTANT){
+            Value value = ir->values[irValue(ir, instruction->read)].constant;
+            loaded &= rewriteLiteral(optimizer, at, value);
+        } else if (instruction->rewrite == IR_LOAD_SLOT){
+            rewriteInstruction(optimizer, at, OP_GET_LOCAL, instruction->rewriteOperand);
+        }
+    }
+    // a store is only dead if every read of it was rewritten
+    if (!loaded) return;
+    for (int i = 0; i < ir->instructionCount; i++){
+        if (ir->instructions[i].rewrite == IR_REMOVE){
+            removeInstruction(optimizer, optimizer->index[ir->instructions[i].offset]);
+        }
+    }
+}
+
+
+// PEEPHOLE OPTIMIZATION
+
+int optimizeChunk(Chunk* chunk, int arity){
+    if (chunk->count == 0) return 0;
+    Optimizer optimizer;
+    optimizer.chunk = chunk;
+    decode(&optimizer);
+
+    IrFunction ir;
+    if (buildIr(&ir, chunk, arity)){
+        optimizeIr(&ir);
+        findTargets(&optimizer);
+        lowerIr(&optimizer, &ir);
+        freeIr(&ir);
+    }
+
+    do {
+        optimizer.changed = false;
+        findTargets(&optimizer);
+        for (int i = 0; i < optimizer.count; i = nextLive(&optimizer, i)){
+            if (!optimizer.instructions[i].live) continue;
+            // every rule starts at instruction i, in this order; the first that applies rewrites it
+            if (foldConstants(&optimizer, i)) continue;
+            if (foldCondition(&optimizer, i)) continue;
+            if (removePushPop(&optimizer, i)) continue;
+            if (mergePops(&optimizer, i)) continue;
+            if (removeReload(&optimizer, i)) continue;
+            if (threadJump(&optimizer, i)) continue;
+            removeUnreachable(&optimizer, i);
+        }
+    } while (optimizer.changed);
+
+    int before = chunk->count;
+    encode(&optimizer);
+    freeOptimizer(&optimizer);
+    return before - chunk->count;
+}
@@ -0,0 +1,27 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+// Peephole optimizer: an optional pass over the finished chunk of every compiled function
+// (vm.optimizeCode, --optimize). It first applies what the SSA form (ir.h) finds about the
+// function's locals, taking arity arguments. Then it folds literal arithmetic, threads jumps to jumps,
+// removes unreachable code and pushes that are popped right away, and merges pops.
+// Jump offsets, line information and inline cache owners are rewritten to match.
+// Returns the number of bytes removed.
+int optimizeChunk(Chunk* chunk, int arity);
+
+// Widens the jumps the compiler could not patch to their LONG variant (see patchJump).
+// farJumps holds (offset of the jump, offset it lands on) pairs.
+void widenJumps(Chunk* chunk, ValueArray* farJumps);
+
+// Replaces the sequences in the superinstruction table (chunk.h) with their fused instruction,
+// wherever no jump lands inside them. Always run by the compiler, after the optimizer.
+void fuseSuperinstructions(Chunk* chunk);
+
+// What the optimizer folds opcode (a unary or binary operator) with literal operands to; false if it does not
+bool foldOperator(int opcode, Value a, Value b, Value* result);
+// Whether a and b are the same literal: numbers compare bitwise
+bool sameConstant(Value a, Value b);
+
+#endif
@@ -8,20 +8,6 @@
 
 // PRIVATE FUNCTIONS
 
-typedef struct {
-    const char* start;
-    const char* curr;
-    int line;
-
-    // to differentiate between string interpolation ${ and {
-    // string interpolation is represented as true.
-    // bitshifting shenanigans inbound.
-    uint32_t braces;
-    uint8_t braceIdx;
-
-    bool unterminatedMultiline;
-} Scanner;
-
 Scanner scanner;
 
 // SCANNING FUNCTIONS
@@ -263,6 +249,13 @@ void initScanner(const char* source){
     scanner.unterminatedMultiline = false;
 }
 
+Scanner saveScanner(){
+    return scanner;
+}
+void restoreScanner(Scanner state){
+    scanner = state;
+}
+
 Token scanToken(){
     skipWhitespace();
     scanner.start = scanner.curr;
@@ -1,6 +1,8 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include "common.h"
+
 // Single-pass scanner:
 // every time scanToken is called, return the next token
 
@@ -43,7 +45,24 @@ typedef struct {
     int line;
 } Token;
 
+typedef struct {
+    const char* start;
+    const char* curr;
+    int line;
+
+    // to differentiate between string interpolation ${ and {
+    // string interpolation is represented as true.
+    // bitshifting shenanigans inbound.
+    uint32_t braces;
+    uint8_t braceIdx;
+
+    bool unterminatedMultiline;
+} Scanner;
+
 void initScanner(const char* source);
 Token scanToken();
+// lookahead: scan on from a saved state, then go back to it
+Scanner saveScanner();
+void restoreScanner(Scanner state);
 
 #endif
\ No newline at end of file
@@ -105,6 +105,10 @@ typedef struct {
 #endif
 
 bool valuesEqual(Value a, Value b);
+static inline bool isFalsey(Value value){
+    // returns true for false and nil
+    return (IS_NIL(value) || (IS_BOOL(value) && AS_BOOL(value) == false));
+}
 
 
 // Dynamically-resizing value array:
@@ -9,6 +9,7 @@
 #include "compiler.h"
 #include "debug.h"
 #include "io.h"
+#include "jit.h"
 #include "memory.h"
 #include "native.h"
 #include "object.h"
@@ -16,6 +17,10 @@
 
 // global variable
 VM vm;
+const char* stlSource = NULL;
+
+// the most call frames printed in a stack trace
+#define TRACE_FRAMES 64
 
 
 // VM HELPER FUNCTIONS
@@ -24,7 +29,51 @@ static void resetStack(){
     vm.frameCount = 0;
 }
 
+static void growStack(int needed){
+    // relocates the value stack so that at least needed more values fit above the stack top
+    // then moves every pointer into it: stack top, frame slots and open upvalues.
+    // their offsets are taken before realloc, as the old pointers are dead once it frees the old stack
+    int count = (int)(vm.stackTop - vm.stack);
+    int capacity = (int)(vm.stackEnd - vm.stack);
+    while (count + needed > capacity) capacity *= 2;
+
+    int upvalueCount = 0;
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) upvalueCount++;
+    ptrdiff_t* offsets = (ptrdiff_t*)malloc(sizeof(ptrdiff_t) * (vm.frameCount + upvalueCount + 1));
+    if (offsets == NULL){
+        fprintf(stderr, "Failed to grow the value stack.");
+        exit(1);
+    }
+    int o = 0;
+    for (int i = 0; i < vm.frameCount; i++){
+        offsets[o++] = vm.frames[i].slots - vm.stack;
+    }
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next){
+        offsets[o++] = upvalue->location - vm.stack;
+    }
+
+    vm.stack = (Value*)realloc(vm.stack, sizeof(Value) * capacity);
+    if (vm.stack == NULL){
+        fprintf(stderr, "Failed to grow the value stack.");
+        exit(1);
+    }
+    vm.stackTop = vm.stack + count;
+    vm.stackEnd = vm.stack + capacity;
+    o = 0;
+    for (int i = 0; i < vm.frameCount; i++){
+        vm.frames[i].slots = vm.stack + offsets[o++];
+    }
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next){
+        upvalue->location = vm.stack + offsets[o++];
+    }
+    free(offsets);
+}
+static void ensureStack(int needed){
+    if (vm.stackEnd - vm.stackTop < needed) growStack(needed);
+}
+
 void push(Value value){
+    if (vm.stackTop == vm.stackEnd) growStack(1);
     *vm.stackTop = value;
     vm.stackTop++;
 }
@@ -36,15 +85,6 @@ static Value peek(int distance){
     return vm.stackTop[-1 - distance];
 }
 
-static inline ObjFunction* getFrameFunction(CallFrame* frame){
-    if (objType(frame->function) == OBJ_FUNCTION){
-        return (ObjFunction*)frame->function;
-    } else {
-        return ((ObjClosure*)frame->function)->function;
-    }
-}
-
-
 static void runtimeError(const char* format, ...){
     // printf-style message to stderr
     va_list args;
@@ -53,13 +93,27 @@ static void runtimeError(const char* format, ...){
     va_end(args);
     fputs("\n", stderr);
 
-    // Stack trace
+    // Stack trace (innermost TRACE_FRAMES frames only)
     for (int i = vm.frameCount - 1; i >= 0; i--){
+        if (vm.frameCount - i > TRACE_FRAMES){
+            fprintf(stderr, "[... %d more frames]\n", i + 1);
+            break;
+        }
         CallFrame* frame = &vm.frames[i];
         ObjFunction* function = getFrameFunction(frame);
-        size_t instruction = frame->ip - function->chunk.code - 1;
+        Chunk* chunk = &function->chunk;
+        size_t instruction = frame->ip - chunk->code - 1;
+        int line = getLine(chunk, instruction);
 
-        fprintf(stderr, "[line %d] in ", getLine(&function->chunk, instruction));
+        // a body copied into its call has no frame: report it as if it had one
+        for (int c = 0; c < chunk->inlinedCount; c++){
+            InlinedCall* inlined = &chunk->inlined[c];
+            if ((int)instruction < inlined->start || (int)instruction >= inlined->end) continue;
+            ObjFunction* callee = AS_FUNCTION(chunk->constants.values[inlined->function]);
+            fprintf(stderr, "[line %d] in %s\n", line, callee->name->chars);
+            line = inlined->line;
+        }
+        fprintf(stderr, "[line %d] in ", line);
         if (function->name == NULL){
             fprintf(stderr, "<script>\n");
         } else {
@@ -70,31 +124,38 @@ static void runtimeError(const char* format, ...){
     resetStack();
 }
 
+static void closeUpvalues(Value* last);
 static bool throwValue(Value* payload){
     // returns true if stack recovery is successful
     // returns false for uncaught exceptions
-    int newFrameCount = 0;
-    for (int i = vm.frameCount - 1; i >= 0; i--){
+    // a run() nested in vmCall only unwinds its own frames
+    for (int i = vm.frameCount - 1; i >= vm.frameBase; i--){
         CallFrame* frame = &vm.frames[i];
-        if (getFrameFunction(frame)->fromTry){
-            newFrameCount = i;
-            break;
+        Chunk* chunk = &getFrameFunction(frame)->chunk;
+        // frame->ip is past the instruction that threw, or past the call of the frame above
+        int offset = (int)(frame->ip - chunk->code) - 1;
+        for (int h = 0; h < chunk->handlerCount; h++){
+            ExceptionHandler* handler = &chunk->handlers[h];
+            if (offset < handler->start || offset >= handler->end) continue;
+
+            // cut the stack back to the try block, and push the exception for the catch variable
+            Value exception = *payload;
+            closeUpvalues(frame->slots + handler->depth);
+            vm.frameCount = i + 1;
+            vm.stackTop = frame->slots + handler->depth;
+            push(exception);
+            frame->ip = chunk->code + handler->handler;
+            return true;
         }
     }
-    if (newFrameCount == 0){
-        runtimeError("Uncaught %s", AS_CSTRING(stringPrimitiveNative(1, payload)) );
+    if (vm.frameBase > 0){
+        // not caught inside the nested run: vmCall hands the exception to its native
+        Value exception = *payload;
+        push(exception);
         return false;
     }
-
-    // recover global variables
-    vm.stackTop = vm.frames[newFrameCount].slots;
-    vm.frameCount = newFrameCount;
-    push(*payload);
-
-    // skip over OP_POP and OP_JUMP following OP_TRY_CALL
-    vm.frames[newFrameCount - 1].ip += 4;
-
-    return true;
+    runtimeError("Uncaught %s", AS_CSTRING(stringPrimitiveNative(1, payload)) );
+    return false;
 }
 static bool runtimeException(const char* format, ...){
     // create a printf-style message to an ObjString, pushed onto the stack
@@ -134,6 +195,8 @@ static int defineNative(ImportNative native, bool isStaticMethod, const int i){
     tableSet(target, peek(1), peek(0));
     if (isStaticMethod) 
         tableSet(&AS_CLASS(peek(2))->statics, peek(1), peek(0));
+    if (target != &vm.stl) updateProtocols(AS_CLASS(peek(2)));
+    vm.cacheEpoch++;
     pop();
     pop();
     return i + 1;
@@ -153,6 +216,13 @@ static int defineSynth(ImportSynth synth, ImportInfo imports, const int i){
     return i + synth.numOfMethods + 1;
 }
 
+static void setSynthClass(int kind, const char* name){
+    Value klass;
+    if (tableGet(&vm.stl, OBJ_VAL(copyString(name, (int)strlen(name))), &klass) && IS_CLASS(klass)){
+        vm.synthClasses[kind] = AS_CLASS(klass);
+    }
+}
+
 void stl(){
     ImportInfo imports = buildSTL();
     for (int i = 0; i < imports.count; /* manual increment */ ){
@@ -164,8 +234,27 @@ void stl(){
         }
     }
     freeSTL(imports);
+    // synth classes by the kind of value they serve
+    setSynthClass(OBJ_STRING, "String");
+    setSynthClass(OBJ_NATIVE, "Function");
+    setSynthClass(OBJ_FUNCTION, "Function");
+    setSynthClass(OBJ_CLOSURE, "Function");
+    setSynthClass(OBJ_BOUND_METHOD, "Function");
+    setSynthClass(OBJ_EXCEPTION, "Exception");
+    setSynthClass(OBJ_ARRAY, "Array");
+    setSynthClass(OBJ_ARRAY_SLICE, "Slice");
+    setSynthClass(OBJ_HASHMAP, "Hashmap");
+    setSynthClass(SYNTH_BOOLEAN, "Boolean");
+    setSynthClass(SYNTH_NUMBER, "Number");
+    // bind natives and synth classes to their global slots
+    for (int i = 0; i < vm.stl.capacity; i++){
+        Entry* entry = &vm.stl.entries[i];
+        if (IS_EMPTY(entry->key)) continue;
+        int index = globalSlot(entry->key);
+        vm.globalSlots[index].stl = entry->value;
+    }
 
-    ObjFunction* stl = compile(readFile("src/stl.lox"), false);
+    ObjFunction* stl = compile(stlSource != NULL ? stlSource : readFile("src/stl.lox"), false);
     if (stl == NULL){
         fprintf(stderr, "STL failed to compile!");
         exit(74);
@@ -179,10 +268,47 @@ void stl(){
     else return;
 }
 
+// GLOBAL SLOTS
+int globalSlot(Value name){
+    // returns the slot index of global variable name, reserving an undefined slot on first use
+    Value index;
+    if (tableGet(&vm.globalIndices, name, &index)) return (int)AS_NUMBER(index);
+
+    push(name);
+    if (vm.globalCount + 1 > vm.globalCapacity){
+        int oldCapacity = vm.globalCapacity;
+        vm.globalCapacity = GROW_CAPACITY(oldCapacity);
+        vm.globalSlots = GROW_ARRAY(GlobalSlot, vm.globalSlots, oldCapacity, vm.globalCapacity);
+    }
+    GlobalSlot* slot = &vm.globalSlots[vm.globalCount];
+    slot->name = name;
+    slot->value = EMPTY_VAL();
+    slot->stl = EMPTY_VAL();
+    tableSet(&vm.globalIndices, name, NUMBER_VAL(vm.globalCount));
+    pop();
+    return vm.globalCount++;
+}
+
 // INITIALIZE/FREE VM
 void initVM(){
+    vm.frames = (CallFrame*)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+    vm.frameCapacity = FRAMES_INITIAL;
+    vm.maxFrames = FRAMES_MAX;
+    vm.stack = (Value*)malloc(sizeof(Value) * STACK_INITIAL);
+    vm.stackEnd = vm.stack + STACK_INITIAL;
+    if (vm.frames == NULL || vm.stack == NULL){
+        fprintf(stderr, "Failed to allocate the VM stacks.");
+        exit(1);
+    }
     resetStack();
     vm.initString = NIL_VAL();
+    for (int i = 0; i < PROTOCOL_COUNT; i++){
+        vm.protocolNames[i] = NIL_VAL();
+    }
+    vm.rootShape = NULL;
+    for (int i = 0; i < SYNTH_KIND_COUNT; i++){
+        vm.synthClasses[i] = NULL;
+    }
 
     // do this BEFORE anything, really
     vm.bytesAllocated = 0;
@@ -190,32 +316,66 @@ void initVM(){
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
+    vm.boundMethodPool = NULL;
+    vm.boundMethodPoolCount = 0;
 
     initTable(&vm.stl);
-    initTable(&vm.globals);
+    initTable(&vm.globalIndices);
+    vm.globalSlots = NULL;
+    vm.globalCount = 0;
+    vm.globalCapacity = 0;
     initTable(&vm.strings);
 
     vm.openUpvalues = NULL;
     vm.objects = NULL;
     vm.counter = 0;
+    vm.frameBase = 0;
+    vm.runDepth = 0;
+    vm.jitEnabled = false;    // the STL always runs in the interpreter
+    vm.optimizeCode = false;
+    vm.bytesOptimized = 0;
+    vm.cacheEpoch = 0;
+    vm.instructionHook = NULL;
+    vm.compileHook = NULL;
+    vm.safepointHook = NULL;
+    vm.budget = SAFEPOINT_INTERVAL;
+    vm.budgetInterval = SAFEPOINT_INTERVAL;
     vm.initString = OBJ_VAL(copyString("init", 4));
+    vm.protocolNames[PROTOCOL_ADD] = OBJ_VAL(copyString("add", 3));
+    vm.protocolNames[PROTOCOL_SUBTRACT] = OBJ_VAL(copyString("subtract", 8));
+    vm.protocolNames[PROTOCOL_MULTIPLY] = OBJ_VAL(copyString("multiply", 8));
+    vm.protocolNames[PROTOCOL_DIVIDE] = OBJ_VAL(copyString("divide", 6));
+    vm.protocolNames[PROTOCOL_LESS] = OBJ_VAL(copyString("less", 4));
+    vm.protocolNames[PROTOCOL_GREATER] = OBJ_VAL(copyString("greater", 7));
+    vm.protocolNames[PROTOCOL_TO_STRING] = OBJ_VAL(copyString("toString", 8));
+    vm.protocolNames[PROTOCOL_GET] = OBJ_VAL(copyString("get", 3));
+    vm.protocolNames[PROTOCOL_SET] = OBJ_VAL(copyString("set", 3));
+    vm.protocolNames[PROTOCOL_INIT] = vm.initString;
+    vm.rootShape = newShape(NULL, EMPTY_VAL());
 
     stl();
 }
 void freeVM(){
     freeTable(&vm.stl);
-    freeTable(&vm.globals);
+    freeTable(&vm.globalIndices);
+    FREE_ARRAY(GlobalSlot, vm.globalSlots, vm.globalCapacity);
+    vm.globalSlots = NULL;
+    vm.globalCount = 0;
+    vm.globalCapacity = 0;
     freeTable(&vm.strings);
     vm.initString = NIL_VAL();
+    for (int i = 0; i < PROTOCOL_COUNT; i++){
+        vm.protocolNames[i] = NIL_VAL();
+    }
     freeObjects();
+    free(vm.frames);
+    free(vm.stack);
+    vm.frames = NULL;
+    vm.stack = NULL;
 }
 
 // RUNTIME HELPER FUNCTIONS
 
-static bool isFalsey(Value value){
-    // returns true for false and nil
-    return (IS_NIL(value) || (IS_BOOL(value) && AS_BOOL(value) == false));
-}
 
 static void concatenateTwo(){
     // concatenates two strings on the stack
@@ -241,12 +401,19 @@ static bool callNative(ObjNative* native, int argCount){
         return runtimeException("<fn %s> expected %d arguments but got %d.", native->name->chars, native->arity, argCount);
     }
     int callframeCount = vm.frameCount;
+    // natives keep pointers into the stack; make sure their pushes never relocate it
+    ensureStack(STACK_RESERVE);
     Value result = (native->function)(argCount, vm.stackTop - argCount);
     if ( !IS_EMPTY(result) ){
         vm.stackTop -= (argCount + 1);
         push(result);
         return true;
     } else {
+        if (vm.frameCount == 0){
+            // a fatal error inside vmCall, already reported
+            resetStack();
+            return false;
+        }
         if (vm.frameCount != callframeCount){
             // Native function passed execution to non-native function
             return true;
@@ -255,6 +422,42 @@ static bool callNative(ObjNative* native, int argCount){
         return throwValue(vm.stackTop - 1);
     }
 }
+static bool safepoint(){
+    // the budget ran out: refill it and check in with the host
+    vm.budget = vm.budgetInterval;
+    if (vm.safepointHook == NULL || vm.safepointHook()) return true;
+    runtimeError("Script interrupted.");
+    return false;
+}
+static bool jitReady(ObjFunction* function){
+    // functions with native code run it, unless an instruction hook has to see every instruction
+    // or native code is already nested JIT_DEPTH_MAX deep on the C stack
+    if (vm.instructionHook != NULL || vm.runDepth >= JIT_DEPTH_MAX) return false;
+    if (function->jitCode != NULL) return true;
+    #ifdef VM_JIT
+    // functions are compiled on their JIT_THRESHOLD-th call
+    // top-level code always runs in the interpreter
+    if (!vm.jitEnabled || function->name == NULL) return false;
+    return ++function->callCount == JIT_THRESHOLD && jitCompile(function);
+    #else
+    return false;
+    #endif
+}
+static bool callJit(ObjFunction* function){
+    // runs the frame just pushed to completion as native code
+    // exceptions it does not catch are rethrown from here, like those of natives.
+    // that includes those its own try blocks catch: the frame then resumes at the catch in the interpreter
+    int frameIndex = vm.frameCount - 1;
+    int frameBase = vm.frameBase;
+    vm.frameBase = frameIndex + 1;
+    vm.runDepth++;
+    bool success = jitRun(function, frameIndex);
+    vm.runDepth--;
+    vm.frameBase = frameBase;
+    if (success) return true;
+    if (vm.frameCount == 0) return false;    // fatal error, already reported
+    return throwValue(vm.stackTop - 1);
+}
 static bool call(Obj* callee, ObjFunction* function, int argCount){
     // attempts to write new call frame to VM
 
@@ -262,16 +465,28 @@ static bool call(Obj* callee, ObjFunction* function, int argCount){
     if (function->arity != argCount){
         return runtimeException("<fn %s> expected %d arguments but got %d.", function->name->chars, function->arity, argCount);
     }
+    if (--vm.budget == 0 && !safepoint()) return false;
     // stack overflow fail
-    if (vm.frameCount == FRAMES_MAX){
-        runtimeError("Stack overflow.");
-        return false;
+    if (vm.frameCount == vm.frameCapacity){
+        if (vm.frameCount >= vm.maxFrames){
+            runtimeError("Stack overflow.");
+            return false;
+        }
+        int capacity = vm.frameCapacity * 2 < vm.maxFrames ? vm.frameCapacity * 2 : vm.maxFrames;
+        vm.frames = (CallFrame*)realloc(vm.frames, sizeof(CallFrame) * capacity);
+        if (vm.frames == NULL){
+            fprintf(stderr, "Failed to grow the call stack.");
+            exit(1);
+        }
+        vm.frameCapacity = capacity;
     }
+    ensureStack(STACK_RESERVE);
     // success; create new call frame
     CallFrame* frame = &vm.frames[vm.frameCount++];
     frame->function = (Obj*)callee;
     frame->ip = function->chunk.code;
     frame->slots = vm.stackTop - argCount - 1;
+    if (jitReady(function)) return callJit(function);
     return true;
 }
 static bool callFunction(ObjFunction* function, int argCount){
@@ -294,8 +509,8 @@ bool callValue(Value callee, int argCount){
                 ObjClass* klass = AS_CLASS(callee);
                 vm.stackTop[- argCount - 1] = OBJ_VAL(newInstance(klass));
                 // if there is an initializer, call that too.
-                Value initializer;
-                if (tableGet(&klass->methods, vm.initString, &initializer)){
+                Value initializer = klass->protocols[PROTOCOL_INIT];
+                if (!IS_EMPTY(initializer)){
                     return callValue(initializer, argCount);
                 } else if (argCount != 0) {
                     return runtimeException("<class %s> initializer expected 0 arguments but got %d.", klass->name->chars, argCount);
@@ -350,12 +565,39 @@ static void closeUpvalues(Value* last){
         vm.openUpvalues = upvalue->next;
     }
 }
+static uint8_t* pushClosure(CallFrame* frame, uint8_t* ip){
+    // creates the closure of the OP_CLOSURE(_LONG) at ip in frame; returns the ip past its operands
+    bool wide = *ip++ == OP_CLOSURE_LONG;
+    int constant = wide ? (ip += 3, ip[-3] << 16 | ip[-2] << 8 | ip[-1]) : *ip++;
+    ObjFunction* function = AS_FUNCTION(getFrameFunction(frame)->chunk.constants.values[constant]);
+    // an in-place closure reads the frame's locals as long as it runs (OP_GET_OUTER_LOCAL), so it captures nothing;
+    // the receiver of Array.map, filter or reduce is right below it
+    UpvalueKind kind = (UpvalueKind)*ip;
+    if (kind == UPVALUE_IN_PLACE || (kind == UPVALUE_IN_PLACE_ARRAY && IS_ARRAY(peek(0)))){
+        push(OBJ_VAL(newInPlaceClosure(function, (int)(frame - vm.frames))));
+        return ip + function->upvalueCount * (wide ? 3 : 2);
+    }
+    ObjClosure* closure = newClosure(function);
+    push(OBJ_VAL(closure));
+    for (int i = 0; i < closure->upvalueCount; i++){
+        UpvalueKind kind = (UpvalueKind)*ip++;
+        int index = wide ? (ip += 2, ip[-2] << 8 | ip[-1]) : *ip++;
+        if (kind != UPVALUE_INHERITED){
+            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+        } else {
+            closure->upvalues[i] = ((ObjClosure*)frame->function)->upvalues[index];
+        }
+    }
+    return ip;
+}
 
 
 static void defineMethod(Value name){
     Value method = peek(0);
     ObjClass* klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
+    updateProtocols(klass);
+    vm.cacheEpoch++;
     pop();
 }
 static void defineStaticMethod(Value name){
@@ -363,13 +605,99 @@ static void defineStaticMethod(Value name){
     ObjClass* klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
     tableSet(&klass->statics, name, method);
+    updateProtocols(klass);
+    vm.cacheEpoch++;
+    pop();
+}
+static bool inherit(){
+    // copies the methods of the superclass down to the subclass on the stack top, then pops the subclass
+    Value superclass = peek(1);
+    if (!IS_CLASS(superclass)){
+        return runtimeException("Superclass must be a class.");
+    }
+    ObjClass* subclass = AS_CLASS(peek(0));
+    tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+    tableAddAll(&AS_CLASS(superclass)->statics, &subclass->statics);
+    updateProtocols(subclass);
+    vm.cacheEpoch++;
+    // Pop subclass. Superclass remains as local variable.
     pop();
+    return true;
+}
+static bool inheritMultiple(){
+    // inherit() from every class of the superclass array, the first one taking precedence
+    ObjClass* subclass = AS_CLASS(peek(0));
+    ObjArray* superclassArray = AS_ARRAY(peek(1));
+    for (int i = superclassArray->data.count - 1; i >= 0; i--){
+        Value superclass = superclassArray->data.values[i];
+        if (!IS_CLASS(superclass)){
+            return runtimeException("Element must be a class for multiple inheritance.");
+        }
+        tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+        tableAddAll(&AS_CLASS(superclass)->statics, &subclass->statics);
+    }
+    updateProtocols(subclass);
+    vm.cacheEpoch++;
+    // Pop subclass. Superclass array remains as local variable.
+    pop();
+    return true;
+}
+static bool findMethod(ObjClass* klass, Value name, InlineCache* cache, Value* method){
+    // looks up a method of klass, through the inline cache of the calling instruction (if any)
+    // returns whether the method is found
+    if (cache == NULL) return tableGet(&klass->methods, name, method);
+    if (cache->epoch != vm.cacheEpoch){
+        // some class changed since this cache was filled
+        cache->epoch = vm.cacheEpoch;
+        cache->count = 0;
+    }
+    if (cache->count == INLINE_CACHE_MEGAMORPHIC) return tableGet(&klass->methods, name, method);
+
+    for (int i = 0; i < cache->count; i++){
+        if (cache->ways[i].klass == (Obj*)klass){
+            *method = cache->ways[i].method;
+            return true;
+        }
+    }
+    if (!tableGet(&klass->methods, name, method)) return false;
+    if (cache->count == INLINE_CACHE_WAYS){
+        cache->count = INLINE_CACHE_MEGAMORPHIC;
+    } else {
+        cache->ways[cache->count].klass = (Obj*)klass;
+        cache->ways[cache->count].method = *method;
+        cache->count++;
+    }
+    return true;
+}
+static int fieldSlot(ObjInstance* instance, Value name, InlineCache* cache){
+    // returns the slot of field name in instance, or -1 if it has no such field
+    // a cache hit only compares shapes
+    if (cache == NULL) return shapeSlot(instance->shape, name);
+    if (cache->shape != (Obj*)instance->shape){
+        cache->shape = (Obj*)instance->shape;
+        cache->transition = NULL;
+        cache->slot = shapeSlot(instance->shape, name);
+    }
+    return cache->slot;
+}
+static void addField(ObjInstance* instance, Value name, Value value, InlineCache* cache){
+    // adds a field the instance does not have yet, remembering the shape transition in the cache
+    // the instance and value must be reachable, as this may allocate
+    ObjShape* shape = instance->shape;
+    ObjShape* next;
+    if (cache != NULL && cache->shape == (Obj*)shape && cache->transition != NULL){
+        next = (ObjShape*)cache->transition;
+    } else {
+        next = shapeTransition(shape, name);
+        if (cache != NULL && cache->shape == (Obj*)shape) cache->transition = (Obj*)next;
+    }
+    appendField(instance, next, value);
 }
-static bool bindMethod(ObjClass* klass, Value name){
+static bool bindMethod(ObjClass* klass, Value name, InlineCache* cache){
     // returns true if method is found and bounded
     // resultant ObjBoundMethod is pushed to the stack
     Value method;
-    if (!tableGet(&klass->methods, name, &method)){
+    if (!findMethod(klass, name, cache, &method)){
         return runtimeException("Undefined property '%s'.", AS_CSTRING(name));
     }
     ObjBoundMethod* bound = newBoundMethod(peek(0), AS_OBJ(method));
@@ -378,25 +706,56 @@ static bool bindMethod(ObjClass* klass, Value name){
     return true;
 }
 
+static bool getProperty(Value name, InlineCache* cache){
+    // replaces the receiver on the stack top with its property:
+    // a field, a static method of a class, or a method bound to the receiver
+    ObjClass* klass;
+    if (IS_INSTANCE(peek(0))){
+        ObjInstance* instance = AS_INSTANCE(peek(0));
+        int slot = fieldSlot(instance, name, cache);
+        if (slot >= 0){
+            vm.stackTop[-1] = instance->fields[slot];
+            return true;
+        }
+        klass = instance->klass;
+    } else if (IS_CLASS(peek(0))){
+        // look for static method
+        // no binding required
+        Value value;
+        if (!tableGet(&AS_CLASS(peek(0))->statics, name, &value)){
+            return runtimeException("No static method of name '%s'.", AS_CSTRING(name));
+        }
+        vm.stackTop[-1] = value;
+        return true;
+    } else {
+        // look for synth class methods
+        klass = synthClass(peek(0));
+        if (klass == NULL){
+            return runtimeException("This object does not have properties.");
+        }
+    }
+    return bindMethod(klass, name, cache);
+}
 
-static bool invokeFromClass(ObjClass* klass, Value name, int argCount){
+static bool invokeFromClass(ObjClass* klass, Value name, int argCount, InlineCache* cache){
     Value method;
-    if (!tableGet(&klass->methods, name, &method)){
+    if (!findMethod(klass, name, cache, &method)){
         return runtimeException("Undefined property '%s'.", AS_CSTRING(name));
     }
     return callValue(method, argCount);
 }
-bool invoke(Value name, int argCount){
+static bool invokeCached(Value name, int argCount, InlineCache* cache){
     Value receiver = peek(argCount);
     if (IS_INSTANCE(receiver)){
         ObjInstance* instance = AS_INSTANCE(receiver);
-        Value value;
-        if (tableGet(&instance->fields, name, &value)){
+        int slot = fieldSlot(instance, name, cache);
+        if (slot >= 0){
             // treat as regular call by replacing 'this' with field
+            Value value = instance->fields[slot];
             vm.stackTop[- argCount - 1] = value;
             return callValue(value, argCount);
         }
-        return invokeFromClass(instance->klass, name, argCount);
+        return invokeFromClass(instance->klass, name, argCount, cache);
     } else if (IS_CLASS(receiver)){
         // static method
         ObjClass* klass = AS_CLASS(receiver);
@@ -411,15 +770,245 @@ bool invoke(Value name, int argCount){
         }
     } else {
         // Find synth
-        Value synth = typeNative(1, &receiver);
-        if (!IS_EMPTY(synth)){
+        ObjClass* synth = synthClass(receiver);
+        if (synth != NULL){
             // synth class found.
-            return invokeFromClass(AS_CLASS(synth), name, argCount);
+            return invokeFromClass(synth, name, argCount, cache);
         }
         // Nothing.
         return runtimeException("Object does not have methods.");
     }
 }
+bool invoke(Value name, int argCount){
+    return invokeCached(name, argCount, NULL);
+}
+
+
+static Value protocolMethod(Value value, Protocol protocol){
+    // returns the protocol method the class (or synth class) of value implements, or EMPTY_VAL
+    ObjClass* klass;
+    if (IS_INSTANCE(value)){
+        klass = AS_INSTANCE(value)->klass;
+    } else if (IS_CLASS(value)){
+        klass = AS_CLASS(value);
+    } else {
+        klass = synthClass(value);
+        if (klass == NULL) return EMPTY_VAL();
+    }
+    return klass->protocols[protocol];
+}
+static bool invokeProtocol(Protocol protocol, int argCount){
+    // invokes a protocol method on the receiver under argCount arguments
+    // instances and synth classes use their cached protocol methods
+    // anything else (classes, fields shadowing the method, missing methods) goes through invoke
+    Value receiver = peek(argCount);
+    Value name = vm.protocolNames[protocol];
+    if (IS_CLASS(receiver)) return invoke(name, argCount);
+    if (IS_INSTANCE(receiver) && shapeSlot(AS_INSTANCE(receiver)->shape, name) >= 0) return invoke(name, argCount);
+    Value method = protocolMethod(receiver, protocol);
+    if (IS_EMPTY(method)) return invoke(name, argCount);
+    return callValue(method, argCount);
+}
+// the longest number %g writes is 13 characters, as -1.23457e-308
+#define NUMBER_LENGTH_MAX 16
+
+static bool buildString(int count){
+    // replaces the count values on top of the stack with one string of them all, as print writes them:
+    // values whose class has toString are converted by it once, as String() does,
+    // and a result that is no string is formatted like other objects
+    // the string is sized once and written in place, with no string made for a number or a piece
+    int base = (int)(vm.stackTop - vm.stack) - count;
+    int length = 0;
+    for (int i = 0; i < count; i++){
+        Value method = protocolMethod(vm.stack[base + i], PROTOCOL_TO_STRING);
+        if (!IS_EMPTY(method)){
+            // the call may relocate the stack, so values are read by index
+            Value result;
+            if (!vmCallMethod(vm.stack[base + i], method, 0, NULL, &result)){
+                if (vm.frameCount == 0){
+                    // a fatal error, already reported
+                    resetStack();
+                    return false;
+                }
+                return throwValue(&result);
+            }
+            vm.stack[base + i] = result;
+        }
+        Value value = vm.stack[base + i];
+        if (IS_NUMBER(value)){
+            length += NUMBER_LENGTH_MAX;
+        } else if (IS_NIL(value)){
+            length += 3;
+        } else if (IS_BOOL(value)){
+            length += AS_BOOL(value) ? 4 : 5;
+        } else {
+            if (!IS_STRING(value)) vm.stack[base + i] = value = stringPrimitiveNative(1, &value);
+            length += AS_STRING(value)->length;
+        }
+    }
+
+    char* chars = ALLOCATE(char, length + 1);
+    char* end = chars;
+    for (int i = 0; i < count; i++){
+        Value value = vm.stack[base + i];
+        if (IS_NUMBER(value)){
+            end += snprintf(end, NUMBER_LENGTH_MAX + 1, "%g", AS_NUMBER(value));
+        } else if (IS_NIL(value)){
+            memcpy(end, "nil", 3);
+            end += 3;
+        } else if (IS_BOOL(value)){
+            end += AS_BOOL(value) ? (memcpy(end, "true", 4), 4) : (memcpy(end, "false", 5), 5);
+        } else {
+            ObjString* string = AS_STRING(value);
+            memcpy(end, string->chars, string->length);
+            end += string->length;
+        }
+    }
+    // numbers took less than their bound: give the rest back
+    int written = (int)(end - chars);
+    if (written < length) chars = GROW_ARRAY(char, chars, length + 1, written + 1);
+    chars[written] = '\0';
+
+    ObjString* result = takeString(chars, written);
+    vm.stackTop = vm.stack + base;
+    push(OBJ_VAL(result));
+    return true;
+}
+static bool tailCall(int argCount){
+    // calls the callee under argCount arguments in place of the current call frame
+    // Lox functions reuse the frame: the callee and arguments slide down over its slots
+    // everything else (natives, classes, frames catching exceptions) is a regular call
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    Value callee = peek(argCount);
+    if (IS_BOUND_METHOD(callee)){
+        vm.stackTop[- argCount - 1] = AS_BOUND_METHOD(callee)->receiver;
+        callee = OBJ_VAL(AS_BOUND_METHOD(callee)->method);
+    }
+    ObjFunction* function;
+    if (IS_CLOSURE(callee)){
+        function = AS_CLOSURE(callee)->function;
+    } else if (IS_FUNCTION(callee)){
+        function = AS_FUNCTION(callee);
+    } else {
+        return callValue(callee, argCount);
+    }
+    if (function->arity != argCount){
+        return callValue(callee, argCount);
+    }
+
+    if (--vm.budget == 0 && !safepoint()) return false;
+    closeUpvalues(frame->slots);
+    memmove(frame->slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+    vm.stackTop = frame->slots + argCount + 1;
+    frame->function = AS_OBJ(callee);
+    frame->ip = function->chunk.code;
+    return true;
+}
+static bool setGlobal(GlobalSlot* slot, bool isSTL){
+    // assigns the stack top to an already defined global; returns false if it is undefined
+    // user code may only assign its own globals, the STL only its own definitions
+    if (isSTL){
+        if (IS_EMPTY(slot->stl)) return false;
+        tableSet(&vm.stl, slot->name, peek(0));
+        slot->stl = peek(0);
+    } else {
+        if (IS_EMPTY(slot->value)) return false;
+        slot->value = peek(0);
+    }
+    return true;
+}
+
+
+// SUBSCRIPTS
+static inline int subscriptIndex(Value key, int length){
+    // returns the position of a whole-number index into length elements, counting negative
+    // indices from the end, or -1 if the key is not such an index
+    if (!IS_NUMBER(key)) return -1;
+    double number = AS_NUMBER(key);
+    if (!(number >= -length && number < length)) return -1;
+    int idx = (int)number;
+    if (idx != number) return -1;
+    return idx < 0 ? idx + length : idx;
+}
+static inline bool indexGetFast(Value receiver, Value key, Value* result){
+    // arrays, hashmaps and strings under a valid key are read in place
+    // returns false for everything else, including errors, which the get protocol reports
+    if (!IS_OBJ(receiver)) return false;
+    switch (OBJ_TYPE(receiver)){
+        case OBJ_ARRAY: {
+            ObjArray* array = AS_ARRAY(receiver);
+            int idx = subscriptIndex(key, array->data.count);
+            if (idx == -1) return false;
+            *result = array->data.values[idx];
+            return true;
+        }
+        case OBJ_HASHMAP:
+            return tableGet(&AS_HASHMAP(receiver)->data, key, result);
+        case OBJ_STRING: {
+            ObjString* str = AS_STRING(receiver);
+            int idx = subscriptIndex(key, str->length);
+            if (idx == -1) return false;
+            *result = OBJ_VAL(copyString(&str->chars[idx], 1));
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+static inline bool indexSetFast(Value receiver, Value key, Value value){
+    // arrays under a valid index and hashmaps are written in place
+    if (!IS_OBJ(receiver)) return false;
+    switch (OBJ_TYPE(receiver)){
+        case OBJ_ARRAY: {
+            ObjArray* array = AS_ARRAY(receiver);
+            int idx = subscriptIndex(key, array->data.count);
+            if (idx == -1) return false;
+            array->data.values[idx] = value;
+            return true;
+        }
+        case OBJ_HASHMAP:
+            tableSet(&AS_HASHMAP(receiver)->data, key, value);
+            return true;
+        default:
+            return false;
+    }
+}
+static bool subscriptSlice(int count, int depth){
+    // replaces the count subscript clauses lying depth values below the stack top with a slice
+    // on failure, leaves the exception on the stack top instead and returns false
+    int base = (int)(vm.stackTop - vm.stack) - depth - count;
+    push(NIL_VAL());
+    for (int i = 0; i < 3; i++){
+        push(i < count ? vm.stack[base + i] : NIL_VAL());
+    }
+    Value slice = sliceInitNative(3, vm.stackTop - 3);
+    if (IS_EMPTY(slice)){
+        vm.stackTop -= 3;
+        return false;
+    }
+    vm.stackTop -= 4;
+    vm.stack[base] = slice;
+    memmove(&vm.stack[base + 1], &vm.stack[base + count], sizeof(Value) * depth);
+    vm.stackTop -= count - 1;
+    return true;
+}
+static bool indexGet(int count){
+    // subscript get through the get protocol, for slices and receivers without a fast path
+    if (count > 1 && !subscriptSlice(count, 0)) return throwValue(vm.stackTop - 1);
+    return invokeProtocol(PROTOCOL_GET, 1);
+}
+static bool indexSet(int count){
+    // subscript set through the set protocol
+    if (count > 1 && !subscriptSlice(count, 1)) return throwValue(vm.stackTop - 1);
+    return invokeProtocol(PROTOCOL_SET, 2);
+}
+static bool indexUpdate(int count){
+    // subscript get that keeps the receiver and key beneath the value, for a following OP_INDEX_SET
+    if (count > 1 && !subscriptSlice(count, 0)) return throwValue(vm.stackTop - 1);
+    push(peek(1));
+    push(peek(1));
+    return invokeProtocol(PROTOCOL_GET, 1);
+}
 
 
 static InterpreterResult run(bool isSTL){
@@ -433,8 +1022,12 @@ static InterpreterResult run(bool isSTL){
     // Preprocessor macros for reading bytes
     #define READ_BYTE()     (*ip++)
     #define READ_SHORT()    (ip += 2, (uint16_t)ip[-2] << 8 | ip[-1])
-    #define READ_CONSTANT() (getFrameFunction(frame)->chunk.constants.values[READ_BYTE()])
-    #define READ_STRING()   (AS_STRING(READ_CONSTANT()))
+    #define READ_LONG()     (ip += 3, (uint32_t)ip[-3] << 16 | (uint32_t)ip[-2] << 8 | ip[-1])
+    // handlers shared by an instruction and its LONG variant read operands of either width
+    #define CONSTANT(index) (getFrameFunction(frame)->chunk.constants.values[index])
+    #define READ_CACHE() \
+        (ip += 2, ((uint16_t)ip[-2] << 8 | ip[-1]) == NO_INLINE_CACHE ? NULL \
+            : &getFrameFunction(frame)->chunk.caches[(uint16_t)ip[-2] << 8 | ip[-1]])
 
     #define SAVE_IP()       (frame->ip = ip)
     #define LOAD_IP() \
@@ -449,395 +1042,988 @@ static InterpreterResult run(bool isSTL){
             else LOAD_IP(); \
         } while (false)
     
-    #define BINARY_OP(valueType, op, alt)\
+    // generic binary operators quicken themselves into their number-only variant
+    // the first time they see two numbers. otherwise, they fall back to operator overloading.
+    #define BINARY_OP(valueType, op, alt, quickened)\
         do{ \
             if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))){ \
-                Value methodString = OBJ_VAL(copyString(alt, (int)strlen(alt))); \
-                THROW(invoke(methodString, 1));\
+                THROW(invokeProtocol(alt, 1));\
                 break; \
             } \
+            ip[-1] = quickened; \
             double b = AS_NUMBER(pop()); \
             double a = AS_NUMBER(pop()); \
             push(valueType(a op b)); \
         } while (false)
+    // number-only variants. if the guard fails, rewrite back to the generic opcode
+    // and dispatch that instead.
+    #define BINARY_OP_NUM(valueType, op, generic)\
+        do{ \
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))){ \
+                ip[-1] = generic; \
+                ip--; \
+                break; \
+            } \
+            double b = AS_NUMBER(pop()); \
+            vm.stackTop[-1] = valueType(AS_NUMBER(vm.stackTop[-1]) op b); \
+        } while (false)
+    // superinstructions: a binary operator on two operands read straight from the frame.
+    // anything but two numbers is pushed for operator overloading, as the unfused sequence would.
+    #define BINARY_OP_FUSED(valueType, op, alt, a, b)\
+        do{ \
+            Value left = (a); \
+            Value right = (b); \
+            if (!IS_NUMBER(left) || !IS_NUMBER(right)){ \
+                push(left); \
+                push(right); \
+                THROW(invokeProtocol(alt, 1)); \
+                break; \
+            } \
+            push(valueType(AS_NUMBER(left) op AS_NUMBER(right))); \
+        } while (false)
+
+    // Instruction dispatch:
+    // with computed gotos, every handler ends by jumping straight to the next handler
+    // through the label-address table, giving each handler its own indirect branch.
+    // otherwise, every handler jumps back to a single switch statement.
+    #ifdef VM_COMPUTED_GOTO
+    static void* handlerTable[UINT8_COUNT] = {
+        [OP_CONSTANT]         = &&TARGET_OP_CONSTANT,
+        [OP_CONSTANT_LONG]    = &&TARGET_OP_CONSTANT_LONG,
+        [OP_NIL]              = &&TARGET_OP_NIL,
+        [OP_TRUE]             = &&TARGET_OP_TRUE,
+        [OP_FALSE]            = &&TARGET_OP_FALSE,
+        [OP_DUPLICATE]        = &&TARGET_OP_DUPLICATE,
+        [OP_POP]              = &&TARGET_OP_POP,
+        [OP_POPN]             = &&TARGET_OP_POPN,
+        [OP_POP_UNDER]        = &&TARGET_OP_POP_UNDER,
+
+        [OP_DEFINE_GLOBAL]    = &&TARGET_OP_DEFINE_GLOBAL,
+        [OP_DEFINE_GLOBAL_LONG] = &&TARGET_OP_DEFINE_GLOBAL_LONG,
+        [OP_GET_GLOBAL]       = &&TARGET_OP_GET_GLOBAL,
+        [OP_GET_GLOBAL_LONG]  = &&TARGET_OP_GET_GLOBAL_LONG,
+        [OP_SET_GLOBAL]       = &&TARGET_OP_SET_GLOBAL,
+        [OP_SET_GLOBAL_LONG]  = &&TARGET_OP_SET_GLOBAL_LONG,
+        [OP_GET_GLOBAL_SLOT]  = &&TARGET_OP_GET_GLOBAL_SLOT,
+        [OP_SET_GLOBAL_SLOT]  = &&TARGET_OP_SET_GLOBAL_SLOT,
+        [OP_GET_LOCAL]        = &&TARGET_OP_GET_LOCAL,
+        [OP_GET_LOCAL_LONG]   = &&TARGET_OP_GET_LOCAL_LONG,
+        [OP_SET_LOCAL]        = &&TARGET_OP_SET_LOCAL,
+        [OP_SET_LOCAL_LONG]   = &&TARGET_OP_SET_LOCAL_LONG,
+        [OP_GET_UPVALUE]      = &&TARGET_OP_GET_UPVALUE,
+        [OP_GET_UPVALUE_LONG] = &&TARGET_OP_GET_UPVALUE_LONG,
+        [OP_SET_UPVALUE]      = &&TARGET_OP_SET_UPVALUE,
+        [OP_SET_UPVALUE_LONG] = &&TARGET_OP_SET_UPVALUE_LONG,
+        [OP_GET_OUTER_LOCAL]  = &&TARGET_OP_GET_OUTER_LOCAL,
+        [OP_GET_OUTER_LOCAL_LONG] = &&TARGET_OP_GET_OUTER_LOCAL_LONG,
+        [OP_SET_OUTER_LOCAL]  = &&TARGET_OP_SET_OUTER_LOCAL,
+        [OP_SET_OUTER_LOCAL_LONG] = &&TARGET_OP_SET_OUTER_LOCAL_LONG,
+        [OP_GET_STL]          = &&TARGET_OP_GET_STL,
+        [OP_GET_STL_LONG]     = &&TARGET_OP_GET_STL_LONG,
+
+        [OP_EQUAL]            = &&TARGET_OP_EQUAL,
+        [OP_GREATER]          = &&TARGET_OP_GREATER,
+        [OP_LESS]             = &&TARGET_OP_LESS,
+        [OP_ADD]              = &&TARGET_OP_ADD,
+        [OP_SUBTRACT]         = &&TARGET_OP_SUBTRACT,
+        [OP_MULTIPLY]         = &&TARGET_OP_MULTIPLY,
+        [OP_DIVIDE]           = &&TARGET_OP_DIVIDE,
+        [OP_NOT]              = &&TARGET_OP_NOT,
+        [OP_NEGATE]           = &&TARGET_OP_NEGATE,
+
+        [OP_GREATER_NUM]      = &&TARGET_OP_GREATER_NUM,
+        [OP_LESS_NUM]         = &&TARGET_OP_LESS_NUM,
+        [OP_ADD_NUM]          = &&TARGET_OP_ADD_NUM,
+        [OP_SUBTRACT_NUM]     = &&TARGET_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_NUM]     = &&TARGET_OP_MULTIPLY_NUM,
+        [OP_DIVIDE_NUM]       = &&TARGET_OP_DIVIDE_NUM,
+
+        [OP_PRINT]            = &&TARGET_OP_PRINT,
+        [OP_BUILD_STRING]     = &&TARGET_OP_BUILD_STRING,
+        [OP_BUILD_STRING_LONG] = &&TARGET_OP_BUILD_STRING_LONG,
+        [OP_JUMP_IF_FALSE]    = &&TARGET_OP_JUMP_IF_FALSE,
+        [OP_JUMP_IF_FALSE_LONG] = &&TARGET_OP_JUMP_IF_FALSE_LONG,
+        [OP_JUMP]             = &&TARGET_OP_JUMP,
+        [OP_JUMP_LONG]        = &&TARGET_OP_JUMP_LONG,
+        [OP_LOOP]             = &&TARGET_OP_LOOP,
+        [OP_LOOP_LONG]        = &&TARGET_OP_LOOP_LONG,
+
+        [OP_CALL]             = &&TARGET_OP_CALL,
+        [OP_CALL_LONG]        = &&TARGET_OP_CALL_LONG,
+        [OP_TAIL_CALL]        = &&TARGET_OP_TAIL_CALL,
+        [OP_TAIL_CALL_LONG]   = &&TARGET_OP_TAIL_CALL_LONG,
+        [OP_CHECK_CALLEE]     = &&TARGET_OP_CHECK_CALLEE,
+        [OP_CHECK_CALLEE_LONG] = &&TARGET_OP_CHECK_CALLEE_LONG,
+        [OP_CLOSURE]          = &&TARGET_OP_CLOSURE,
+        [OP_CLOSURE_LONG]     = &&TARGET_OP_CLOSURE_LONG,
+        [OP_CLOSE_UPVALUE]    = &&TARGET_OP_CLOSE_UPVALUE,
+        [OP_RETURN]           = &&TARGET_OP_RETURN,
+
+        [OP_THROW]            = &&TARGET_OP_THROW,
+
+        [OP_CLASS]            = &&TARGET_OP_CLASS,
+        [OP_CLASS_LONG]       = &&TARGET_OP_CLASS_LONG,
+        [OP_GET_PROPERTY]     = &&TARGET_OP_GET_PROPERTY,
+        [OP_GET_PROPERTY_LONG] = &&TARGET_OP_GET_PROPERTY_LONG,
+        [OP_SET_PROPERTY]     = &&TARGET_OP_SET_PROPERTY,
+        [OP_SET_PROPERTY_LONG] = &&TARGET_OP_SET_PROPERTY_LONG,
+        [OP_METHOD]           = &&TARGET_OP_METHOD,
+        [OP_METHOD_LONG]      = &&TARGET_OP_METHOD_LONG,
+        [OP_STATIC_METHOD]    = &&TARGET_OP_STATIC_METHOD,
+        [OP_STATIC_METHOD_LONG] = &&TARGET_OP_STATIC_METHOD_LONG,
+        [OP_INVOKE]           = &&TARGET_OP_INVOKE,
+        [OP_INVOKE_LONG]      = &&TARGET_OP_INVOKE_LONG,
+        [OP_INHERIT]          = &&TARGET_OP_INHERIT,
+        [OP_INHERIT_MULTIPLE] = &&TARGET_OP_INHERIT_MULTIPLE,
+        [OP_GET_SUPER]        = &&TARGET_OP_GET_SUPER,
+        [OP_GET_SUPER_LONG]   = &&TARGET_OP_GET_SUPER_LONG,
+        [OP_SUPER_INVOKE]     = &&TARGET_OP_SUPER_INVOKE,
+        [OP_SUPER_INVOKE_LONG] = &&TARGET_OP_SUPER_INVOKE_LONG,
+
+        [OP_INDEX_GET]        = &&TARGET_OP_INDEX_GET,
+        [OP_INDEX_SET]        = &&TARGET_OP_INDEX_SET,
+        [OP_INDEX_UPDATE]     = &&TARGET_OP_INDEX_UPDATE,
+
+        [OP_ADD_LOCAL_CONSTANT]      = &&TARGET_OP_ADD_LOCAL_CONSTANT,
+        [OP_SUBTRACT_LOCAL_CONSTANT] = &&TARGET_OP_SUBTRACT_LOCAL_CONSTANT,
+        [OP_LESS_LOCAL_CONSTANT]     = &&TARGET_OP_LESS_LOCAL_CONSTANT,
+        [OP_LESS_LOCAL_LOCAL]        = &&TARGET_OP_LESS_LOCAL_LOCAL,
+        [OP_SET_LOCAL_POP]           = &&TARGET_OP_SET_LOCAL_POP,
+        [OP_JUMP_IF_FALSE_POP]       = &&TARGET_OP_JUMP_IF_FALSE_POP
+    };
+    // handlers are reached through dispatchTable, which is refilled only when a hook is (un)installed.
+    // with a hook, every opcode first detours through HOOK_INSTRUCTION.
+    // without one, dispatchTable is a plain copy of handlerTable and the fast path is unchanged.
+    static void* dispatchTable[UINT8_COUNT];
+    static bool dispatchReady = false;
+    static bool dispatchHooked = false;
+    if (!dispatchReady || dispatchHooked != (vm.instructionHook != NULL)){
+        dispatchHooked = vm.instructionHook != NULL;
+        for (int i = 0; i < UINT8_COUNT; i++){
+            dispatchTable[i] = dispatchHooked ? &&HOOK_INSTRUCTION : handlerTable[i];
+        }
+        dispatchReady = true;
+    }
 
+    #define CASE(opcode)    TARGET_##opcode
+    #define DISPATCH()      goto *dispatchTable[instruction = READ_BYTE()]
+    #define INTERPRET_LOOP \
+        DISPATCH(); \
+        HOOK_INSTRUCTION: \
+            vm.instructionHook(frame, ip - 1); \
+            goto *handlerTable[instruction];
+    #else
+    // the portable path pays one (well-predicted) branch per instruction for the hook
+    #define CASE(opcode)    case opcode
+    #define DISPATCH()      goto loop
+    #define INTERPRET_LOOP \
+        loop: \
+            if (vm.instructionHook != NULL) vm.instructionHook(frame, ip); \
+            switch (instruction = READ_BYTE())
+    #endif
 
     // ip is the incrementer, and is changed internally
-    for (;;){
-        
-        #ifdef DEBUG_TRACE_EXECUTION
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++){
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(&getFrameFunction(frame)->chunk, 
-            (int)(ip - getFrameFunction(frame)->chunk.code));
-        #endif
-
-        // excecute instruction
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()){
-            case OP_CONSTANT:{
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
+    // every handler ends in DISPATCH() (or returns from run)
+    uint8_t instruction;
+    // operands of an instruction with a LONG variant: the LONG handler reads them wide,
+    // then jumps to BODY_<opcode>, which the narrow handler reaches right after its byte-wide reads
+    Value constantOperand;
+    int countOperand;
+    uint32_t jumpOperand;
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT): {
+            Value constant = CONSTANT(READ_BYTE());
+            push(constant);
+            DISPATCH();
+        }
+        CASE(OP_CONSTANT_LONG): {
+            Value constant = CONSTANT(READ_LONG());
+            push(constant);
+            DISPATCH();
+        }
 
-            case OP_NIL:   push(NIL_VAL()); break;
-            case OP_TRUE:  push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_DUPLICATE: {
-                push(peek(READ_BYTE()));
-                break;
-            }
-            case OP_POP:   pop(); break;
-            case OP_POPN: {
-                vm.stackTop -= READ_BYTE();
-                break;
-            }
+        CASE(OP_NIL):   push(NIL_VAL()); DISPATCH();
+        CASE(OP_TRUE):  push(BOOL_VAL(true)); DISPATCH();
+        CASE(OP_FALSE): push(BOOL_VAL(false)); DISPATCH();
+        CASE(OP_DUPLICATE): {
+            push(peek(READ_BYTE()));
+            DISPATCH();
+        }
+        CASE(OP_POP):   pop(); DISPATCH();
+        CASE(OP_POPN): {
+            vm.stackTop -= READ_BYTE();
+            DISPATCH();
+        }
+        CASE(OP_POP_UNDER): {
+            // the value on top replaces the ones under it
+            int count = READ_BYTE();
+            vm.stackTop[-1 - count] = peek(0);
+            vm.stackTop -= count;
+            DISPATCH();
+        }
 
-            case OP_DEFINE_GLOBAL: {
-                Value name = READ_CONSTANT();
-                HashTable* table = isSTL ? &vm.stl : &vm.globals;
-                tableSet(table, name, peek(0));
-                pop();
-                break;
+        CASE(OP_DEFINE_GLOBAL_LONG):
+            constantOperand = CONSTANT(READ_LONG());
+            goto BODY_OP_DEFINE_GLOBAL;
+        CASE(OP_DEFINE_GLOBAL):
+            constantOperand = CONSTANT(READ_BYTE());
+        BODY_OP_DEFINE_GLOBAL: {
+            Value name = constantOperand;
+            int index = globalSlot(name);
+            GlobalSlot* slot = &vm.globalSlots[index];
+            if (isSTL){
+                tableSet(&vm.stl, name, peek(0));
+                slot->stl = peek(0);
+            } else {
+                slot->value = peek(0);
             }
-            case OP_GET_GLOBAL: {
-                Value name = READ_CONSTANT();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value) && !tableGet(&vm.stl, name, &value)){
-                    THROW(runtimeException("Undefined variable '%s'", AS_CSTRING(name)));
-                    break;
-                }
-                push(value);
-                break;
-            }
-            case OP_SET_GLOBAL: {
-                Value name = READ_CONSTANT();
-                HashTable* table = isSTL ? &vm.stl : &vm.globals;
-                if (tableSet(table, name, peek(0))){
-                    // isNewKey returned true. cannot set undeclared global variable.
-                    tableDelete(table, name);
-                    THROW(runtimeException("Undefined variable '%s'.", AS_CSTRING(name)));
-                    break;
-                }
-                break;
-            }
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
-            }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
-            }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*((ObjClosure*)frame->function)->upvalues[slot]->location);
-                break;
+            pop();
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL_LONG):
+            constantOperand = CONSTANT(READ_LONG());
+            goto BODY_OP_GET_GLOBAL;
+        CASE(OP_GET_GLOBAL):
+            constantOperand = CONSTANT(READ_BYTE());
+        BODY_OP_GET_GLOBAL: {
+            Value name = constantOperand;
+            int index = globalSlot(name);
+            GlobalSlot* slot = &vm.globalSlots[index];
+            Value value = IS_EMPTY(slot->value) ? slot->stl : slot->value;
+            if (IS_EMPTY(value)){
+                THROW(runtimeException("Undefined variable '%s'", AS_CSTRING(name)));
+                DISPATCH();
             }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *((ObjClosure*)frame->function)->upvalues[slot]->location = peek(0);
-                break;
+            push(value);
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL_LONG):
+            constantOperand = CONSTANT(READ_LONG());
+            goto BODY_OP_SET_GLOBAL;
+        CASE(OP_SET_GLOBAL):
+            constantOperand = CONSTANT(READ_BYTE());
+        BODY_OP_SET_GLOBAL: {
+            Value name = constantOperand;
+            int index = globalSlot(name);
+            if (!setGlobal(&vm.globalSlots[index], isSTL)){
+                THROW(runtimeException("Undefined variable '%s'.", AS_CSTRING(name)));
+                DISPATCH();
             }
-            case OP_GET_STL: {
-                Value name = READ_CONSTANT();
-                Value value;
-                if (!tableGet(&vm.stl, name, &value)){
-                    SAVE_IP();
-                    runtimeError("Undefined STL identifier '%s'", AS_CSTRING(name));
-                    return INTERPRETER_RUNTIME_ERROR;
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL_SLOT): {
+            GlobalSlot* slot = &vm.globalSlots[READ_SHORT()];
+            Value value = slot->value;
+            if (IS_EMPTY(value)){
+                value = slot->stl;
+                if (IS_EMPTY(value)){
+                    THROW(runtimeException("Undefined variable '%s'", AS_CSTRING(slot->name)));
+                    DISPATCH();
                 }
-                push(value);
-                break;
             }
-
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+            push(value);
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL_SLOT): {
+            GlobalSlot* slot = &vm.globalSlots[READ_SHORT()];
+            if (!setGlobal(slot, isSTL)){
+                THROW(runtimeException("Undefined variable '%s'.", AS_CSTRING(slot->name)));
+                DISPATCH();
             }
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >, "less"); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <, "greater"); break;
-
-            case OP_ADD:      BINARY_OP(NUMBER_VAL, +, "add"); break;
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -, "subtract"); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *, "multiply"); break;
-            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /, "divide"); break;
-
-            case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))){
-                    SAVE_IP();
-                    runtimeError("Operand must be a number.");
-                    return INTERPRETER_RUNTIME_ERROR;
-                }
-                push( NUMBER_VAL( -(AS_NUMBER(pop())) ) );
-                break;
-            
-            case OP_PRINT: {
-                Value toStringName = OBJ_VAL(copyString("toString", 8));
-                push(toStringName);
-                Value toStringFunction = hasMethodNative(2, vm.stackTop - 2);
-                pop();
-                if (!IS_NIL(toStringFunction)){
-                    // call toString in separate callframe, then return to this instruction
-                    ip--;
-                    THROW(callValue(toStringFunction, 0));
-                    break;
-                }
-                printValue(pop());
-                printf("\n");
-                break;
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            push(frame->slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_LONG): {
+            uint16_t slot = READ_SHORT();
+            push(frame->slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL_LONG): {
+            uint16_t slot = READ_SHORT();
+            frame->slots[slot] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            push(*((ObjClosure*)frame->function)->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE_LONG): {
+            uint16_t slot = READ_SHORT();
+            push(*((ObjClosure*)frame->function)->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            *((ObjClosure*)frame->function)->upvalues[slot]->location = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE_LONG): {
+            uint16_t slot = READ_SHORT();
+            *((ObjClosure*)frame->function)->upvalues[slot]->location = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_OUTER_LOCAL): {
+            uint8_t upvalue = READ_BYTE();
+            uint8_t slot = READ_BYTE();
+            push(*outerLocal((ObjClosure*)frame->function, upvalue, slot));
+            DISPATCH();
+        }
+        CASE(OP_GET_OUTER_LOCAL_LONG): {
+            uint16_t upvalue = READ_SHORT();
+            uint16_t slot = READ_SHORT();
+            push(*outerLocal((ObjClosure*)frame->function, upvalue, slot));
+            DISPATCH();
+        }
+        CASE(OP_SET_OUTER_LOCAL): {
+            uint8_t upvalue = READ_BYTE();
+            uint8_t slot = READ_BYTE();
+            *outerLocal((ObjClosure*)frame->function, upvalue, slot) = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_SET_OUTER_LOCAL_LONG): {
+            uint16_t upvalue = READ_SHORT();
+            uint16_t slot = READ_SHORT();
+            *outerLocal((ObjClosure*)frame->function, upvalue, slot) = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_STL_LONG):
+            constantOperand = CONSTANT(READ_LONG());
+            goto BODY_OP_GET_STL;
+        CASE(OP_GET_STL):
+            constantOperand = CONSTANT(READ_BYTE());
+        BODY_OP_GET_STL: {
+            Value name = constantOperand;
+            Value value;
+            if (!tableGet(&vm.stl, name, &value)){
+                SAVE_IP();
+                runtimeError("Undefined STL identifier '%s'", AS_CSTRING(name));
+                return INTERPRETER_RUNTIME_ERROR;
             }
+            push(value);
+            DISPATCH();
+        }
 
-            case OP_JUMP_IF_FALSE: {
-                uint16_t jump = READ_SHORT();
-                if (isFalsey(peek(0))) ip += jump;
-                break;
-            }
-            case OP_JUMP: {
-                uint16_t jump = READ_SHORT();
-                ip += jump;
-                break;
+        CASE(OP_EQUAL): {
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER):  BINARY_OP(BOOL_VAL, >, PROTOCOL_LESS, OP_GREATER_NUM); DISPATCH();
+        CASE(OP_LESS):     BINARY_OP(BOOL_VAL, <, PROTOCOL_GREATER, OP_LESS_NUM); DISPATCH();
+
+        CASE(OP_ADD):      BINARY_OP(NUMBER_VAL, +, PROTOCOL_ADD, OP_ADD_NUM); DISPATCH();
+        CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -, PROTOCOL_SUBTRACT, OP_SUBTRACT_NUM); DISPATCH();
+        CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *, PROTOCOL_MULTIPLY, OP_MULTIPLY_NUM); DISPATCH();
+        CASE(OP_DIVIDE):   BINARY_OP(NUMBER_VAL, /, PROTOCOL_DIVIDE, OP_DIVIDE_NUM); DISPATCH();
+
+        CASE(OP_NOT):
+            push(BOOL_VAL(isFalsey(pop())));
+            DISPATCH();
+        CASE(OP_NEGATE):
+            if (!IS_NUMBER(peek(0))){
+                SAVE_IP();
+                runtimeError("Operand must be a number.");
+                return INTERPRETER_RUNTIME_ERROR;
             }
-            case OP_LOOP: {
-                uint16_t jump = READ_SHORT();
-                ip -= jump;
-                break;
+            push( NUMBER_VAL( -(AS_NUMBER(pop())) ) );
+            DISPATCH();
+
+        CASE(OP_GREATER_NUM):  BINARY_OP_NUM(BOOL_VAL, >, OP_GREATER); DISPATCH();
+        CASE(OP_LESS_NUM):     BINARY_OP_NUM(BOOL_VAL, <, OP_LESS); DISPATCH();
+
+        CASE(OP_ADD_NUM):      BINARY_OP_NUM(NUMBER_VAL, +, OP_ADD); DISPATCH();
+        CASE(OP_SUBTRACT_NUM): BINARY_OP_NUM(NUMBER_VAL, -, OP_SUBTRACT); DISPATCH();
+        CASE(OP_MULTIPLY_NUM): BINARY_OP_NUM(NUMBER_VAL, *, OP_MULTIPLY); DISPATCH();
+        CASE(OP_DIVIDE_NUM):   BINARY_OP_NUM(NUMBER_VAL, /, OP_DIVIDE); DISPATCH();
+        
+        CASE(OP_PRINT): {
+            Value toStringFunction = protocolMethod(peek(0), PROTOCOL_TO_STRING);
+            if (!IS_EMPTY(toStringFunction)){
+                // call toString in separate callframe, then return to this instruction
+                ip--;
+                THROW(callValue(toStringFunction, 0));
+                DISPATCH();
             }
-            
-            case OP_CALL: {
-                int argCount = READ_BYTE();
+            printValue(pop());
+            printf("\n");
+            DISPATCH();
+        }
+        CASE(OP_BUILD_STRING_LONG):
+            countOperand = READ_SHORT();
+            goto BODY_OP_BUILD_STRING;
+        CASE(OP_BUILD_STRING):
+            countOperand = READ_BYTE();
+        BODY_OP_BUILD_STRING:
+            THROW(buildString(countOperand));
+            DISPATCH();
+
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t jump = READ_SHORT();
+            if (isFalsey(peek(0))) ip += jump;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE_LONG): {
+            uint32_t jump = READ_LONG();
+            if (isFalsey(peek(0))) ip += jump;
+            DISPATCH();
+        }
+        CASE(OP_JUMP): {
+            uint16_t jump = READ_SHORT();
+            ip += jump;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_LONG): {
+            uint32_t jump = READ_LONG();
+            ip += jump;
+            DISPATCH();
+        }
+        CASE(OP_LOOP_LONG):
+            jumpOperand = READ_LONG();
+            goto BODY_OP_LOOP;
+        CASE(OP_LOOP):
+            jumpOperand = READ_SHORT();
+        BODY_OP_LOOP:
+            if (--vm.budget == 0){
                 SAVE_IP();
-                if (!callValue(peek(argCount), argCount)){
-                    return INTERPRETER_RUNTIME_ERROR;
-                }
-                // new call frame on stack, new register pointer
-                LOAD_IP();
-                break;
+                if (!safepoint()) return INTERPRETER_RUNTIME_ERROR;
             }
-            case OP_CLOSURE: {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
-                for (int i = 0; i < closure->upvalueCount; i++){
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal){
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = ((ObjClosure*)frame->function)->upvalues[index];
-                    }
-                }
-                break;
+            ip -= jumpOperand;
+            DISPATCH();
+        
+        CASE(OP_CALL_LONG):
+            countOperand = READ_SHORT();
+            goto BODY_OP_CALL;
+        CASE(OP_CALL):
+            countOperand = READ_BYTE();
+        BODY_OP_CALL: {
+            int argCount = countOperand;
+            SAVE_IP();
+            if (!callValue(peek(argCount), argCount)){
+                return INTERPRETER_RUNTIME_ERROR;
             }
-            case OP_CLOSE_UPVALUE: {
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
+            // new call frame on stack, new register pointer
+            LOAD_IP();
+            DISPATCH();
+        }
+        CASE(OP_CHECK_CALLEE_LONG):
+            constantOperand = CONSTANT(READ_LONG());
+            countOperand = READ_SHORT();
+            goto BODY_OP_CHECK_CALLEE;
+        CASE(OP_CHECK_CALLEE):
+            constantOperand = CONSTANT(READ_BYTE());
+            countOperand = READ_BYTE();
+        BODY_OP_CHECK_CALLEE: {
+            // guards a call the compiler inlined: jumps to its copy of the body if the callee is still that function
+            Value function = constantOperand;
+            int argCount = countOperand;
+            uint16_t jump = READ_SHORT();
+            if (valuesEqual(peek(argCount), function)) ip += jump;
+            DISPATCH();
+        }
+        CASE(OP_TAIL_CALL_LONG):
+            countOperand = READ_SHORT();
+            goto BODY_OP_TAIL_CALL;
+        CASE(OP_TAIL_CALL):
+            countOperand = READ_BYTE();
+        BODY_OP_TAIL_CALL: {
+            int argCount = countOperand;
+            SAVE_IP();
+            if (!tailCall(argCount)){
+                return INTERPRETER_RUNTIME_ERROR;
             }
-            case OP_RETURN:{
-                Value result = pop();
-                closeUpvalues(frame->slots);
-                vm.frameCount--;
-                if (vm.frameCount == 0){
-                    pop();
-                    return INTERPRETER_OK;
-                }
-                // discard call frame, restore universal variables (stack top)
-                // then push result
+            LOAD_IP();
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE):
+        CASE(OP_CLOSURE_LONG): {
+            ip = pushClosure(frame, ip - 1);
+            DISPATCH();
+        }
+        CASE(OP_CLOSE_UPVALUE): {
+            closeUpvalues(vm.stackTop - 1);
+            pop();
+            DISPATCH();
+        }
+        CASE(OP_RETURN):{
+            Value result = pop();
+            closeUpvalues(frame->slots);
+            vm.frameCount--;
+            if (vm.frameCount == vm.frameBase){
+                // returning from the bottom frame of this run: the top-level script,
+                // or the callee of vmCall, whose result replaces it on the stack
                 vm.stackTop = frame->slots;
-                push(result);
-                // update frame and ip
-                LOAD_IP();
-                break;
+                if (vm.frameBase > 0) push(result);
+                return INTERPRETER_OK;
             }
+            // discard call frame, restore universal variables (stack top)
+            // then push result
+            vm.stackTop = frame->slots;
+            push(result);
+            // update frame and ip
+            LOAD_IP();
+            DISPATCH();
+        }
 
-            case OP_TRY_CALL: {
-                SAVE_IP();
-                // No need to check for type safety
-                callValue(peek(0), 0);
-                LOAD_IP();
-                break;
-            }
-            case OP_THROW: {
-                // store ip from register to callframe (not that it matters for anything other than error reporting)
-                SAVE_IP();
-                if (throwValue(vm.stackTop - 1) == false)
-                    return INTERPRETER_RUNTIME_ERROR;
-                // new call frame on stack, new register pointer
-                LOAD_IP();
-                break;
-            }
+        CASE(OP_THROW): {
+            // store ip from register to callframe (not that it matters for anything other than error reporting)
+            SAVE_IP();
+            if (throwValue(vm.stackTop - 1) == false)
+                return INTERPRETER_RUNTIME_ERROR;
+            // new call frame on stack, new register pointer
+            LOAD_IP();
+            DISPATCH();
+        }
 
-            case OP_CLASS: {
-                ObjString* name = READ_STRING();
-                Value klass;
-                // if isSTL and class has synth counterpart, open that class
-                if (isSTL && tableGet(&vm.stl, OBJ_VAL(name), &klass)){
-                    push(klass);
-                    break;
-                }
-                push(OBJ_VAL(newClass(name)));
-                break;
+        CASE(OP_CLASS_LONG):
+            constantOperand = CONSTANT(READ_LONG());
+            goto BODY_OP_CLASS;
+        CASE(OP_CLASS):
+            constantOperand = CONSTANT(READ_BYTE());
+        BODY_OP_CLASS: {
+            ObjString* name = AS_STRING(constantOperand);
+            Value klass;
+            // if isSTL and class has synth counterpart, open that class
+            if (isSTL && tableGet(&vm.stl, OBJ_VAL(name), &klass)){
+                push(klass);
+                DISPATCH();
             }
-            case OP_GET_PROPERTY: {
-                ObjClass* klass = NULL;
-                Value name = READ_CONSTANT();
-                SAVE_IP();
-                if (IS_INSTANCE(peek(0))){
-                    // if property found, use that
-                    // else look for class methods
-                    ObjInstance* instance = AS_INSTANCE(peek(0));
-                    Value value;
-                    if (tableGet(&instance->fields, name, &value)){
-                        pop();    // Pop instance
-                        push(value);
-                        break;
-                    }
-                    klass = instance->klass;
-                } else if (IS_CLASS(peek(0))){
-                    // look for static method
-                    // no binding required
-                    Value klass = peek(0);
-                    Value value;
-                    if (tableGet(&AS_CLASS(klass)->statics, name, &value)){
-                        pop();
-                        push(value);
-                        break;
-                    } else {
-                        THROW(runtimeException("No static method of name '%s'.", AS_CSTRING(name)));
-                        break;
-                    }
-                } else {
-                    // look for synth class methods
-                    Value value = peek(0);
-                    Value synth = typeNative(1, &value);
-                    if (IS_EMPTY(synth)){
-                        THROW(runtimeException("This object does not have properties."));
-                        break;
-                    } else {
-                        klass = AS_CLASS(synth);
-                    }
-                }
-                if (!bindMethod(klass, name)){
-                    return INTERPRETER_RUNTIME_ERROR;
-                }
-                // update frame and ip
-                LOAD_IP();
-                break;
-            }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))){
-                    THROW(runtimeException("Only instances have fields."));
-                    break;
+            push(OBJ_VAL(newClass(name)));
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY_LONG):
+            constantOperand = CONSTANT(READ_LONG());
+            goto BODY_OP_GET_PROPERTY;
+        CASE(OP_GET_PROPERTY):
+            constantOperand = CONSTANT(READ_BYTE());
+        BODY_OP_GET_PROPERTY: {
+            Value name = constantOperand;
+            InlineCache* cache = READ_CACHE();
+            if (IS_INSTANCE(peek(0))){
+                ObjInstance* instance = AS_INSTANCE(peek(0));
+                int slot = fieldSlot(instance, name, cache);
+                if (slot >= 0){
+                    vm.stackTop[-1] = instance->fields[slot];
+                    DISPATCH();
                 }
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                Value name = READ_CONSTANT();
-                tableSet(&instance->fields, name, peek(0));
-                Value value = pop();
-                pop();
-                push(value);
-                break;
             }
-            case OP_METHOD: {
-                defineMethod(READ_CONSTANT());
-                break;
+            // methods, static methods and errors
+            THROW(getProperty(name, cache));
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY_LONG):
+            constantOperand = CONSTANT(READ_LONG());
+            goto BODY_OP_SET_PROPERTY;
+        CASE(OP_SET_PROPERTY):
+            constantOperand = CONSTANT(READ_BYTE());
+        BODY_OP_SET_PROPERTY: {
+            Value name = constantOperand;
+            InlineCache* cache = READ_CACHE();
+            if (!IS_INSTANCE(peek(1))){
+                THROW(runtimeException("Only instances have fields."));
+                DISPATCH();
             }
-            case OP_STATIC_METHOD: {
-                defineStaticMethod(READ_CONSTANT());
-                break;
+            ObjInstance* instance = AS_INSTANCE(peek(1));
+            int slot = fieldSlot(instance, name, cache);
+            if (slot >= 0){
+                instance->fields[slot] = peek(0);
+            } else {
+                addField(instance, name, peek(0), cache);
             }
-            case OP_INVOKE: {
-                Value method = READ_CONSTANT();
-                int argCount = READ_BYTE();
-                SAVE_IP();
-                if (!invoke(method, argCount)){
-                    return INTERPRETER_RUNTIME_ERROR;
-                }
-                // update frame and ip
-                LOAD_IP();
-                break;
+            Value value = pop();
+            pop();
+            push(value);
+            DISPATCH();
+        }
+        CASE(OP_METHOD):      defineMethod(CONSTANT(READ_BYTE())); DISPATCH();
+        CASE(OP_METHOD_LONG): defineMethod(CONSTANT(READ_LONG())); DISPATCH();
+        CASE(OP_STATIC_METHOD):      defineStaticMethod(CONSTANT(READ_BYTE())); DISPATCH();
+        CASE(OP_STATIC_METHOD_LONG): defineStaticMethod(CONSTANT(READ_LONG())); DISPATCH();
+        CASE(OP_INVOKE_LONG):
+            constantOperand = CONSTANT(READ_LONG());
+            countOperand = READ_SHORT();
+            goto BODY_OP_INVOKE;
+        CASE(OP_INVOKE):
+            constantOperand = CONSTANT(READ_BYTE());
+            countOperand = READ_BYTE();
+        BODY_OP_INVOKE: {
+            Value method = constantOperand;
+            int argCount = countOperand;
+            InlineCache* cache = READ_CACHE();
+            SAVE_IP();
+            if (!invokeCached(method, argCount, cache)){
+                return INTERPRETER_RUNTIME_ERROR;
             }
-            case OP_INHERIT: {
-                Value predecessor = peek(1);
-                if (IS_CLASS(predecessor)){
-                    ObjClass* subclass = AS_CLASS(peek(0));
-                    tableAddAll(&AS_CLASS(predecessor)->methods, &subclass->methods);
-                    tableAddAll(&AS_CLASS(predecessor)->statics, &subclass->statics);
-                    // Pop subclass. Superclass remains as local variable.
-                    pop();
-                    break;
-                } else {
-                    THROW(runtimeException("Superclass must be a class."));
-                    break;
-                }
+            // update frame and ip
+            LOAD_IP();
+            DISPATCH();
+        }
+        CASE(OP_INHERIT):          THROW(inherit()); DISPATCH();
+        CASE(OP_INHERIT_MULTIPLE): THROW(inheritMultiple()); DISPATCH();
+        CASE(OP_GET_SUPER_LONG):
+            constantOperand = CONSTANT(READ_LONG());
+            goto BODY_OP_GET_SUPER;
+        CASE(OP_GET_SUPER):
+            constantOperand = CONSTANT(READ_BYTE());
+        BODY_OP_GET_SUPER: {
+            Value name = constantOperand;
+            ObjClass* superclass = AS_CLASS(pop());
+            THROW(bindMethod(superclass, name, NULL));
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE_LONG):
+            constantOperand = CONSTANT(READ_LONG());
+            countOperand = READ_SHORT();
+            goto BODY_OP_SUPER_INVOKE;
+        CASE(OP_SUPER_INVOKE):
+            constantOperand = CONSTANT(READ_BYTE());
+            countOperand = READ_BYTE();
+        BODY_OP_SUPER_INVOKE: {
+            Value method = constantOperand;
+            int argCount = countOperand;
+            ObjClass* superclass = AS_CLASS(pop());
+            SAVE_IP();
+            if (!invokeFromClass(superclass, method, argCount, NULL)){
+                return INTERPRETER_RUNTIME_ERROR;
             }
-            case OP_INHERIT_MULTIPLE: {
-                ObjClass* subclass = AS_CLASS(peek(0));
-                ObjArray* superclassArray = AS_ARRAY(peek(1));
-                for (int i = superclassArray->data.count - 1; i >= 0; i--){
-                    Value superclass = superclassArray->data.values[i];
-                    if (!IS_CLASS(superclass)){
-                        THROW(runtimeException("Element must be a class for multiple inheritance."));
-                        break;
-                    }
-                    tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                    tableAddAll(&AS_CLASS(superclass)->statics, &subclass->statics);
-                }
-                // Pop subclass. Superclass array remains as local variable.
-                pop();
-                break;
+            LOAD_IP();
+            DISPATCH();
+        }
+
+        // subscripts read arrays, hashmaps and strings in place under a single index.
+        // slices and everything else go through the get/set protocols.
+        CASE(OP_INDEX_GET): {
+            int count = READ_BYTE();
+            Value result;
+            if (count == 1 && indexGetFast(peek(1), peek(0), &result)){
+                vm.stackTop[-2] = result;
+                vm.stackTop--;
+                DISPATCH();
             }
-            case OP_GET_SUPER: {
-                Value name = READ_CONSTANT();
-                ObjClass* superclass = AS_CLASS(pop());
-                if (!bindMethod(superclass, name)){
-                    return INTERPRETER_RUNTIME_ERROR;
-                }
-                break;
+            THROW(indexGet(count));
+            DISPATCH();
+        }
+        CASE(OP_INDEX_SET): {
+            int count = READ_BYTE();
+            if (count == 1 && indexSetFast(peek(2), peek(1), peek(0))){
+                vm.stackTop[-3] = peek(0);
+                vm.stackTop -= 2;
+                DISPATCH();
             }
-            case OP_SUPER_INVOKE: {
-                Value method = READ_CONSTANT();
-                int argCount = READ_BYTE();
-                ObjClass* superclass = AS_CLASS(pop());
-                SAVE_IP();
-                if (!invokeFromClass(superclass, method, argCount)){
-                    return INTERPRETER_RUNTIME_ERROR;
-                }
-                LOAD_IP();
-                break;
+            THROW(indexSet(count));
+            DISPATCH();
+        }
+        CASE(OP_INDEX_UPDATE): {
+            int count = READ_BYTE();
+            Value result;
+            if (count == 1 && indexGetFast(peek(1), peek(0), &result)){
+                push(result);
+                DISPATCH();
             }
-        }    // end switch
-    }        // end loop
+            THROW(indexUpdate(count));
+            DISPATCH();
+        }
+
+        CASE(OP_ADD_LOCAL_CONSTANT): {
+            uint8_t slot = READ_BYTE();
+            BINARY_OP_FUSED(NUMBER_VAL, +, PROTOCOL_ADD, frame->slots[slot], CONSTANT(READ_BYTE()));
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT_LOCAL_CONSTANT): {
+            uint8_t slot = READ_BYTE();
+            BINARY_OP_FUSED(NUMBER_VAL, -, PROTOCOL_SUBTRACT, frame->slots[slot], CONSTANT(READ_BYTE()));
+            DISPATCH();
+        }
+        CASE(OP_LESS_LOCAL_CONSTANT): {
+            uint8_t slot = READ_BYTE();
+            BINARY_OP_FUSED(BOOL_VAL, <, PROTOCOL_GREATER, frame->slots[slot], CONSTANT(READ_BYTE()));
+            DISPATCH();
+        }
+        CASE(OP_LESS_LOCAL_LOCAL): {
+            uint8_t a = READ_BYTE();
+            uint8_t b = READ_BYTE();
+            BINARY_OP_FUSED(BOOL_VAL, <, PROTOCOL_GREATER, frame->slots[a], frame->slots[b]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL_POP): {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = pop();
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE_POP): {
+            // the value stays for the POP at the jump target
+            uint16_t jump = READ_SHORT();
+            if (isFalsey(peek(0))) ip += jump;
+            else vm.stackTop--;
+            DISPATCH();
+        }
+    }    // end dispatch
+
+    // Unreachable: every handler dispatches or returns.
+    return INTERPRETER_RUNTIME_ERROR;
 
     #undef READ_BYTE
     #undef READ_SHORT
-    #undef READ_CONSTANT
-    #undef READ_STRING
+    #undef READ_LONG
+    #undef CONSTANT
+    #undef READ_CACHE
     #undef SAVE_IP
     #undef LOAD_IP
     #undef THROW
     #undef BINARY_OP
+    #undef BINARY_OP_NUM
+    #undef BINARY_OP_FUSED
+    #undef CASE
+    #undef DISPATCH
+    #undef INTERPRET_LOOP
+}
+bool vmCall(Value callee, int argCount, Value* args, Value* out){
+    return vmCallMethod(callee, callee, argCount, args, out);
+}
+bool vmCallMethod(Value receiver, Value callee, int argCount, Value* args, Value* out){
+    // calls callee with argCount arguments and receiver in its slot 0, running a nested run() until it returns.
+    // args and out may point into the value stack; they are moved along if the call relocates it.
+    int base = (int)(vm.stackTop - vm.stack);
+    bool argsOnStack = args >= vm.stack && args < vm.stackEnd;
+    bool outOnStack = out >= vm.stack && out < vm.stackEnd;
+    int argsOffset = argsOnStack ? (int)(args - vm.stack) : 0;
+    int outOffset = outOnStack ? (int)(out - vm.stack) : 0;
+
+    if (vm.runDepth >= RUN_DEPTH_MAX){
+        runtimeError("Stack overflow.");
+        vm.stackTop = vm.stack + base;
+        *out = EMPTY_VAL();
+        return false;
+    }
+    ensureStack(argCount + 1);
+    if (argsOnStack) args = vm.stack + argsOffset;
+    push(receiver);
+    for (int i = 0; i < argCount; i++){
+        push(args[i]);
+    }
+
+    int frameCount = vm.frameCount;
+    int frameBase = vm.frameBase;
+    vm.frameBase = frameCount;
+    bool success = callValue(callee, argCount);
+    if (success && vm.frameCount > frameCount){
+        vm.runDepth++;
+        success = run(false) == INTERPRETER_OK;
+        vm.runDepth--;
+    }
+    vm.frameBase = frameBase;
+
+    if (outOnStack) out = vm.stack + outOffset;
+    if (vm.frameCount == 0){
+        // fatal error, already reported. the call stack stays reset, but the value stack
+        // is left as the native had it until callNative resets it
+        vm.stackTop = vm.stack + base;
+        *out = EMPTY_VAL();
+        return false;
+    }
+    // the result (or the uncaught exception) is on top of the stack
+    *out = vm.stackTop[-1];
+    closeUpvalues(vm.stack + base);
+    vm.frameCount = frameCount;
+    vm.stackTop = vm.stack + base;
+    return success;
+}
+
+// NATIVE CODE RUNTIME: helpers called from JIT and --emit-c code (see jit.h)
+
+static bool runFrames(int base){
+    // interprets until the frame at index base returns, its result left on the stack
+    int frameBase = vm.frameBase;
+    vm.frameBase = base;
+    vm.runDepth++;
+    bool success = run(false) == INTERPRETER_OK;
+    vm.runDepth--;
+    vm.frameBase = frameBase;
+    return success;
+}
+static bool runCallee(int frameCount){
+    // finishes a call made by a helper: an interpreted callee left above frameCount runs to completion
+    return vm.frameCount == frameCount || runFrames(frameCount);
+}
+bool jitResume(int frameIndex){
+    return runFrames(frameIndex);
+}
+bool jitCall(int argCount){
+    int frameCount = vm.frameCount;
+    return callValue(peek(argCount), argCount) && runCallee(frameCount);
+}
+JitStatus jitTailCall(int argCount){
+    // a Lox callee replaces the frame in place: its ip moves to the start of the callee
+    int frameCount = vm.frameCount;
+    uint8_t* ip = vm.frames[frameCount - 1].ip;
+    if (!tailCall(argCount)) return JIT_THREW;
+    if (vm.frameCount > frameCount) return runFrames(frameCount) ? JIT_RETURNED : JIT_THREW;
+    return vm.frames[frameCount - 1].ip == ip ? JIT_RETURNED : JIT_REPLACED;
+}
+bool jitInvoke(Value name, int argCount, InlineCache* cache){
+    int frameCount = vm.frameCount;
+    return invokeCached(name, argCount, cache) && runCallee(frameCount);
+}
+bool jitSuperInvoke(Value name, int argCount){
+    int frameCount = vm.frameCount;
+    ObjClass* superclass = AS_CLASS(pop());
+    return invokeFromClass(superclass, name, argCount, NULL) && runCallee(frameCount);
+}
+bool jitSafepoint(){
+    return safepoint();
+}
+void jitClosure(uint8_t* ip){
+    pushClosure(&vm.frames[vm.frameCount - 1], ip);
+}
+void jitCloseUpvalues(Value* last){
+    closeUpvalues(last);
+}
+Value* jitOuterLocal(int upvalue, int slot){
+    return outerLocal((ObjClosure*)vm.frames[vm.frameCount - 1].function, upvalue, slot);
+}
+void jitDefineGlobal(Value name){
+    int index = globalSlot(name);
+    vm.globalSlots[index].value = peek(0);
+    pop();
+}
+bool jitGetGlobal(Value name){
+    GlobalSlot* slot = &vm.globalSlots[globalSlot(name)];
+    Value value = IS_EMPTY(slot->value) ? slot->stl : slot->value;
+    if (IS_EMPTY(value)){
+        return runtimeException("Undefined variable '%s'", AS_CSTRING(name));
+    }
+    push(value);
+    return true;
+}
+bool jitSetGlobal(Value name){
+    if (!setGlobal(&vm.globalSlots[globalSlot(name)], false)){
+        return runtimeException("Undefined variable '%s'.", AS_CSTRING(name));
+    }
+    return true;
+}
+bool jitGetStl(Value name){
+    Value value;
+    if (!tableGet(&vm.stl, name, &value)){
+        runtimeError("Undefined STL identifier '%s'", AS_CSTRING(name));
+        return false;
+    }
+    push(value);
+    return true;
+}
+bool jitOperator(Protocol protocol){
+    // a binary operator on operands that are not both numbers
+    int frameCount = vm.frameCount;
+    return invokeProtocol(protocol, 1) && runCallee(frameCount);
+}
+bool jitPrint(){
+    // the value is converted by its toString method (repeatedly) before it is printed
+    for (;;){
+        Value toStringFunction = protocolMethod(peek(0), PROTOCOL_TO_STRING);
+        if (IS_EMPTY(toStringFunction)) break;
+        int frameCount = vm.frameCount;
+        if (!callValue(toStringFunction, 0) || !runCallee(frameCount)) return false;
+    }
+    printValue(pop());
+    printf("\n");
+    return true;
+}
+bool jitBuildString(int count){
+    return buildString(count);
+}
+void jitThrow(){
+    // nothing above the frame can catch it: the native code returns JIT_THREW
+    throwValue(vm.stackTop - 1);
+}
+void jitClass(Value name){
+    push(OBJ_VAL(newClass(AS_STRING(name))));
+}
+void jitMethod(Value name, bool isStatic){
+    if (isStatic){
+        defineStaticMethod(name);
+    } else {
+        defineMethod(name);
+    }
+}
+bool jitInherit(bool multiple){
+    return multiple ? inheritMultiple() : inherit();
+}
+bool jitGetProperty(Value name, InlineCache* cache){
+    return getProperty(name, cache);
+}
+bool jitSetProperty(Value name, InlineCache* cache){
+    if (!IS_INSTANCE(peek(1))){
+        return runtimeException("Only instances have fields.");
+    }
+    ObjInstance* instance = AS_INSTANCE(peek(1));
+    int slot = fieldSlot(instance, name, cache);
+    if (slot >= 0){
+        instance->fields[slot] = peek(0);
+    } else {
+        addField(instance, name, peek(0), cache);
+    }
+    vm.stackTop[-2] = peek(0);
+    vm.stackTop--;
+    return true;
+}
+bool jitGetSuper(Value name){
+    ObjClass* superclass = AS_CLASS(pop());
+    return bindMethod(superclass, name, NULL);
+}
+bool jitIndexGet(int count){
+    Value result;
+    if (count == 1 && indexGetFast(peek(1), peek(0), &result)){
+        vm.stackTop[-2] = result;
+        vm.stackTop--;
+        return true;
+    }
+    int frameCount = vm.frameCount;
+    return indexGet(count) && runCallee(frameCount);
+}
+bool jitIndexSet(int count){
+    if (count == 1 && indexSetFast(peek(2), peek(1), peek(0))){
+        vm.stackTop[-3] = peek(0);
+        vm.stackTop -= 2;
+        return true;
+    }
+    int frameCount = vm.frameCount;
+    return indexSet(count) && runCallee(frameCount);
+}
+bool jitIndexUpdate(int count){
+    Value result;
+    if (count == 1 && indexGetFast(peek(1), peek(0), &result)){
+        push(result);
+        return true;
+    }
+    int frameCount = vm.frameCount;
+    return indexUpdate(count) && runCallee(frameCount);
+}
+
+InterpreterResult interpretFunction(ObjFunction* function){
+    // runs top-level code, which may itself run as native code
+    push(OBJ_VAL(function));
+    if (!callFunction(function, 0)) return INTERPRETER_RUNTIME_ERROR;
+    if (vm.frameCount == 0){
+        // it ran to completion as native code, which leaves its result behind
+        resetStack();
+        return INTERPRETER_OK;
+    }
+    return run(false);
 }
 InterpreterResult interpret(const char* source, bool evalExpr){
     ObjFunction* topLevelCode = compile(source, evalExpr);
     if (topLevelCode == NULL)
         return INTERPRETER_COMPILE_ERROR;
 
-    // push top-level call frame onto stack
-    push(OBJ_VAL(topLevelCode));
-    callFunction(topLevelCode, 0);
-
-    return run(false);
-}
\ No newline at end of file
+    return interpretFunction(topLevelCode);
+}
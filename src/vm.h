@@ -5,8 +5,15 @@
 #include "hashtable.h"
 #include "object.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// The call stack and value stack start small and grow (relocating) as calls nest deeper.
+// FRAMES_MAX is the default limit on call depth; vm.maxFrames can be changed after initVM.
+// Every call makes sure STACK_RESERVE values fit above the stack top, so push() rarely grows.
+#define FRAMES_INITIAL 64
+#define FRAMES_MAX (1 << 16)
+#define STACK_RESERVE (2 * UINT8_COUNT)
+#define STACK_INITIAL (FRAMES_INITIAL * UINT8_COUNT)
+// Natives calling back into Lox through vmCall nest run() on the C stack, up to RUN_DEPTH_MAX deep.
+#define RUN_DEPTH_MAX 1024
 
 typedef struct {
     // Can be ObjFunction or ObjClosure
@@ -15,21 +22,81 @@ typedef struct {
     Value* slots;
 } CallFrame;
 
+static inline ObjFunction* getFrameFunction(CallFrame* frame){
+    if (objType(frame->function) == OBJ_FUNCTION){
+        return (ObjFunction*)frame->function;
+    } else {
+        return ((ObjClosure*)frame->function)->function;
+    }
+}
+
+// Instrumentation hooks (NULL when not installed)
+// InstructionHook is called before every instruction, with ip pointing at its opcode.
+// It is picked up on entry to run(); with no hook installed the dispatch loop does no extra work.
+// CompileHook is called on every function that finishes compiling without errors.
+typedef void (*InstructionHook)(CallFrame* frame, uint8_t* ip);
+typedef void (*CompileHook)(ObjFunction* function);
+
+// Safepoints: every OP_LOOP and every call of a Lox function takes one unit of vm.budget.
+// When it runs out, the budget is refilled to vm.budgetInterval and the SafepointHook (if any) is called.
+// The stack is consistent at a safepoint, so the hook may collect garbage or yield to the host.
+// It returns false to interrupt the script, which stops with an error that cannot be caught.
+#define SAFEPOINT_INTERVAL 10000
+typedef bool (*SafepointHook)();
+
+// Global variables live in slots, resolved from their names at compile time
+// value is the user-defined global, stl the STL definition it falls back to (EMPTY_VAL if undefined)
+typedef struct {
+    Value name;
+    Value value;
+    Value stl;
+} GlobalSlot;
+
+// Synth classes hold the methods of values that are not instances
+// they are indexed by ObjType, followed by the non-object primitive kinds
+typedef enum {
+    SYNTH_BOOLEAN = OBJ_TYPE_COUNT,
+    SYNTH_NUMBER,
+    SYNTH_KIND_COUNT
+} SynthKind;
+
 typedef struct {
     // Runtime fields
-    CallFrame frames[FRAMES_MAX];
+    CallFrame* frames;
     int frameCount;
-    Value stack[STACK_MAX];
+    int frameCapacity;
+    int maxFrames;
+    Value* stack;
     Value* stackTop;
+    Value* stackEnd;
+    int frameBase;    // run() returns when frameCount drops back to this; nonzero inside vmCall
+    int runDepth;
+    bool jitEnabled;    // run hot functions as machine code (VM_JIT builds only)
+    bool optimizeCode;  // run the peephole optimizer over compiled functions (optimizer.h)
+    long bytesOptimized;    // bytes it has removed so far
     
     HashTable stl;
-    HashTable globals;
+    HashTable globalIndices;    // name -> index into globalSlots
+    GlobalSlot* globalSlots;
+    int globalCount;
+    int globalCapacity;
     HashTable strings;
     ObjUpvalue* openUpvalues;
     Obj* objects;
 
     uint16_t counter;
     Value initString;
+    Value protocolNames[PROTOCOL_COUNT];
+    ObjClass* synthClasses[SYNTH_KIND_COUNT];    // filled once in stl(), NULL if none
+    ObjShape* rootShape;
+    uint32_t cacheEpoch;
+
+    // Instrumentation fields
+    InstructionHook instructionHook;
+    CompileHook compileHook;
+    SafepointHook safepointHook;
+    int budget;            // safepoints left until the next check-in
+    int budgetInterval;
 
     // Garbage collector fields (we manage this ourselves)
     size_t bytesAllocated;
@@ -37,9 +104,28 @@ typedef struct {
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
+    ObjBoundMethod* boundMethodPool;    // freed bound methods kept for reuse, chained through method
+    int boundMethodPoolCount;
 } VM;
 
 extern VM vm;
+// source text of the STL compiled by initVM(), or NULL to read it from src/stl.lox
+extern const char* stlSource;
+
+static inline ObjClass* synthClass(Value value){
+    // returns the synth class of a value that is not an instance or class, or NULL if it has none
+    if (IS_BOOL(value)) return vm.synthClasses[SYNTH_BOOLEAN];
+    if (IS_NUMBER(value)) return vm.synthClasses[SYNTH_NUMBER];
+    if (IS_OBJ(value)) return vm.synthClasses[OBJ_TYPE(value)];
+    return NULL;
+}
+
+static inline Value* outerLocal(ObjClosure* closure, int upvalue, int slot){
+    // what OP_GET_OUTER_LOCAL and OP_SET_OUTER_LOCAL reach: the slot of the frame an in-place closure
+    // reads, or the upvalue a closure that may escape captured from it
+    if (closure->frame >= 0) return vm.frames[closure->frame].slots + slot;
+    return closure->upvalues[upvalue]->location;
+}
 
 void initVM();
 void freeVM();
@@ -47,8 +133,18 @@ void freeVM();
 void push(Value value);
 Value pop();
 bool invoke(Value name, int argCount);
+int globalSlot(Value name);
 bool callValue(Value callee, int argCount);
 
+// Calls callee with argCount arguments from args, and runs it to completion.
+// Returns true with the result in out. Returns false if the callee threw an exception
+// it did not catch, with the exception in out, or hit a fatal error (out is EMPTY_VAL).
+// The value stack may be relocated by the call: natives must not keep pointers into it
+// (their own args included) across vmCall. out is not a GC root.
+bool vmCall(Value callee, int argCount, Value* args, Value* out);
+// vmCall with receiver in the callee's slot 0 ('this' of a method), without binding the method to it
+bool vmCallMethod(Value receiver, Value callee, int argCount, Value* args, Value* out);
+
 typedef enum {
     INTERPRETER_OK,
     INTERPRETER_COMPILE_ERROR,
@@ -56,5 +152,7 @@ typedef enum {
 } InterpreterResult;
 
 InterpreterResult interpret(const char* source, bool evalExpr);
+// runs compiled top-level code (interpret() after compiling)
+InterpreterResult interpretFunction(ObjFunction* function);
 
 #endif
\ No newline at end of file